@@ -0,0 +1,335 @@
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include "../cpu.h"
+#include "../multicore.h"
+#include "../cosim.h"
+#include "../fuzz.h"
+#include "../disasm.h"
+#include "../Dans-Instruction-Set-Compiler/Lexer.h"
+#include "Suite.h"
+
+static double RunCycles(Memory& mem, const Program& program, i64 cycles, TimingModel* timing = nullptr) {
+    CPU cpu{};
+    cpu.Reset(mem);
+    cpu.timing = timing;
+
+    for (size_t i = 0; i < program.text.size(); i++)
+    {
+        mem[(Word)i] = program.text[i];
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    cpu.Execute(cycles, mem);
+    auto end = std::chrono::steady_clock::now();
+
+    return std::chrono::duration<double>(end - start).count();
+}
+
+//Runs the program on several cores for cycles each, returns wall time for the whole system
+static double RunCores(Memory& mem, const Program& program, i64 cycles, Byte coreCount) {
+    CPU boot{};
+    boot.Reset(mem);
+
+    for (size_t i = 0; i < program.text.size(); i++)
+    {
+        mem[(Word)i] = program.text[i];
+    }
+
+    MultiCore system(boot, mem, coreCount);
+    auto start = std::chrono::steady_clock::now();
+    system.Run(cycles);
+    auto end = std::chrono::steady_clock::now();
+
+    return std::chrono::duration<double>(end - start).count();
+}
+
+//Interleaves many guests on this thread through CoSim, granting each a slice of cycles in turn
+static double RunInterleaved(const Program& program, i64 cycles, size_t guestCount, i64 slice) {
+    struct Guest
+    {
+        Memory mem;
+        CPU cpu{};
+    };
+
+    std::vector<std::unique_ptr<Guest>> guests;
+    std::vector<CoSim> sims;
+    for (size_t i = 0; i < guestCount; i++) {
+        guests.emplace_back(new Guest);
+        Guest& guest = *guests.back();
+        guest.cpu.Reset(guest.mem);
+        for (size_t j = 0; j < program.text.size(); j++)
+        {
+            guest.mem[(Word)j] = program.text[j];
+        }
+        sims.push_back(Simulate(guest.cpu, guest.mem));
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (i64 granted = 0; granted < cycles; granted += slice) {
+        for (CoSim& sim : sims) {
+            sim.Resume(slice);
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    return std::chrono::duration<double>(end - start).count();
+}
+
+//Read-modify-write of a word in a fixed window
+static Program FlatWorkload() {
+    Program p;
+    Word loop = p.Here();
+    p.Emit(OP_LDM); p.Emit(1); p.EmitWord(0x2000);
+    p.Emit(OP_INC); p.Emit(1);
+    p.Emit(OP_STRM); p.Emit(1); p.EmitWord(0x2000);
+    p.Emit(OP_JMP); p.EmitWord(loop);
+    return p;
+}
+
+//Same as FlatWorkload, but switches the bank behind window 2 every iteration (pages 0x100 - 0x1FF)
+static Program BankHopWorkload() {
+    Program p;
+    p.Emit(OP_STCM | 0x80); p.Emit(0x01); p.EmitWord(Memory::IO_BASE + 2 * 2 + 1); //Window 2 bank register (high byte)
+    Word loop = p.Here();
+    p.Emit(OP_INC); p.Emit(2);
+    p.Emit(OP_STRM | 0x80); p.Emit(2); p.EmitWord(Memory::IO_BASE + 2 * 2); //Window 2 bank register (low byte)
+    p.Emit(OP_LDM); p.Emit(1); p.EmitWord(0x2000);
+    p.Emit(OP_INC); p.Emit(1);
+    p.Emit(OP_STRM); p.Emit(1); p.EmitWord(0x2000);
+    p.Emit(OP_JMP); p.EmitWord(loop);
+    return p;
+}
+
+//Alternates between two banks, hitting the same two pages over and over
+static Program BankPingPongWorkload() {
+    Program p;
+    Word loop = p.Here();
+    p.Emit(OP_STCM | 0x80); p.Emit(0x40); p.EmitWord(Memory::IO_BASE + 2 * 2);
+    p.Emit(OP_LDM); p.Emit(1); p.EmitWord(0x2000);
+    p.Emit(OP_STCM | 0x80); p.Emit(0x41); p.EmitWord(Memory::IO_BASE + 2 * 2);
+    p.Emit(OP_STRM); p.Emit(1); p.EmitWord(0x2000);
+    p.Emit(OP_JMP); p.EmitWord(loop);
+    return p;
+}
+
+static void Report(const char* name, double seconds, i64 cycles) {
+    std::cout << name << ": " << (cycles / seconds) / 1e6 << " Mcycles/s, "
+        << (seconds * 1e9) / cycles << " ns/cycle\n";
+}
+
+//Input parser for the fuzz benchmark: sums the input bytes into a buffer, returns early on a 0 byte
+static Program ParserWorkload() {
+    Program p;
+    Word loop = p.Here();
+    p.Emit(OP_JRZ); p.Emit(0); Word done = p.Here(); p.EmitWord(0); //R0: bytes left
+    p.Emit(OP_LDM | 0x80); p.Emit(2); p.EmitWord(0); Word load = p.Here() - 2; //No indirect loads: INCM walks this operand through the buffer
+    p.Emit(OP_JRZ); p.Emit(2); Word early = p.Here(); p.EmitWord(0);
+    p.Emit(OP_ADD); p.Emit(3); p.Emit(2);
+    p.Emit(OP_STRM); p.Emit(3); p.EmitWord(0x3000);
+    p.Emit(OP_INCM); p.EmitWord(load); //Lands in a code page, restored with the rest
+    p.Emit(OP_DEC); p.Emit(0);
+    p.Emit(OP_JMP); p.EmitWord(loop);
+    Word halt = p.Here();
+    p.Emit(OP_HALT);
+
+    p.text[done] = halt & 0xFF; p.text[done + 1] = halt >> 8;
+    p.text[early] = halt & 0xFF; p.text[early + 1] = halt >> 8;
+    p.text[load] = 0x00; p.text[load + 1] = 0x80; //Input buffer
+    return p;
+}
+
+//Runs random inputs through the harness, returns executions per second
+static double FuzzExecutions(const Program& program, size_t executions) {
+    Memory mem{};
+    CPU cpu{};
+    cpu.Reset(mem);
+    for (size_t i = 0; i < program.text.size(); i++)
+    {
+        mem[(Word)i] = program.text[i];
+    }
+
+    FuzzHarness fuzz(cpu, mem, 0x8000, 64, 10'000);
+    fuzz.Snapshot();
+
+    Byte input[64];
+    DWord seed = 1;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < executions; i++) {
+        seed = seed * 1664525 + 1013904223;
+        Byte size = 1 + (seed >> 24) % sizeof(input);
+        for (Byte j = 0; j < size; j++) {
+            input[j] = 1 + (Byte)((seed >> (j % 24)) % 255);
+        }
+        fuzz.Run(input, size);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    return executions / std::chrono::duration<double>(end - start).count();
+}
+
+//Random instructions of every opcode the assembler can produce, registers in range
+static std::vector<Byte> GenerateCode(size_t targetSize) {
+    std::vector<Byte> code;
+    code.reserve(targetSize + Disassembler::MAX_LENGTH);
+
+    DWord seed = 1;
+    while (code.size() < targetSize) {
+        seed = seed * 1664525 + 1013904223;
+        Byte instByte = (seed >> 24) & 0xFF;
+        const OpcodeInfo& info = OPCODES.Info(instByte);
+        if (!info.mnemonic) {
+            continue;
+        }
+
+        code.push_back(instByte);
+        for (Byte i = 0; i < info.argc; i++) {
+            seed = seed * 1664525 + 1013904223;
+            Byte size = OpcodeTable::OperandSize(info.operands[i], instByte >> 7);
+            code.push_back(size == 1 && info.operands[i] != OPERAND_VALUE ? (seed >> 24) % 4 : (seed >> 24) & 0xFF);
+            if (size == 2) {
+                code.push_back((seed >> 16) & 0xFF);
+            }
+        }
+    }
+    return code;
+}
+
+static void DisassemblerBenchmark() {
+    constexpr size_t CODE_SIZE = 16 * 1024 * 1024;
+    constexpr int RUNS = 5;
+
+    std::vector<Byte> code = GenerateCode(CODE_SIZE);
+    char text[Disassembler::MAX_TEXT];
+
+    double best = 1e30;
+    size_t instructions = 0;
+    size_t characters = 0; //Printed, so the text can't be optimized away
+    for (int i = 0; i < RUNS; i++) {
+        instructions = 0;
+        characters = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t at = 0; at < code.size(); instructions++) {
+            at += Disassembler::Disassemble(&code[at], code.size() - at, text);
+            characters += std::strlen(text);
+        }
+        auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double>(end - start).count());
+    }
+
+    std::cout << "disassembler: " << (instructions / best) / 1e6 << " M instructions/s, "
+        << instructions << " instructions, " << characters << " characters\n";
+}
+
+//Generates assembly shaped like real programs: labels, comments, registers, constants and addresses
+static std::string GenerateSource(size_t targetSize) {
+    std::string source;
+    source.reserve(targetSize + 256);
+
+    for (size_t i = 0; source.size() < targetSize; i++) {
+        source += "label_" + std::to_string(i) + ":\n";
+        source += "MOV R1 0x0004 ; Load constant into register 1\n";
+        source += "ADD R1 R2\n";
+        source += "MOV [" + std::to_string(i & 0xFFF) + "]:2 R1\n";
+        source += "JRN R1 12 label_" + std::to_string(i / 2) + "\n";
+        source += "\n";
+    }
+    return source;
+}
+
+static void LexerBenchmark() {
+    constexpr size_t SOURCE_SIZE = 64 * 1024 * 1024;
+    constexpr int RUNS = 5;
+
+    std::string source = GenerateSource(SOURCE_SIZE);
+    TokenStream stream;
+
+    double best = 1e30;
+    for (int i = 0; i < RUNS; i++) {
+        auto start = std::chrono::steady_clock::now();
+        Lex(source, stream);
+        auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double>(end - start).count());
+    }
+
+    std::cout << "lexer: " << (source.size() / best) / (1024 * 1024) << " MB/s, "
+        << stream.tokens.size() << " tokens, " << stream.symbols.names.size() << " symbols\n";
+}
+
+//Benchmarks runs the host side benchmarks below. Benchmarks --suite [--csv=results.csv] [--baseline=baseline.csv] [--tolerance=10] [--rss-tolerance=1024]
+//runs the standard guest workloads instead (see Suite.h): save a baseline with --csv, then compare later builds against it
+int main(int argc, char** argv)
+{
+    bool suite = false;
+    const char* csvPath = nullptr;
+    const char* baselinePath = nullptr;
+    double tolerance = Suite::DEFAULT_TOLERANCE;
+    uint64_t rssTolerance = Suite::DEFAULT_RSS_TOLERANCE;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--suite") == 0) {
+            suite = true;
+        }
+        else if (std::strncmp(argv[i], "--csv=", 6) == 0) {
+            csvPath = argv[i] + 6;
+        }
+        else if (std::strncmp(argv[i], "--baseline=", 11) == 0) {
+            baselinePath = argv[i] + 11;
+        }
+        else if (std::strncmp(argv[i], "--tolerance=", 12) == 0) {
+            tolerance = std::atof(argv[i] + 12);
+        }
+        else if (std::strncmp(argv[i], "--rss-tolerance=", 16) == 0) {
+            rssTolerance = std::strtoull(argv[i] + 16, nullptr, 10);
+        }
+        else {
+            std::cout << "WARNING: Unknown option " << argv[i] << "\n";
+        }
+    }
+    if (suite) {
+        return Suite::RunAll(csvPath, baselinePath, tolerance, rssTolerance);
+    }
+
+    constexpr i64 CYCLES = 200'000'000;
+    constexpr DWord EXTENDED_SIZE = 4 * 1024 * 1024;
+
+    {
+        Memory mem{};
+        Report("flat (64 KiB)", RunCycles(mem, FlatWorkload(), CYCLES), CYCLES);
+    }
+    {
+        Memory mem(EXTENDED_SIZE);
+        Report("flat (4 MiB)", RunCycles(mem, FlatWorkload(), CYCLES), CYCLES);
+    }
+    {
+        Memory mem{};
+        TimingModel timing;
+        Report("flat (64 KiB, timing model)", RunCycles(mem, FlatWorkload(), CYCLES, &timing), CYCLES);
+    }
+    for (Byte cores : { 2, 4 }) {
+        Memory mem{};
+        std::string name = "flat x" + std::to_string(cores) + " cores (64 KiB, all cores)";
+        Report(name.c_str(), RunCores(mem, FlatWorkload(), CYCLES, cores), CYCLES * cores);
+    }
+    {
+        constexpr size_t GUESTS = 1000;
+        Report("cosim x1000 guests (one thread, 10k cycle slices)", RunInterleaved(FlatWorkload(), CYCLES / GUESTS, GUESTS, 10'000), CYCLES);
+    }
+    {
+        Memory mem(EXTENDED_SIZE);
+        Report("bank hop (4 MiB)", RunCycles(mem, BankHopWorkload(), CYCLES), CYCLES);
+    }
+    {
+        Memory mem(EXTENDED_SIZE);
+        Report("bank ping-pong (4 MiB)", RunCycles(mem, BankPingPongWorkload(), CYCLES), CYCLES);
+    }
+    {
+        constexpr size_t EXECUTIONS = 1'000'000;
+        std::cout << "fuzz (input parser, snapshot reset): " << FuzzExecutions(ParserWorkload(), EXECUTIONS) << " executions/s\n";
+    }
+
+    LexerBenchmark();
+    DisassemblerBenchmark();
+}
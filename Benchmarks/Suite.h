@@ -0,0 +1,405 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "../cpu.h"
+#include "../dma.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#include <Psapi.h>
+#elif defined(__APPLE__)
+#include <mach/mach.h>
+#else
+#include <unistd.h>
+#endif
+
+//Guest code built byte by byte, loaded at address 0
+struct Program
+{
+    std::vector<Byte> text;
+
+    Word Here() const {
+        return (Word)text.size();
+    }
+    void Emit(Byte value) {
+        text.push_back(value);
+    }
+    void EmitWord(Word value) {
+        text.push_back(value & 0xFF); //Little endian system
+        text.push_back(value >> 8);
+    }
+    //Fills in a forward reference emitted as a placeholder word
+    void PatchWord(Word at, Word value) {
+        text[at] = value & 0xFF;
+        text[at + 1] = value >> 8;
+    }
+};
+
+/*
+    Standard guest workloads, run by "Benchmarks --suite"
+
+    Each workload runs from a fresh CPU and memory for SUITE_CYCLES guest cycles, SUITE_RUNS times, and the
+    median run is kept. Runs take turns across the workloads, so a slow spell on a busy machine costs every
+    workload a run instead of one workload all of them. Results are written as CSV, one row per workload:
+
+        workload,instructions,cycles,seconds,ns_per_instruction,mips,cycles_per_second,rss_kib
+
+    rss_kib is how far the resident set grew from before a run created its CPU and memory to the end of the
+    run, the largest over the workload's runs, so earlier workloads and reading the baseline don't count
+    against it.
+    Given a baseline (a CSV written by an earlier run on the same machine), a workload whose ns per
+    instruction is more than the tolerance (percent) above the baseline's, or whose RSS is more than the
+    RSS tolerance (KiB) above it, is a regression, and the suite exits with 1
+*/
+namespace Suite
+{
+    constexpr i64 SUITE_CYCLES = 200'000'000;
+    constexpr int SUITE_RUNS = 7; //Odd, so the median is a real run
+    constexpr double DEFAULT_TOLERANCE = 10.0; //Percent
+    constexpr uint64_t DEFAULT_RSS_TOLERANCE = 1024; //KiB, a workload's growth is a few pages so a percentage of it is noise
+
+    //Integer ALU work in a counted loop, the INC/JRN loop of the emulator's demo with a body
+    static Program ArithmeticWorkload() {
+        Program p;
+        Word outer = p.Here();
+        p.Emit(OP_LDC); p.Emit(0); p.EmitWord(0);
+        Word loop = p.Here();
+        p.Emit(OP_ADD); p.Emit(1); p.Emit(0);
+        p.Emit(OP_SUBC); p.Emit(2); p.EmitWord(3);
+        p.Emit(OP_MUL); p.Emit(3); p.Emit(1);
+        p.Emit(OP_MULC); p.Emit(4); p.EmitWord(7);
+        p.Emit(OP_DIVC); p.Emit(4); p.EmitWord(3);
+        p.Emit(OP_ADD); p.Emit(5); p.Emit(4);
+        p.Emit(OP_INC); p.Emit(0);
+        p.Emit(OP_JRN); p.Emit(0); p.EmitWord(0x1000); p.EmitWord(loop);
+        p.Emit(OP_JMP); p.EmitWord(outer);
+        return p;
+    }
+
+    //Byte by byte copy of 256 bytes from 0x4000 to 0x6000. There are no indirect loads, so INCM walks the
+    //load and store operands through the buffers and the outer loop puts them back
+    static Program MemoryCopyWorkload() {
+        Program p;
+        Word start = p.Here();
+        p.Emit(OP_LDC); p.Emit(0); p.EmitWord(0x100);
+        p.Emit(OP_STCM); p.EmitWord(0x4000); Word resetSource = p.Here(); p.EmitWord(0);
+        p.Emit(OP_STCM); p.EmitWord(0x6000); Word resetDestination = p.Here(); p.EmitWord(0);
+        Word copy = p.Here();
+        p.Emit(OP_LDM | 0x80); p.Emit(1); Word source = p.Here(); p.EmitWord(0x4000);
+        p.Emit(OP_STRM | 0x80); p.Emit(1); Word destination = p.Here(); p.EmitWord(0x6000);
+        p.Emit(OP_INCM); p.EmitWord(source);
+        p.Emit(OP_INCM); p.EmitWord(destination);
+        p.Emit(OP_DEC); p.Emit(0);
+        p.Emit(OP_JRN); p.Emit(0); p.EmitWord(0); p.EmitWord(copy);
+        p.Emit(OP_JMP); p.EmitWord(start);
+
+        p.PatchWord(resetSource, source);
+        p.PatchWord(resetDestination, destination);
+        return p;
+    }
+
+    //Naive recursive Fibonacci of 12, R0 -> R1, calling through JSR/RTN with the stack holding the locals
+    static Program RecursionWorkload() {
+        Program p;
+        Word main = p.Here();
+        p.Emit(OP_LDC); p.Emit(0); p.EmitWord(12);
+        p.Emit(OP_JSR); Word call = p.Here(); p.EmitWord(0);
+        p.Emit(OP_JMP); p.EmitWord(main);
+
+        Word fib = p.Here();
+        p.Emit(OP_JRL); p.Emit(0); p.EmitWord(2); Word toBase = p.Here(); p.EmitWord(0);
+        p.Emit(OP_DEC); p.Emit(0);
+        p.Emit(OP_PUSH); p.Emit(0);
+        p.Emit(OP_JSR); p.EmitWord(fib); //fib(n - 1)
+        p.Emit(OP_POP); p.Emit(0);
+        p.Emit(OP_PUSH); p.Emit(1);
+        p.Emit(OP_DEC); p.Emit(0);
+        p.Emit(OP_JSR); p.EmitWord(fib); //fib(n - 2)
+        p.Emit(OP_POP); p.Emit(2);
+        p.Emit(OP_ADD); p.Emit(1); p.Emit(2);
+        p.Emit(OP_RTN);
+        Word base = p.Here();
+        p.Emit(OP_LDR); p.Emit(1); p.Emit(0);
+        p.Emit(OP_RTN);
+
+        p.PatchWord(call, fib);
+        p.PatchWord(toBase, base);
+        return p;
+    }
+
+    //A one byte DMA fill with a completion interrupt, restarted every 7 instructions. The handler counts
+    //interrupts at 0x3002 and returns by popping the return address and the status byte by hand
+    static Program InterruptStormWorkload() {
+        constexpr Word CHANNEL = Memory::IO_BASE + DMAController::FIRST_BLOCK * Memory::IO_BLOCK_SIZE; //Channel 0
+
+        Program p;
+        p.Emit(OP_STCM); p.EmitWord(0x00AA); p.EmitWord(CHANNEL + 0); //Fill value
+        p.Emit(OP_STCM); p.EmitWord(0x3000); p.EmitWord(CHANNEL + 2);
+        p.Emit(OP_STCM); p.EmitWord(1); p.EmitWord(CHANNEL + 4);
+        p.Emit(OP_STCM); Word vector = p.Here(); p.EmitWord(0); p.EmitWord(Memory::INTERRUPT_TABLE); //Line 0
+        p.Emit(OP_SEI);
+
+        Word loop = p.Here();
+        p.Emit(OP_STCM | 0x80); p.Emit(DMAController::CTRL_START | DMAController::CTRL_IRQ | DMAController::CTRL_FILL); p.EmitWord(CHANNEL + 6);
+        p.Emit(OP_ADD); p.Emit(1); p.Emit(2);
+        p.Emit(OP_INC); p.Emit(2);
+        p.Emit(OP_SUBC); p.Emit(3); p.EmitWord(1);
+        p.Emit(OP_ADD); p.Emit(1); p.Emit(3);
+        p.Emit(OP_INC); p.Emit(4);
+        p.Emit(OP_JMP); p.EmitWord(loop);
+
+        Word handler = p.Here();
+        p.Emit(OP_STCM | 0x80); p.Emit(0); p.EmitWord(CHANNEL + 7); //Clear DONE
+        p.Emit(OP_INCM); p.EmitWord(0x3002);
+        p.Emit(OP_POP); p.Emit(5);
+        p.Emit(OP_POPS);
+        p.Emit(OP_LDR); p.Emit(6); p.Emit(5); //PC = R5
+
+        p.PatchWord(vector, handler);
+        return p;
+    }
+
+    //Byte and word forms of the same operations interleaved: loads, constants, packed math and stores
+    static Program MixedWidthWorkload() {
+        Program p;
+        Word loop = p.Here();
+        p.Emit(OP_LDM | 0x80); p.Emit(1); p.EmitWord(0x2000);
+        p.Emit(OP_LDM); p.Emit(2); p.EmitWord(0x2002);
+        p.Emit(OP_ADDC | 0x80); p.Emit(1); p.Emit(0x03);
+        p.Emit(OP_ADDC); p.Emit(2); p.EmitWord(0x0101);
+        p.Emit(OP_ADD8); p.Emit(3); p.Emit(1);
+        p.Emit(OP_QADD16); p.Emit(4); p.Emit(2);
+        p.Emit(OP_STRM | 0x80); p.Emit(1); p.EmitWord(0x2000);
+        p.Emit(OP_STRM); p.Emit(2); p.EmitWord(0x2002);
+        p.Emit(OP_STCM | 0x80); p.Emit(0x11); p.EmitWord(0x2004);
+        p.Emit(OP_STMM | 0x80); p.EmitWord(0x2005); p.EmitWord(0x2004);
+        p.Emit(OP_UXT); p.Emit(3);
+        p.Emit(OP_JMP); p.EmitWord(loop);
+        return p;
+    }
+
+    struct Workload
+    {
+        const char* name;
+        Program (*build)();
+        bool dma; //Needs a DMA controller attached
+    };
+
+    static const Workload WORKLOADS[] = {
+        { "arithmetic", ArithmeticWorkload, false },
+        { "memcpy", MemoryCopyWorkload, false },
+        { "recursion", RecursionWorkload, false },
+        { "interrupt_storm", InterruptStormWorkload, true },
+        { "mixed_width", MixedWidthWorkload, false },
+    };
+
+    struct Result
+    {
+        std::string name;
+        uint64_t instructions = 0;
+        uint64_t cycles = 0;
+        double seconds = 0;
+        uint64_t rss = 0; //KiB grown while the workload ran
+
+        double NsPerInstruction() const {
+            return seconds * 1e9 / instructions;
+        }
+        double MIPS() const {
+            return instructions / seconds / 1e6;
+        }
+        double CyclesPerSecond() const {
+            return cycles / seconds;
+        }
+    };
+
+    //Current resident set size of the process in KiB, 0 if it can't be read
+    static uint64_t CurrentRSS() {
+#ifdef _WIN32
+        PROCESS_MEMORY_COUNTERS counters{};
+        GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+        return counters.WorkingSetSize / 1024;
+#elif defined(__APPLE__)
+        mach_task_basic_info info{};
+        mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+        if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count) != KERN_SUCCESS) {
+            return 0;
+        }
+        return info.resident_size / 1024;
+#else
+        std::ifstream statm("/proc/self/statm");
+        uint64_t size = 0, resident = 0;
+        statm >> size >> resident; //In pages
+        return resident * (sysconf(_SC_PAGESIZE) / 1024);
+#endif
+    }
+
+    //One run of the workload, its time appended to seconds. Returns false if the guest stopped before using
+    //its cycles, which would make the numbers meaningless
+    static bool Run(const Workload& workload, const Program& program, Result& result, std::vector<double>& seconds) {
+        uint64_t before = CurrentRSS();
+        Memory mem{};
+        CPU cpu{};
+        DMAController dma;
+        cpu.Reset(mem);
+        if (workload.dma) {
+            dma.Attach(cpu, mem);
+        }
+        mem.WriteBlock(0, program.text.data(), (Word)program.text.size());
+
+        auto start = std::chrono::steady_clock::now();
+        cpu.RunFor(SUITE_CYCLES, mem);
+        auto end = std::chrono::steady_clock::now();
+
+        if (cpu.stop.reason != STOP_BUDGET) {
+            std::cout << "ERROR: Workload " << workload.name << " stopped at 0x" << std::hex << cpu.stop.pc << std::dec << " before using its cycles\n";
+            return false;
+        }
+
+        uint64_t after = CurrentRSS();
+        if (after > before) {
+            result.rss = std::max(result.rss, after - before);
+        }
+        seconds.push_back(std::chrono::duration<double>(end - start).count());
+        result.instructions = cpu.perf.instructions; //The guest is deterministic, every run matches
+        result.cycles = cpu.perf.cycles;
+        return true;
+    }
+
+    static void WriteCSV(std::ostream& out, const std::vector<Result>& results) {
+        out << "workload,instructions,cycles,seconds,ns_per_instruction,mips,cycles_per_second,rss_kib\n";
+        for (const Result& result : results) {
+            out << result.name << ',' << result.instructions << ',' << result.cycles << ',' << std::setprecision(6) << result.seconds << ','
+                << result.NsPerInstruction() << ',' << result.MIPS() << ',' << std::setprecision(12) << result.CyclesPerSecond() << ','
+                << result.rss << '\n';
+        }
+    }
+
+    //Reads a CSV written by WriteCSV. Only the columns the comparison needs are kept
+    static bool ReadCSV(const char* path, std::vector<Result>& results) {
+        std::ifstream in(path);
+        if (!in) {
+            std::cout << "ERROR: Cannot open baseline " << path << "\n";
+            return false;
+        }
+
+        std::string line;
+        std::getline(in, line); //Header
+        while (std::getline(in, line)) {
+            std::vector<std::string> fields;
+            std::stringstream row(line);
+            for (std::string field; std::getline(row, field, ',');) {
+                fields.push_back(field);
+            }
+            if (fields.size() < 8) {
+                continue;
+            }
+
+            Result result;
+            result.name = fields[0];
+            result.instructions = std::stoull(fields[1]);
+            result.cycles = std::stoull(fields[2]);
+            result.seconds = std::stod(fields[3]);
+            result.rss = std::stoull(fields[7]);
+            results.push_back(result);
+        }
+        return true;
+    }
+
+    //Returns the number of regressions
+    static int Compare(const std::vector<Result>& results, const std::vector<Result>& baseline, double tolerance, uint64_t rssTolerance) {
+        int regressions = 0;
+        for (const Result& result : results) {
+            const Result* before = nullptr;
+            for (const Result& candidate : baseline) {
+                if (candidate.name == result.name) {
+                    before = &candidate;
+                }
+            }
+            if (!before) {
+                std::cout << "WARNING: " << result.name << " is not in the baseline\n";
+                continue;
+            }
+
+            double time = (result.NsPerInstruction() / before->NsPerInstruction() - 1) * 100;
+            int64_t memory = (int64_t)result.rss - (int64_t)before->rss;
+            bool slower = time > tolerance;
+            bool larger = memory > (int64_t)rssTolerance;
+
+            std::cout << (slower || larger ? "ERROR: " : "INFO: ") << result.name << ": " << std::setprecision(4)
+                << result.NsPerInstruction() << " ns/instruction (" << std::showpos << time << "%), " << std::noshowpos
+                << result.rss << " KiB RSS (" << std::showpos << memory << " KiB)" << std::noshowpos;
+            if (slower) {
+                std::cout << ", over the " << tolerance << "% time tolerance";
+            }
+            if (larger) {
+                std::cout << ", over the " << rssTolerance << " KiB RSS tolerance";
+            }
+            std::cout << "\n";
+            regressions += slower || larger;
+        }
+        return regressions;
+    }
+
+    //Runs every workload, writes the CSV to csvPath (stdout when null) and compares against baselinePath if given.
+    //Returns the process exit code
+    static int RunAll(const char* csvPath, const char* baselinePath, double tolerance, uint64_t rssTolerance) {
+        std::vector<Result> baseline;
+        if (baselinePath && !ReadCSV(baselinePath, baseline)) {
+            return 1;
+        }
+
+        std::vector<Program> programs;
+        std::vector<Result> results;
+        for (const Workload& workload : WORKLOADS) {
+            programs.push_back(workload.build());
+            results.emplace_back();
+            results.back().name = workload.name;
+        }
+
+        std::vector<std::vector<double>> seconds(results.size());
+        for (int run = 0; run < SUITE_RUNS; run++) {
+            for (size_t i = 0; i < results.size(); i++) {
+                if (!Run(WORKLOADS[i], programs[i], results[i], seconds[i])) {
+                    return 1;
+                }
+            }
+        }
+
+        //The median, so one slow or lucky run doesn't move the result
+        for (size_t i = 0; i < results.size(); i++) {
+            std::nth_element(seconds[i].begin(), seconds[i].begin() + SUITE_RUNS / 2, seconds[i].end());
+            results[i].seconds = seconds[i][SUITE_RUNS / 2];
+        }
+
+        if (csvPath) {
+            std::ofstream out(csvPath);
+            WriteCSV(out, results);
+            if (!out) {
+                std::cout << "ERROR: Cannot write " << csvPath << "\n";
+                return 1;
+            }
+        }
+        else {
+            WriteCSV(std::cout, results);
+        }
+
+        if (baselinePath) {
+            int regressions = Compare(results, baseline, tolerance, rssTolerance);
+            if (regressions) {
+                std::cout << "ERROR: " << regressions << " workload(s) regressed\n";
+                return 1;
+            }
+            std::cout << "INFO: No regressions against " << baselinePath << "\n";
+        }
+        return 0;
+    }
+}
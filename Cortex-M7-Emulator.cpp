@@ -1,7 +1,186 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <memory>
+#include <vector>
 #include "cpu.h"
+#include "disasm.h"
+#include "image.h"
+#include "multicore.h"
+#include "semihost.h"
+#include "thumb.h"
 
-int main()
+//Runs ARM firmware on the Thumb-2 frontend, which has its own memory map
+static int RunThumb(const ImageFile& image, i64 cycles) {
+    ThumbCPU cpu;
+    Memory mem(cpu.PhysicalSize());
+    if (!cpu.Load(image, mem)) {
+        return 1;
+    }
+
+    cpu.Execute(cycles, mem);
+    return 0;
+}
+
+//Runs a program on a number of cores sharing its memory, cycles is per core. Exits with core 0's exit code
+static int RunCores(CPU& boot, Memory& mem, i64 cycles, int coreCount) {
+    MultiCore system(boot, mem, (Byte)std::min(coreCount, 255));
+    system.Run(cycles);
+
+    for (auto& core : system.cores) {
+        core->semihost.Flush();
+    }
+    for (size_t i = 0; i < system.cores.size(); i++) {
+        const CPU& cpu = system.cores[i]->cpu;
+        std::cout << "INFO: Core " << i << ": " << cpu.perf.cycles << " cycles, " << cpu.perf.instructions << " instructions"
+            << (cpu.halted ? ", halted\n" : "\n");
+    }
+    std::cout << "INFO: " << system.quanta << " quanta of " << system.quantum << " cycles\n";
+    return system.cores[0]->cpu.exitCode;
+}
+
+//Lists the code of every loaded segment, with the image's labels: Cortex-M7-Emulator --disassemble program.img/.hex/.elf
+//Data between instructions is listed as instructions too, there is no way to tell them apart
+static int DisassembleImage(const char* path) {
+    ImageFile image;
+    if (!image.Open(path)) {
+        return 1;
+    }
+    if (image.machine == ImageFile::MACHINE_ARM) {
+        std::cout << "ERROR: " << path << " is Thumb code, only the 16-bit core can be disassembled\n";
+        return 1;
+    }
+
+    std::vector<const ImageSymbol*> symbols;
+    for (const ImageSymbol& symbol : image.symbols) {
+        symbols.push_back(&symbol);
+    }
+    std::stable_sort(symbols.begin(), symbols.end(), [](const ImageSymbol* a, const ImageSymbol* b) { return a->address < b->address; });
+
+    char text[Disassembler::MAX_TEXT];
+    for (const ImageSegment& segment : image.segments) {
+        if (!segment.data) {
+            continue; //Zero filled
+        }
+        std::cout << "; Segment at 0x" << std::hex << segment.address << ", " << std::dec << segment.size << " bytes\n";
+
+        auto symbol = symbols.begin();
+        for (DWord offset = 0; offset < segment.size;) {
+            DWord address = segment.address + offset;
+            //Labels are CPU addresses, which only match physical ones in the first 64 KiB
+            while (symbol != symbols.end() && (*symbol)->address < address) {
+                symbol++;
+            }
+            while (address < Memory::MEM_SIZE && symbol != symbols.end() && (*symbol)->address == address) {
+                std::cout << (*symbol)->name << ":\n";
+                symbol++;
+            }
+
+            Byte length = Disassembler::Disassemble(segment.data + offset, segment.size - offset, text);
+            std::cout << "    " << std::left << std::setw(32) << text << std::right << "; 0x" << std::hex << std::uppercase
+                << std::setfill('0') << std::setw(4) << address << std::setfill(' ') << std::nouppercase << std::dec << "\n";
+            offset += length;
+        }
+    }
+    return 0;
+}
+
+//Runs a program: Cortex-M7-Emulator [--timing[=config]] [--cores=N] program.img/.hex/.elf [cycles]. ARM ELF files run as Thumb code.
+//The exit code is the one the program passed to the semihosting EXIT command, 0 if it never did
+static int RunImage(const char* path, i64 cycles, const char* timingConfig, int coreCount) {
+    ImageFile image;
+    if (!image.Open(path)) {
+        return 1;
+    }
+    if (image.machine == ImageFile::MACHINE_ARM) {
+        if (timingConfig || coreCount > 1) {
+            std::cout << "WARNING: --timing and --cores only apply to the 16-bit core, ignoring them\n";
+        }
+        return RunThumb(image, cycles);
+    }
+
+    Memory mem(image.PhysicalSize()); //Banked memory grows to hold every segment
+    CPU cpu{};
+
+    cpu.Reset(mem);
+    if (!image.Load(cpu, mem)) {
+        return 1;
+    }
+
+    //Charge whole blocks when the image carries metadata for the code that was loaded
+    if (!image.blocks.blocks.empty()) {
+        if (image.blocks.Matches(mem)) {
+            image.blocks.Attach(cpu);
+        }
+        else {
+            std::cout << "WARNING: Block metadata in " << path << " does not match its code, charging per byte\n";
+        }
+    }
+
+    if (coreCount > 1) {
+        if (timingConfig) {
+            std::cout << "WARNING: The timing model is not shared between cores, ignoring --timing\n";
+        }
+        return RunCores(cpu, mem, cycles, coreCount);
+    }
+
+    //Cache/TCM timing is opt-in, without it every byte costs 1 cycle
+    std::unique_ptr<TimingModel> timing;
+    if (timingConfig) {
+        TimingConfig config;
+        if (*timingConfig && !config.Load(timingConfig)) {
+            return 1;
+        }
+        timing.reset(new TimingModel(config));
+        cpu.timing = timing.get();
+    }
+
+    Semihost semihost;
+    semihost.Attach(cpu, mem);
+
+    cpu.Execute(cycles, mem);
+    semihost.Flush();
+
+    if (timing) {
+        std::cout << "INFO: " << cpu.perf.cycles << " cycles, " << cpu.perf.instructions << " instructions\n";
+        timing->Report(std::cout);
+    }
+    return cpu.exitCode;
+}
+
+int main(int argc, char** argv)
 {
+    const char* timingConfig = nullptr; //"" for the default model
+    int coreCount = 1;
+    bool disassemble = false;
+    std::vector<const char*> args;
+    for (int i = 1; i < argc; i++) {
+        if (std::strncmp(argv[i], "--timing", 8) == 0 && (argv[i][8] == 0 || argv[i][8] == '=')) {
+            timingConfig = argv[i][8] ? argv[i] + 9 : "";
+        }
+        else if (std::strncmp(argv[i], "--cores=", 8) == 0) {
+            coreCount = std::atoi(argv[i] + 8);
+        }
+        else if (std::strcmp(argv[i], "--disassemble") == 0) {
+            disassemble = true;
+        }
+        else {
+            args.push_back(argv[i]);
+        }
+    }
+
+    if (disassemble) {
+        if (args.empty()) {
+            std::cout << "ERROR: --disassemble needs a program\n";
+            return 1;
+        }
+        return DisassembleImage(args[0]);
+    }
+    if (!args.empty()) {
+        return RunImage(args[0], args.size() > 1 ? std::strtoll(args[1], nullptr, 0) : 1000000, timingConfig, coreCount);
+    }
+
     Memory mem{};
     CPU cpu{};
 
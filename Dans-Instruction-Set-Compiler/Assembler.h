@@ -0,0 +1,1119 @@
+#pragma once
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <span>
+#include "../cpu.h"
+#include "../blocks.h"
+#include "../image.h"
+#include "Lexer.h"
+#include "Object.h"
+#include "Mnemonics.h"
+
+struct AsmArgument
+{
+    Type type;
+    Word value; //Constant, address or register number
+    uint32_t symbol; //Interned label name for Type_Label
+};
+
+struct AsmInstruction
+{
+    const TableEntry* mnemonic;
+    const OperandForm* form; //Selected encoding
+    Byte argc;
+    AsmArgument args[3];
+    uint32_t token; //First token, for diagnostics
+};
+
+static Word ParseNumber(std::string_view str, const TokenStream& stream, const Token& token) {
+    DWord value = 0;
+    bool hex = str.size() > 2 && str[0] == '0' && (str[1] == 'x' || str[1] == 'X');
+    size_t digits = 0;
+
+    for (size_t i = hex ? 2 : 0; i < str.size(); i++, digits++) {
+        char c = str[i];
+        int digit = isdigit((unsigned char)c) ? c - '0'
+            : hex && isxdigit((unsigned char)c) ? (toupper((unsigned char)c) - 'A' + 10)
+            : -1;
+        if (digit < 0) {
+            throw stream.At(token, "Invalid number '" + std::string(str) + "'");
+        }
+        value = value * (hex ? 16 : 10) + digit;
+        if (value > 0xFFFF) {
+            throw stream.At(token, "Number out of range '" + std::string(str) + "'");
+        }
+    }
+    if (digits == 0) {
+        throw stream.At(token, "Invalid number '" + std::string(str) + "'");
+    }
+    return (Word)value;
+}
+
+//Classifies and decodes an operand in one pass over its text. decimalWords types every decimal
+//constant as a word, for instructions where the width is the meaning
+static AsmArgument ClassifyOperand(const TokenStream& stream, const Token& token, bool decimalWords = false) {
+    std::string_view text = stream.Text(token);
+
+    switch (token.kind)
+    {
+    case Tok_Address: {
+        //[address] or [address]:size, size defaults to a word
+        size_t close = text.find(']');
+        Word address = ParseNumber(text.substr(1, close - 1), stream, token);
+        std::string_view size = text.substr(close + 1);
+
+        if (size.empty() || size == ":2") {
+            return AsmArgument{ Type_WordAddress, address, 0 };
+        }
+        if (size == ":1") {
+            return AsmArgument{ Type_ByteAddress, address, 0 };
+        }
+        throw stream.At(token, "Address size must be 1 or 2");
+    }
+    case Tok_Number: {
+        //Hex literals are sized by their digit count, decimals by value. The width only matters where it
+        //changes the meaning (PUSH, stores), the optimizer narrows the rest
+        Word value = ParseNumber(text, stream, token);
+        bool hex = text.size() > 2 && text[1] == 'x';
+        bool isByte = hex ? text.size() <= 4 : value <= 0xFF && !decimalWords;
+
+        return AsmArgument{ isByte ? Type_Byte : Type_Word, value, 0 };
+    }
+    case Tok_Identifier: {
+        if (const TableEntry* entry = LookupName(text)) {
+            if (entry->kind == Entry_Register) {
+                return AsmArgument{ Type_Register, entry->value, 0 };
+            }
+            if (entry->kind == Entry_VectorRegister) {
+                return AsmArgument{ Type_VectorRegister, entry->value, 0 };
+            }
+            throw stream.At(token, "Unexpected mnemonic '" + std::string(text) + "'");
+        }
+        return AsmArgument{ Type_Label, 0, token.symbol };
+    }
+    default:
+        throw stream.At(token, "Unexpected token");
+    }
+}
+
+//Returns the first operand form of the mnemonic that accepts the operand types, or nullptr
+static const OperandForm* MatchForm(const AsmInstruction& asmInst) {
+    for (const OperandForm& form : asmInst.mnemonic->forms) {
+        if (form.argc != asmInst.argc) {
+            continue;
+        }
+
+        bool matches = true;
+        for (size_t i = 0; i < form.argc && matches; i++) {
+            matches = form.masks[i] & (1 << asmInst.args[i].type);
+        }
+
+        if (matches) {
+            return &form;
+        }
+    }
+    return nullptr;
+}
+
+static const OperandForm& SelectForm(const TokenStream& stream, const AsmInstruction& asmInst) {
+    const OperandForm* form = MatchForm(asmInst);
+    if (!form) {
+        throw stream.At(stream.tokens[asmInst.token], "Invalid operands for " + std::string(asmInst.mnemonic->name));
+    }
+    if (form->error) {
+        throw stream.At(stream.tokens[asmInst.token], form->error);
+    }
+    return *form;
+}
+
+static Byte InstructionSize(const OperandForm& form) {
+    return OPCODES.Length(form.opcode);
+}
+
+static uint32_t EstimateCycles(const OperandForm& form) {
+    return InstructionSize(form) + OPCODES.DataCycles(form.opcode);
+}
+
+//Attributes of a mnemonic are those of its first form, the one taking registers
+static Byte Attributes(const TableEntry& mnemonic) {
+    return OPCODES.Info(mnemonic.forms[0].opcode).attributes;
+}
+
+//Instructions that write their first operand when it is a register
+static bool WritesFirstOperand(const TableEntry& mnemonic) {
+    return Attributes(mnemonic) & OPA_WRITES_FIRST;
+}
+
+//Jumps, calls, returns, stops and writes to PC end a basic block
+static bool EndsBlock(const AsmInstruction& i) {
+    if (Attributes(*i.mnemonic) & (OPA_BRANCH | OPA_STOP)) {
+        return true;
+    }
+    return WritesFirstOperand(*i.mnemonic) && i.argc > 0 && i.args[0].type == Type_Register && i.args[0].value == 6;
+}
+
+struct Symbol
+{
+    bool defined;
+    bool reported; //Undefined and already diagnosed
+    Word address;
+};
+
+//Label definition between instructions: the label's address is that of the instruction at index
+struct LabelDefinition
+{
+    size_t instruction;
+    uint32_t symbol;
+    uint32_t token;
+};
+
+//Data directive between instructions: emitted before the instruction at index, after the first
+//labels label definitions, so it keeps its place among labels at the same index
+struct DataDirective
+{
+    size_t instruction;
+    size_t labels;
+    Directive kind;
+    uint32_t token; //The directive
+    uint32_t first; //Operands, in Assembler::dataArguments
+    uint32_t count;
+};
+
+//Label use that could not be resolved when it was emitted, or any label use in a relocatable object
+struct Fixup
+{
+    uint32_t offset; //Into the output
+    uint32_t symbol;
+    uint32_t token;
+};
+
+struct OptimizerReport
+{
+    uint32_t removed = 0; //Instructions deleted
+    uint32_t rewritten = 0; //Instructions moved to a cheaper form
+    uint32_t bytesSaved = 0;
+    uint32_t cyclesSaved = 0; //Static estimate, every instruction executed once
+
+    void Add(const OptimizerReport& other) {
+        removed += other.removed;
+        rewritten += other.rewritten;
+        bytesSaved += other.bytesSaved;
+        cyclesSaved += other.cyclesSaved;
+    }
+};
+
+/*
+    Peephole optimizer over parsed instructions, run before emission
+
+    Works on straight-line code: what is known about registers is dropped at every label and data
+    directive and after anything that can transfer control. PC and SP are never tracked.
+    - ADD/SUB/MUL/DIV with a constant and INC/DEC are folded into the MOV of a constant that set the
+      register, if nothing read it in between
+    - ADD/SUB 1 become INC/DEC, ADD/SUB 0 and MUL/DIV 1 are removed
+    - A MOV of a value the register already holds is removed, as is a MOV overwritten before it is read
+    - A word constant that is already in a register uses the register form when that is shorter
+    - A constant up to 0xFF uses the byte mode form when that form zero extends it
+    - Compare and branch against a constant: removed when it can never be taken and turned into JMP when
+      it always is (from the constant alone or a known register), JRE/JRLE 0 and JRL 1 become JRZ, and
+      JRL/JRGE 0x100 become JRLE/JRG 0xFF to use the byte form
+*/
+struct Optimizer
+{
+    static constexpr Byte TRACKED = 6; //R0 - R5
+    static constexpr size_t NONE = SIZE_MAX;
+
+    struct RegisterState
+    {
+        bool known;
+        Word value;
+        size_t definition; //MOV into the register that nothing has read yet, or NONE
+    };
+
+    RegisterState registers[TRACKED];
+    std::vector<bool> removed;
+
+    void Run(std::vector<AsmInstruction>& instructions, std::vector<LabelDefinition>& labels, std::vector<DataDirective>& data, OptimizerReport& report) {
+        uint32_t bytesBefore = 0, cyclesBefore = 0;
+        for (const AsmInstruction& i : instructions) {
+            bytesBefore += InstructionSize(*i.form);
+            cyclesBefore += EstimateCycles(*i.form);
+        }
+
+        removed.assign(instructions.size(), false);
+        Forget();
+
+        size_t nextLabel = 0, nextData = 0;
+        for (size_t n = 0; n < instructions.size(); n++)
+        {
+            bool barrier = false;
+            for (; nextLabel < labels.size() && labels[nextLabel].instruction == n; nextLabel++) {
+                barrier = true; //Reachable from elsewhere
+            }
+            for (; nextData < data.size() && data[nextData].instruction == n; nextData++) {
+                barrier = true;
+            }
+            if (barrier) {
+                Forget();
+            }
+            Visit(instructions, n);
+        }
+
+        //Pick the final encodings and drop removed instructions, moving labels and data along
+        size_t count = 0;
+        nextLabel = 0;
+        nextData = 0;
+        for (size_t n = 0; n <= instructions.size(); n++)
+        {
+            for (; nextLabel < labels.size() && labels[nextLabel].instruction == n; nextLabel++) {
+                labels[nextLabel].instruction = count;
+            }
+            for (; nextData < data.size() && data[nextData].instruction == n; nextData++) {
+                data[nextData].instruction = count;
+            }
+            if (n == instructions.size()) {
+                break;
+            }
+
+            if (removed[n]) {
+                report.removed++;
+                continue;
+            }
+
+            AsmInstruction& i = instructions[n];
+            const OperandForm* original = i.form;
+            Encode(i);
+            report.rewritten += i.form != original;
+            instructions[count++] = i;
+        }
+        instructions.resize(count);
+
+        uint32_t bytesAfter = 0, cyclesAfter = 0;
+        for (const AsmInstruction& i : instructions) {
+            bytesAfter += InstructionSize(*i.form);
+            cyclesAfter += EstimateCycles(*i.form);
+        }
+        report.bytesSaved = bytesBefore - bytesAfter;
+        report.cyclesSaved = cyclesBefore - cyclesAfter;
+    }
+
+private:
+    void Forget() {
+        for (RegisterState& r : registers) {
+            r = RegisterState{ false, 0, NONE };
+        }
+    }
+
+    static bool Tracked(const AsmArgument& arg) {
+        return arg.type == Type_Register && arg.value < TRACKED;
+    }
+    static bool IsConstant(const AsmArgument& arg) {
+        return arg.type == Type_Word || arg.type == Type_Byte;
+    }
+
+    static bool Compare(Instruction op, Word value, Word constant) {
+        switch (op)
+        {
+        case INST_JRE: return value == constant;
+        case INST_JRN: return value != constant;
+        case INST_JRG: return value > constant;
+        case INST_JRGE: return value >= constant;
+        case INST_JRL: return value < constant;
+        default: return value <= constant;
+        }
+    }
+
+    static bool Apply(Instruction op, Word& value, Word constant) {
+        switch (op)
+        {
+        case INST_ADD: value += constant; return true;
+        case INST_SUB: value -= constant; return true;
+        case INST_MUL: value *= constant; return true;
+        case INST_DIV: {
+            if (constant == 0) {
+                return false; //Left for the CPU to deal with
+            }
+            value /= constant;
+        } return true;
+        default: return false;
+        }
+    }
+
+    void Visit(std::vector<AsmInstruction>& instructions, size_t n) {
+        AsmInstruction& i = instructions[n];
+        Instruction op = (Instruction)i.mnemonic->value;
+
+        //Arithmetic on a register with a constant
+        bool arithmetic = op == INST_ADD || op == INST_SUB || op == INST_MUL || op == INST_DIV;
+        bool unary = op == INST_INC || op == INST_DEC;
+        if ((arithmetic && i.argc == 2 && Tracked(i.args[0]) && IsConstant(i.args[1])) || (unary && Tracked(i.args[0]))) {
+            RegisterState& r = registers[i.args[0].value];
+            Instruction applied = arithmetic ? op : op == INST_INC ? INST_ADD : INST_SUB;
+            Word constant = arithmetic ? i.args[1].value : 1;
+
+            bool identity = (applied == INST_ADD || applied == INST_SUB) ? constant == 0 : constant == 1;
+            if (identity) {
+                removed[n] = true;
+                return;
+            }
+
+            Word value = r.value;
+            if (r.known && r.definition != NONE && IsConstant(instructions[r.definition].args[1]) && Apply(applied, value, constant)) {
+                instructions[r.definition].args[1] = AsmArgument{ Type_Word, value, 0 };
+                r.value = value;
+                removed[n] = true;
+                return;
+            }
+
+            if (arithmetic && constant == 1 && (op == INST_ADD || op == INST_SUB)) {
+                i.mnemonic = LookupName(op == INST_ADD ? "INC" : "DEC");
+                i.argc = 1;
+            }
+            r.known = r.known && Apply(applied, r.value, constant);
+            r.definition = NONE;
+            return;
+        }
+
+        //Register moves
+        if (op == INST_MOV && Tracked(i.args[0])) {
+            RegisterState& r = registers[i.args[0].value];
+            const AsmArgument& source = i.args[1];
+
+            if (source.type == Type_Register && source.value == i.args[0].value) {
+                removed[n] = true;
+                return;
+            }
+            if (r.known && ((IsConstant(source) && source.value == r.value) ||
+                (Tracked(source) && registers[source.value].known && registers[source.value].value == r.value))) {
+                removed[n] = true;
+                return;
+            }
+
+            Substitute(i);
+
+            if (r.definition != NONE) {
+                removed[r.definition] = true; //Overwritten before it was read
+            }
+
+            if (IsConstant(i.args[1])) {
+                r = RegisterState{ true, i.args[1].value, n };
+            }
+            else if (i.args[1].type == Type_Register) {
+                bool known = Tracked(i.args[1]) && registers[i.args[1].value].known;
+                Word value = known ? registers[i.args[1].value].value : 0;
+                if (Tracked(i.args[1])) {
+                    registers[i.args[1].value].definition = NONE;
+                }
+                r = RegisterState{ known, value, n };
+            }
+            else {
+                r = RegisterState{ false, 0, NONE }; //Memory reads are never removed
+            }
+            return;
+        }
+
+        Substitute(i);
+
+        //Compare and branch against a constant
+        if (op >= INST_JRE && op <= INST_JRLE && IsConstant(i.args[1])) {
+            Word constant = i.args[1].value;
+            bool known = Tracked(i.args[0]) && registers[i.args[0].value].known;
+
+            bool never = known ? !Compare(op, registers[i.args[0].value].value, constant) :
+                (op == INST_JRL && constant == 0) || (op == INST_JRG && constant == 0xFFFF);
+            bool always = known ? !never :
+                (op == INST_JRGE && constant == 0) || (op == INST_JRLE && constant == 0xFFFF);
+
+            if (never) {
+                removed[n] = true;
+                return;
+            }
+            if (always) {
+                i.mnemonic = LookupName("JMP");
+                i.args[0] = i.args[2];
+                i.argc = 1;
+            }
+            else if (((op == INST_JRE || op == INST_JRLE) && constant == 0) || (op == INST_JRL && constant == 1)) {
+                i.mnemonic = LookupName("JRZ");
+                i.args[1] = i.args[2];
+                i.argc = 2;
+            }
+            else if ((op == INST_JRL || op == INST_JRGE) && constant == 0x100) {
+                i.mnemonic = LookupName(op == INST_JRL ? "JRLE" : "JRG");
+                i.args[1] = AsmArgument{ Type_Byte, 0xFF, 0 };
+            }
+        }
+
+        //Everything else: register operands are read, and the first one is written by some instructions
+        for (Byte a = 0; a < i.argc; a++) {
+            if (Tracked(i.args[a])) {
+                registers[i.args[a].value].definition = NONE;
+            }
+        }
+
+        if (WritesFirstOperand(*i.mnemonic) && i.argc > 0 && Tracked(i.args[0])) {
+            registers[i.args[0].value] = RegisterState{ false, 0, NONE };
+        }
+        if (EndsBlock(i)) {
+            Forget();
+        }
+    }
+
+    //Replaces word constants that a register already holds, if the register form is shorter
+    void Substitute(AsmInstruction& i) {
+        for (Byte a = 0; a < i.argc; a++) {
+            if (i.args[a].type != Type_Word) {
+                continue;
+            }
+            for (Byte reg = 0; reg < TRACKED; reg++) {
+                if (!registers[reg].known || registers[reg].value != i.args[a].value) {
+                    continue;
+                }
+
+                AsmInstruction candidate = i;
+                candidate.args[a] = AsmArgument{ Type_Register, reg, 0 };
+                const OperandForm* form = MatchForm(candidate);
+                if (form && !form->error && InstructionSize(*form) < InstructionSize(*i.form)) {
+                    candidate.form = form;
+                    i = candidate;
+                    registers[reg].definition = NONE;
+                }
+                break;
+            }
+        }
+    }
+
+    //Final form, narrowing word constants to byte mode where the form zero extends them
+    static void Encode(AsmInstruction& i) {
+        i.form = MatchForm(i);
+
+        for (Byte a = 0; a < i.argc; a++) {
+            if (i.args[a].type != Type_Word || i.args[a].value > 0xFF) {
+                continue;
+            }
+
+            AsmInstruction candidate = i;
+            candidate.args[a].type = Type_Byte;
+            const OperandForm* form = MatchForm(candidate);
+            if (form && !form->error && form->zeroExtends) {
+                candidate.form = form;
+                i = candidate;
+            }
+        }
+    }
+};
+
+//Bytes loaded at address, stored at offset in the output the image was assembled into
+struct Segment
+{
+    Word address;
+    Word size;
+    uint32_t offset;
+};
+
+//Result of assembling one program. The code itself lives in the output it was assembled into,
+//or in text when no output was given. The output holds the segments back to back, so without .org
+//it is the program exactly as it sits in memory from origin
+struct Image
+{
+    Word origin = 0; //Address of the first byte
+    Word size = 0; //Bytes of output, all segments
+    std::vector<Segment> segments; //In source order, never overlapping
+    std::vector<ImageSymbol> symbols; //Labels with their addresses, exported ones only in linked images
+    Word entry = 0; //Address of .main
+    Word interruptVectors[8]{}; //Addresses of the .irq0 - .irq7 handlers (linked images)
+    Byte interruptMask = 0; //Lines that have a handler
+    std::vector<Byte> text;
+    std::vector<Diagnostic> diagnostics;
+    OptimizerReport optimizer;
+    BlockMap blocks; //Basic blocks with their static sizes and cycle costs
+
+    bool Ok() const {
+        return diagnostics.empty();
+    }
+};
+
+//The longest run of guest memory from origin that is contiguous on the host, stopping before I/O space.
+//Windows that are consecutive on the host form one run, which is the usual case after a reset
+static std::span<Byte> ContiguousMemory(Memory& mem, Word origin) {
+    Byte* start = &mem[origin];
+    DWord room = 0;
+    for (DWord address = origin; address < Memory::IO_BASE && &mem[(Word)address] == start + room;) {
+        DWord n = std::min<DWord>(Memory::WindowRoom((Word)address), Memory::IO_BASE - address);
+        room += n;
+        address += n;
+    }
+    return std::span<Byte>(start, room);
+}
+
+//Points the interrupt table at the image's .irq0 - .irq7 handlers
+static void WriteInterruptTable(const Image& image, Memory& mem) {
+    for (Byte line = 0; line < 8; line++) {
+        if (image.interruptMask & (1 << line)) {
+            mem[Memory::INTERRUPT_TABLE + line * 2] = image.interruptVectors[line] & 0xFF;
+            mem[Memory::INTERRUPT_TABLE + line * 2 + 1] = image.interruptVectors[line] >> 8;
+        }
+    }
+}
+
+//File form of an image, its segment data pointing into text (the output it was assembled into)
+static ImageFile ToImageFile(const Image& image, const Byte* text) {
+    ImageFile file;
+    file.entry = image.entry;
+    file.interruptMask = image.interruptMask;
+    std::copy(std::begin(image.interruptVectors), std::end(image.interruptVectors), file.interruptVectors);
+    for (const Segment& segment : image.segments) {
+        file.segments.push_back(ImageSegment{ segment.address, segment.size, text + segment.offset });
+    }
+    file.symbols = image.symbols;
+    file.blocks = image.blocks;
+    return file;
+}
+
+//Copies every segment from the output the image was assembled into to its address, one memcpy per
+//window it covers, then fills in the interrupt table
+static void LoadImage(const Image& image, const Byte* text, Memory& mem) {
+    for (const Segment& segment : image.segments) {
+        mem.WriteBlock(segment.address, text + segment.offset, segment.size);
+    }
+    WriteInterruptTable(image, mem);
+}
+
+/*
+    Assembles programs into a caller provided buffer or Memory, or into relocatable objects
+
+    Besides instructions, a program can contain data:
+        .byte 1 2 0x30          .word 0x1234 label      .fill 16 0xFF       .incbin "table.bin"
+    and .org moves the rest of the program to another address, for example the interrupt table:
+        .org 0xFFF0
+        .word handler0 handler1
+    Each .org starts a new Segment. Segments may not overlap or touch I/O space, and relocatable
+    objects cannot use .org (the linker places them)
+
+    One Assembler can be reused for any number of programs, its tables keep their capacity between runs.
+    Errors never throw: they are returned in Image::diagnostics and the output is left incomplete
+*/
+struct Assembler
+{
+    static constexpr Word VERSION = 1; //Bump whenever the same source assembles to different output
+
+    TokenStream stream;
+    std::vector<AsmInstruction> instructions;
+    std::vector<LabelDefinition> labelDefinitions;
+    std::vector<DataDirective> dataDirectives;
+    std::vector<AsmArgument> dataArguments;
+    std::vector<Symbol> symbols; //Indexed by interned symbol id
+    std::vector<Fixup> fixups;
+    std::vector<Fixup> labelUses; //Relocatable output only
+    Optimizer optimizer;
+    std::vector<Byte> scratch; //Output of the Memory overload, kept so repeated runs don't allocate
+    bool optimize = true;
+
+    //Assembles into out, to be loaded at origin by LoadImage
+    Image Assemble(std::string_view source, std::span<Byte> out, Word origin = 0) {
+        Image image;
+        image.origin = origin;
+
+        if (Prepare(source, image)) {
+            Emit(image, out, false);
+        }
+        if (image.Ok()) {
+            Resolve(image, out, false);
+        }
+        return image;
+    }
+
+    //Assembles and loads into guest memory through the current bank mapping, and fills in the interrupt
+    //table. Nothing is written if there are errors. The output goes through scratch, which is allocated
+    //once per Assembler, and only the bytes of the segments are copied
+    Image Assemble(std::string_view source, Memory& mem, Word origin = 0) {
+        scratch.resize(Memory::MEM_SIZE);
+        Image image = Assemble(source, std::span<Byte>(scratch), origin);
+        if (image.Ok()) {
+            LoadImage(image, scratch.data(), mem);
+        }
+        return image;
+    }
+
+    //Assembles into Image::text
+    Image Assemble(std::string_view source, Word origin = 0) {
+        std::vector<Byte> text(Memory::MEM_SIZE);
+        Image image = Assemble(source, std::span<Byte>(text), origin);
+        text.resize(image.size);
+        image.text = std::move(text);
+        return image;
+    }
+
+    //Assembles into a relocatable object (code at offset 0), see ObjectFile. Keeps object.source
+    Image Compile(std::string_view source, ObjectFile& object) {
+        Image image;
+        ObjectFile fresh;
+        fresh.source = std::move(object.source);
+        object = std::move(fresh);
+        object.code.resize(Memory::MEM_SIZE);
+
+        if (Prepare(source, image)) {
+            Emit(image, object.code, true);
+        }
+        if (image.Ok()) {
+            Resolve(image, object.code, true);
+        }
+        object.code.resize(image.size);
+        if (!image.Ok()) {
+            return image;
+        }
+
+        for (uint32_t id = 0; id < symbols.size(); id++) {
+            if (symbols[id].defined && ObjectFile::IsExported(stream.symbols.names[id])) {
+                object.exports.push_back(ObjectSymbol{ std::string(stream.symbols.names[id]), symbols[id].address });
+            }
+        }
+
+        std::vector<uint32_t> importIndex(symbols.size(), Relocation::LOCAL);
+        for (const Fixup& use : labelUses) {
+            uint32_t symbol = Relocation::LOCAL;
+            if (!symbols[use.symbol].defined) {
+                if (importIndex[use.symbol] == Relocation::LOCAL) {
+                    importIndex[use.symbol] = (uint32_t)object.imports.size();
+                    object.imports.push_back(std::string(stream.symbols.names[use.symbol]));
+                }
+                symbol = importIndex[use.symbol];
+            }
+            object.relocations.push_back(Relocation{ (Word)use.offset, symbol });
+        }
+
+        object.blocks = image.blocks.blocks;
+        return image;
+    }
+
+    //Paths of the files the source pulls in with .incbin (its only string operand), for cache keys.
+    //Empty when the source has no strings or does not lex, in which case it will not assemble either
+    std::vector<std::string> Includes(std::string_view source) {
+        std::vector<std::string> paths;
+        if (source.find('"') == std::string_view::npos) {
+            return paths;
+        }
+
+        try {
+            Lex(source, stream);
+        }
+        catch (const Diagnostic&) {
+            return paths;
+        }
+        for (const Token& token : stream.tokens) {
+            if (token.kind == Tok_String) {
+                std::string_view text = stream.Text(token);
+                paths.emplace_back(text.substr(1, text.size() - 2));
+            }
+        }
+        return paths;
+    }
+
+private:
+    //Lex, parse and optimize
+    bool Prepare(std::string_view source, Image& image) {
+        try {
+            Lex(source, stream);
+        }
+        catch (const Diagnostic& diagnostic) {
+            image.diagnostics.push_back(diagnostic);
+            return false;
+        }
+
+        Parse(image);
+        if (image.Ok() && optimize) {
+            optimizer.Run(instructions, labelDefinitions, dataDirectives, image.optimizer);
+        }
+        return image.Ok();
+    }
+
+    //Tokens -> instructions, label definitions and data. A bad line is reported and skipped
+    void Parse(Image& image) {
+        instructions.clear();
+        labelDefinitions.clear();
+        dataDirectives.clear();
+        dataArguments.clear();
+        instructions.reserve(stream.tokens.size() / 3);
+
+        AsmInstruction asmInst{};
+        DataDirective directive{};
+        bool isDirective = false;
+        bool isFirstWord = true;
+
+        for (uint32_t i = 0; i < stream.tokens.size(); i++)
+        {
+            const Token& token = stream.tokens[i];
+
+            try {
+                if (token.kind == Tok_Label) {
+                    labelDefinitions.push_back(LabelDefinition{ instructions.size(), token.symbol, i });
+                    continue;
+                }
+                if (token.kind == Tok_Newline) {
+                    if (isDirective) {
+                        CheckDirective(directive);
+                        dataDirectives.push_back(directive);
+                    }
+                    else {
+                        asmInst.form = &SelectForm(stream, asmInst);
+                        instructions.push_back(asmInst); //Lines without tokens never produce a newline
+                    }
+                    isFirstWord = true;
+                    continue;
+                }
+
+                if (isFirstWord) {
+                    const TableEntry* entry = LookupName(stream.Text(token));
+                    if (!entry || (entry->kind != Entry_Mnemonic && entry->kind != Entry_Directive)) {
+                        throw stream.At(token, "Unknown instruction '" + std::string(stream.Text(token)) + "'");
+                    }
+
+                    isDirective = entry->kind == Entry_Directive;
+                    if (isDirective) {
+                        directive = DataDirective{ instructions.size(), labelDefinitions.size(), (Directive)entry->value, i, (uint32_t)dataArguments.size(), 0 };
+                    }
+                    else {
+                        asmInst = AsmInstruction{ entry, nullptr, 0, {}, i };
+                    }
+                    isFirstWord = false;
+                }
+                else if (isDirective) {
+                    //The path of .incbin stays a token, the operands of the others are decoded here
+                    if (token.kind != Tok_String) {
+                        dataArguments.push_back(ClassifyOperand(stream, token));
+                    }
+                    directive.count++;
+                }
+                else if (asmInst.argc < 3) {
+                    //POP register always takes a word, so PUSH only pushes a byte when asked for with 0xNN
+                    asmInst.args[asmInst.argc++] = ClassifyOperand(stream, token, asmInst.mnemonic->value == INST_PUSH);
+                }
+                else {
+                    throw stream.At(token, "Too many operands");
+                }
+            }
+            catch (const Diagnostic& diagnostic) {
+                image.diagnostics.push_back(diagnostic);
+                while (stream.tokens[i].kind != Tok_Newline) { //The lexer always ends a line with a newline
+                    i++;
+                }
+                if (isDirective) {
+                    dataArguments.resize(directive.first);
+                }
+                isFirstWord = true;
+            }
+        }
+    }
+
+    //Operand counts and types of a data directive
+    void CheckDirective(const DataDirective& d) const {
+        const Token& token = stream.tokens[d.token];
+        const AsmArgument* args = dataArguments.data() + d.first;
+        uint32_t values = (uint32_t)dataArguments.size() - d.first; //Operands that are not strings
+
+        auto constant = [&](uint32_t n, Word max) {
+            return (args[n].type == Type_Word || args[n].type == Type_Byte) && args[n].value <= max;
+        };
+
+        switch (d.kind)
+        {
+        case Dir_Byte:
+            for (uint32_t n = 0; n < values; n++) {
+                if (!constant(n, 0xFF)) {
+                    throw stream.At(token, ".byte takes constants up to 0xFF");
+                }
+            }
+            if (d.count == 0 || values != d.count) {
+                throw stream.At(token, ".byte takes one or more constants up to 0xFF");
+            }
+            break;
+        case Dir_Word:
+            for (uint32_t n = 0; n < values; n++) {
+                if (!constant(n, 0xFFFF) && args[n].type != Type_Label) {
+                    throw stream.At(token, ".word takes constants and labels");
+                }
+            }
+            if (d.count == 0 || values != d.count) {
+                throw stream.At(token, ".word takes one or more constants or labels");
+            }
+            break;
+        case Dir_Fill:
+            if ((d.count != 1 && d.count != 2) || values != d.count || !constant(0, 0xFFFF) || (values == 2 && !constant(1, 0xFF))) {
+                throw stream.At(token, ".fill takes a count and an optional byte value");
+            }
+            break;
+        case Dir_Incbin:
+            if (d.count != 1 || values != 0) {
+                throw stream.At(token, ".incbin takes one \"path\"");
+            }
+            break;
+        case Dir_Org:
+            if (d.count != 1 || values != 1 || !constant(0, 0xFFFF)) {
+                throw stream.At(token, ".org takes an address");
+            }
+            break;
+        }
+    }
+
+    //Single pass: labels get their address as they are reached, backward references are written
+    //directly and forward references are recorded as fixups. Basic blocks are measured on the way,
+    //data is never part of one. Relocatable output also records every label use
+    void Emit(Image& image, std::span<Byte> out, bool relocatable) {
+        symbols.assign(stream.symbols.names.size(), Symbol{});
+        fixups.clear();
+        labelUses.clear();
+
+        size_t size = 0; //Into out
+        DWord address = image.origin; //Where the next byte is loaded
+        size_t nextLabel = 0;
+        size_t nextData = 0;
+
+        image.segments.clear();
+        Segment segment{ image.origin, 0, 0 };
+
+        image.blocks = BlockMap{};
+        BasicBlock block{ image.origin, 0, 0 };
+        uint32_t blockCycles = 0;
+
+        auto endBlock = [&]() {
+            if (block.size > 0) {
+                block.cycles = (Word)std::min<uint32_t>(blockCycles, 0xFFFF);
+                image.blocks.blocks.push_back(block);
+            }
+            block = BasicBlock{ (Word)address, 0, 0 };
+            blockCycles = 0;
+        };
+
+        //Makes room for n more bytes at the current address
+        auto place = [&](size_t n, uint32_t token) {
+            std::string error;
+            if (size + n > out.size()) {
+                error = "Program does not fit in " + std::to_string(out.size()) + " bytes";
+            }
+            else if (address + n > Memory::MEM_SIZE) {
+                error = "Program runs past the end of memory";
+            }
+            else if (address < Memory::INTERRUPT_TABLE && address + n > Memory::IO_BASE) {
+                error = "Program runs into I/O space";
+            }
+            if (!error.empty()) {
+                image.diagnostics.push_back(stream.At(stream.tokens[token], error));
+                return false;
+            }
+            segment.size += (Word)n;
+            address += (DWord)n;
+            return true;
+        };
+
+        //Value of a constant or label operand written at the current output position
+        auto resolve = [&](const AsmArgument& arg, uint32_t token) -> Word {
+            if (arg.type != Type_Label) {
+                return arg.value;
+            }
+            if (relocatable) {
+                labelUses.push_back(Fixup{ (uint32_t)size, arg.symbol, token });
+            }
+
+            const Symbol& symbol = symbols[arg.symbol];
+            if (symbol.defined) {
+                return symbol.address;
+            }
+            fixups.push_back(Fixup{ (uint32_t)size, arg.symbol, token });
+            return 0; //Placeholder value
+        };
+
+        auto emitData = [&](const DataDirective& d) {
+            const AsmArgument* args = dataArguments.data() + d.first;
+
+            switch (d.kind)
+            {
+            case Dir_Byte:
+                if (!place(d.count, d.token)) {
+                    return false;
+                }
+                for (uint32_t n = 0; n < d.count; n++) {
+                    out[size++] = (Byte)args[n].value;
+                }
+                return true;
+            case Dir_Word:
+                if (!place(d.count * 2, d.token)) {
+                    return false;
+                }
+                for (uint32_t n = 0; n < d.count; n++) {
+                    Word value = resolve(args[n], d.token);
+                    out[size++] = value & 0xFF;
+                    out[size++] = value >> 8;
+                }
+                return true;
+            case Dir_Fill:
+                if (!place(args[0].value, d.token)) {
+                    return false;
+                }
+                std::memset(out.data() + size, d.count > 1 ? args[1].value : 0, args[0].value);
+                size += args[0].value;
+                return true;
+            case Dir_Incbin: {
+                std::string_view path = stream.Text(stream.tokens[d.token + 1]);
+                path = path.substr(1, path.size() - 2);
+
+                try {
+                    MappedFile file{ std::string(path) };
+                    if (!place(file.size, d.token)) {
+                        return false;
+                    }
+                    if (file.size > 0) {
+                        std::memcpy(out.data() + size, file.data, file.size);
+                    }
+                    size += file.size;
+                }
+                catch (const Except& e) {
+                    image.diagnostics.push_back(stream.At(stream.tokens[d.token], e.what()));
+                }
+            } return true;
+            case Dir_Org:
+                if (relocatable) {
+                    image.diagnostics.push_back(stream.At(stream.tokens[d.token], ".org cannot be used in a relocatable object"));
+                    return true;
+                }
+                if (segment.size > 0) {
+                    image.segments.push_back(segment);
+                }
+                address = args[0].value;
+                segment = Segment{ args[0].value, 0, (uint32_t)size };
+                return true;
+            }
+            return true;
+        };
+
+        for (size_t n = 0; n <= instructions.size(); n++)
+        {
+            //Labels and data before this instruction, in source order
+            bool fits = true;
+            while (fits) {
+                bool isLabel = nextLabel < labelDefinitions.size() && labelDefinitions[nextLabel].instruction == n;
+                bool isData = nextData < dataDirectives.size() && dataDirectives[nextData].instruction == n;
+
+                if (isData && (!isLabel || dataDirectives[nextData].labels <= nextLabel)) {
+                    endBlock();
+                    fits = emitData(dataDirectives[nextData++]);
+                    endBlock();
+                }
+                else if (isLabel) {
+                    endBlock(); //Labels start a block
+
+                    const LabelDefinition& label = labelDefinitions[nextLabel++];
+                    Symbol& symbol = symbols[label.symbol];
+                    if (symbol.defined) {
+                        image.diagnostics.push_back(stream.At(stream.tokens[label.token], "Label '" + std::string(stream.symbols.names[label.symbol]) + "' is defined more than once"));
+                        continue;
+                    }
+                    symbol = Symbol{ true, false, (Word)address };
+                }
+                else {
+                    break;
+                }
+            }
+            if (!fits || n == instructions.size()) {
+                break;
+            }
+
+            const AsmInstruction& i = instructions[n];
+            const OperandForm& form = *i.form;
+
+            if (!place(InstructionSize(form), i.token)) {
+                break;
+            }
+
+            out[size++] = form.opcode;
+
+            const OpcodeInfo& info = OPCODES.Info(form.opcode);
+            for (Byte slot = 0; slot < info.argc; slot++)
+            {
+                Word value = resolve(i.args[info.order[slot]], i.token);
+
+                if (OpcodeTable::OperandSize(info.operands[slot], form.opcode >> 7) == 2) {
+                    //Little endian system (least significant portion first)
+                    out[size++] = value & 0xFF;
+                    out[size++] = value >> 8;
+                }
+                else {
+                    out[size++] = value & 0xFF;
+                }
+            }
+
+            block.size += InstructionSize(form);
+            blockCycles += EstimateCycles(form);
+            if (EndsBlock(i)) {
+                endBlock();
+            }
+        }
+
+        endBlock();
+        if (segment.size > 0) {
+            image.segments.push_back(segment);
+        }
+        image.size = (Word)size;
+
+        //Later segments must not land on earlier ones
+        std::vector<Segment> sorted = image.segments;
+        std::sort(sorted.begin(), sorted.end(), [](const Segment& a, const Segment& b) { return a.address < b.address; });
+        for (size_t n = 1; n < sorted.size(); n++) {
+            if ((DWord)sorted[n - 1].address + sorted[n - 1].size > sorted[n].address) {
+                image.diagnostics.push_back(Diagnostic{ 0, 0, "The segment at " + std::to_string(sorted[n].address) +
+                    " overlaps the one at " + std::to_string(sorted[n - 1].address) });
+            }
+        }
+    }
+
+    //One sweep over the fixups, reporting every undefined symbol at its first use. In relocatable
+    //output undefined symbols are imports and .main is optional
+    void Resolve(Image& image, std::span<Byte> out, bool relocatable) {
+        for (const Fixup& fixup : fixups) {
+            Symbol& symbol = symbols[fixup.symbol];
+
+            if (!symbol.defined) {
+                if (!symbol.reported && !relocatable) {
+                    symbol.reported = true;
+                    image.diagnostics.push_back(stream.At(stream.tokens[fixup.token], "Undefined label '" + std::string(stream.symbols.names[fixup.symbol]) + "'"));
+                }
+                continue;
+            }
+
+            out[fixup.offset] = symbol.address & 0xFF;
+            out[fixup.offset + 1] = symbol.address >> 8;
+        }
+
+        //The block map checks the first segment, normally the code at origin
+        Segment code = image.segments.empty() ? Segment{ image.origin, 0, 0 } : image.segments[0];
+        image.blocks.origin = code.address;
+        image.blocks.size = code.size;
+        image.blocks.hash = BlockMap::Hash(out.data() + code.offset, code.size);
+
+        if (relocatable) {
+            return;
+        }
+
+        for (uint32_t id = 0; id < symbols.size(); id++) {
+            if (symbols[id].defined) {
+                image.symbols.push_back(ImageSymbol{ std::string(stream.symbols.names[id]), symbols[id].address });
+            }
+        }
+
+        uint32_t main = stream.symbols.Find(".main");
+        if (main == SymbolInterner::EMPTY || !symbols[main].defined) {
+            image.diagnostics.push_back(Diagnostic{ 0, 0, "The program must contain the .main label" });
+            return;
+        }
+        image.entry = symbols[main].address;
+
+        for (Byte line = 0; line < 8; line++) {
+            uint32_t handler = stream.symbols.Find(".irq" + std::to_string(line));
+            if (handler != SymbolInterner::EMPTY && symbols[handler].defined) {
+                image.interruptVectors[line] = symbols[handler].address;
+                image.interruptMask |= 1 << line;
+            }
+        }
+    }
+};
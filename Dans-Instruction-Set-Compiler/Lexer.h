@@ -0,0 +1,239 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <cctype>
+#include <algorithm>
+#include "../mapped.h"
+
+//Error or warning tied to a source position. Line 0 means the whole program
+struct Diagnostic
+{
+    uint32_t line;
+    uint32_t column;
+    std::string message;
+
+    std::string Text() const {
+        if (line == 0) {
+            return message;
+        }
+        return std::to_string(line) + ":" + std::to_string(column) + ": " + message;
+    }
+};
+
+//A mapped file as source text
+inline std::string_view View(const MappedFile& file) {
+    return std::string_view(file.data ? file.data : "", file.size);
+}
+
+//Interns names (mnemonics, registers, labels) into dense ids. Names are views into the source,
+//so the table only allocates when it grows, never per token
+struct SymbolInterner
+{
+    static constexpr uint32_t EMPTY = 0xFFFFFFFF;
+
+    std::vector<std::string_view> names; //id -> name
+    std::vector<uint32_t> slots{ std::vector<uint32_t>(1024, EMPTY) }; //Open addressing, power of two size
+
+    static uint32_t Hash(std::string_view name) {
+        uint32_t hash = 2166136261u; //FNV-1a
+        for (char c : name) {
+            hash = (hash ^ (uint8_t)c) * 16777619u;
+        }
+        return hash;
+    }
+
+    void Clear() {
+        names.clear();
+        std::fill(slots.begin(), slots.end(), EMPTY);
+    }
+
+    uint32_t Intern(std::string_view name) {
+        size_t mask = slots.size() - 1;
+        for (size_t i = Hash(name) & mask;; i = (i + 1) & mask) {
+            uint32_t id = slots[i];
+            if (id == EMPTY) {
+                id = (uint32_t)names.size();
+                names.push_back(name);
+                slots[i] = id;
+
+                if (names.size() * 2 > slots.size()) {
+                    Grow();
+                }
+                return id;
+            }
+            if (names[id] == name) {
+                return id;
+            }
+        }
+    }
+
+    //Returns EMPTY if the name was never interned
+    uint32_t Find(std::string_view name) const {
+        size_t mask = slots.size() - 1;
+        for (size_t i = Hash(name) & mask;; i = (i + 1) & mask) {
+            uint32_t id = slots[i];
+            if (id == EMPTY || names[id] == name) {
+                return id;
+            }
+        }
+    }
+
+    void Grow() {
+        slots.assign(slots.size() * 2, EMPTY);
+        size_t mask = slots.size() - 1;
+        for (uint32_t id = 0; id < names.size(); id++) {
+            size_t i = Hash(names[id]) & mask;
+            while (slots[i] != EMPTY) {
+                i = (i + 1) & mask;
+            }
+            slots[i] = id;
+        }
+    }
+};
+
+enum TokenKind : uint8_t
+{
+    Tok_Identifier, //Mnemonic, register or label reference (interned)
+    Tok_Label,      //Label definition, without the ':' (interned)
+    Tok_Number,     //Decimal or 0x hex literal
+    Tok_Address,    //[...] with an optional :size suffix
+    Tok_String,     //"..." on one line, including the quotes
+    Tok_Newline,    //End of a line that had tokens
+};
+
+struct Token
+{
+    uint32_t offset; //Into the source
+    uint32_t line; //1 based
+    uint32_t symbol; //Interned id for identifiers and labels
+    uint16_t column; //1 based
+    uint16_t length;
+    TokenKind kind;
+};
+
+struct TokenStream
+{
+    std::string_view source;
+    std::vector<Token> tokens;
+    SymbolInterner symbols;
+
+    std::string_view Text(const Token& token) const {
+        return source.substr(token.offset, token.length);
+    }
+
+    Diagnostic At(const Token& token, std::string message) const {
+        return Diagnostic{ token.line, token.column, std::move(message) };
+    }
+};
+
+/*
+    Single pass lexer over an in-memory (usually memory mapped) source
+
+    Tokens are separated by spaces, tabs or commas. ';' starts a comment that runs to the end of the line.
+    A line with no tokens produces no Tok_Newline, so the parser never sees empty instructions
+    Throws a Diagnostic on malformed input
+*/
+static void Lex(std::string_view source, TokenStream& out) {
+    out.source = source;
+    out.tokens.clear();
+    out.symbols.Clear();
+    out.tokens.reserve(source.size() / 4); //Roughly one token per 4 bytes of typical assembly
+
+    const char* begin = source.data();
+    const char* end = begin + source.size();
+    const char* p = begin;
+    const char* lineStart = begin;
+    uint32_t line = 1;
+    bool lineHasTokens = false;
+
+    auto push = [&](TokenKind kind, const char* start, const char* stop, uint32_t symbol) {
+        if (stop - start > 0xFFFF) {
+            throw Diagnostic{ line, (uint32_t)(start - lineStart + 1), "Token too long" };
+        }
+        out.tokens.push_back(Token{
+            (uint32_t)(start - begin),
+            line,
+            symbol,
+            (uint16_t)(start - lineStart + 1),
+            (uint16_t)(stop - start),
+            kind });
+    };
+
+    while (p < end) {
+        char c = *p;
+
+        if (c == ' ' || c == '\t' || c == ',' || c == '\r') {
+            p++;
+        }
+        else if (c == '\n') {
+            if (lineHasTokens) {
+                push(Tok_Newline, p, p, SymbolInterner::EMPTY);
+            }
+            lineHasTokens = false;
+            lineStart = ++p;
+            line++;
+        }
+        else if (c == ';') {
+            while (p < end && *p != '\n') {
+                p++;
+            }
+        }
+        else if (c == '[') {
+            const char* start = p;
+            while (p < end && *p != ']' && *p != '\n') {
+                p++;
+            }
+            if (p == end || *p != ']') {
+                throw Diagnostic{ line, (uint32_t)(start - lineStart + 1), "Unterminated address" };
+            }
+            p++;
+            if (p < end && *p == ':') { //Size suffix
+                p++;
+                while (p < end && isdigit((unsigned char)*p)) {
+                    p++;
+                }
+            }
+            push(Tok_Address, start, p, SymbolInterner::EMPTY);
+            lineHasTokens = true;
+        }
+        else if (c == '"') {
+            const char* start = p++;
+            while (p < end && *p != '"' && *p != '\n') {
+                p++;
+            }
+            if (p == end || *p != '"') {
+                throw Diagnostic{ line, (uint32_t)(start - lineStart + 1), "Unterminated string" };
+            }
+            p++;
+            push(Tok_String, start, p, SymbolInterner::EMPTY);
+            lineHasTokens = true;
+        }
+        else {
+            const char* start = p;
+            while (p < end && *p != ' ' && *p != '\t' && *p != ',' && *p != '\r' && *p != '\n' && *p != ';') {
+                p++;
+            }
+
+            if (p[-1] == ':') { //Label definition
+                if (lineHasTokens) {
+                    throw Diagnostic{ line, (uint32_t)(start - lineStart + 1), "Labels cannot have spaces" };
+                }
+                push(Tok_Label, start, p - 1, out.symbols.Intern(std::string_view(start, p - 1 - start)));
+            }
+            else if (isdigit((unsigned char)c)) {
+                push(Tok_Number, start, p, SymbolInterner::EMPTY);
+                lineHasTokens = true;
+            }
+            else {
+                push(Tok_Identifier, start, p, out.symbols.Intern(std::string_view(start, p - start)));
+                lineHasTokens = true;
+            }
+        }
+    }
+
+    if (lineHasTokens) {
+        push(Tok_Newline, p, p, SymbolInterner::EMPTY);
+    }
+}
@@ -0,0 +1,197 @@
+#pragma once
+#include <atomic>
+#include <thread>
+#include <cstring>
+#include <unordered_map>
+#include "Assembler.h"
+#include "ObjectCache.h"
+
+//One source file assembled on its own
+struct Unit
+{
+    std::string path;
+    ObjectFile object;
+    Image image; //Diagnostics and optimizer report of the compile
+    bool cached = false; //Loaded from the object cache, image is empty
+};
+
+//Assembles every file into an object, spread over the host's cores. Each worker reuses one Assembler.
+//With a cache, files whose source did not change are loaded instead of assembled
+static std::vector<Unit> CompileUnits(const std::vector<std::string>& paths, bool optimize = true, ObjectCache* cache = nullptr) {
+    std::vector<Unit> units(paths.size());
+    std::atomic<size_t> next{ 0 };
+
+    auto worker = [&]() {
+        Assembler assembler;
+        assembler.optimize = optimize;
+
+        for (size_t i = next++; i < units.size(); i = next++) {
+            Unit& unit = units[i];
+            unit.path = paths[i];
+            unit.object.source = paths[i];
+
+            try {
+                MappedFile file(paths[i]);
+                uint64_t key = cache ? ObjectCache::Key(View(file), optimize, assembler.Includes(View(file))) : 0;
+                if (cache && cache->Load(key, unit.object)) {
+                    unit.object.source = paths[i];
+                    unit.cached = true;
+                    continue;
+                }
+
+                unit.image = assembler.Compile(View(file), unit.object);
+                if (cache && unit.image.Ok()) {
+                    cache->Store(key, unit.object, i);
+                }
+            }
+            catch (const Except& e) {
+                unit.image.diagnostics.push_back(Diagnostic{ 0, 0, e.what() });
+            }
+        }
+    };
+
+    size_t threadCount = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), paths.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < threadCount; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    return units;
+}
+
+/*
+    Places objects one after another from origin and patches their relocations
+
+    Memory layout of a linked program:
+        origin ... origin + size                Code, in object order
+        origin + size ... IO_BASE - stackSize   Heap
+        IO_BASE - stackSize ... IO_BASE         Stack (SP starts at IO_BASE)
+        INTERRUPT_TABLE                         Handlers exported as .irq0 - .irq7 (7 is non-maskable)
+
+    The entry point is the exported .main. Errors are returned in Image::diagnostics
+*/
+struct Linker
+{
+    Word stackSize = 0x400; //Kept free below I/O space
+
+    struct Definition
+    {
+        Word address;
+        size_t object;
+    };
+
+    std::unordered_map<std::string_view, Definition> symbols;
+    std::vector<Word> importAddresses;
+
+    Image Link(const std::vector<const ObjectFile*>& objects, std::span<Byte> out, Word origin = 0) {
+        Image image;
+        image.origin = origin;
+        image.blocks.origin = origin;
+        symbols.clear();
+
+        //Placement and the global symbol table
+        DWord size = 0;
+        std::vector<Word> bases(objects.size());
+        for (size_t n = 0; n < objects.size(); n++) {
+            bases[n] = (Word)(origin + size);
+            size += (DWord)objects[n]->code.size();
+
+            if (origin + size > (DWord)(Memory::IO_BASE - stackSize) || size > out.size()) {
+                image.diagnostics.push_back(Diagnostic{ 0, 0, "Program does not fit: " + objects[n]->source + " ends at " +
+                    std::to_string(origin + size) + ", the stack starts at " + std::to_string(Memory::IO_BASE - stackSize) });
+                return image;
+            }
+
+            for (const ObjectSymbol& symbol : objects[n]->exports) {
+                auto inserted = symbols.emplace(symbol.name, Definition{ (Word)(bases[n] + symbol.offset), n });
+                if (!inserted.second) {
+                    image.diagnostics.push_back(Diagnostic{ 0, 0, "Symbol '" + symbol.name + "' is defined in both " +
+                        objects[inserted.first->second.object]->source + " and " + objects[n]->source });
+                }
+            }
+        }
+        image.size = (Word)size;
+        image.segments.push_back(Segment{ origin, (Word)size, 0 });
+
+        //Code, relocations and blocks
+        for (size_t n = 0; n < objects.size(); n++) {
+            const ObjectFile& object = *objects[n];
+            Byte* code = out.data() + (bases[n] - origin);
+            if (!object.code.empty()) {
+                std::memcpy(code, object.code.data(), object.code.size());
+            }
+
+            importAddresses.assign(object.imports.size(), 0);
+            for (size_t i = 0; i < object.imports.size(); i++) {
+                auto found = symbols.find(object.imports[i]);
+                if (found == symbols.end()) {
+                    image.diagnostics.push_back(Diagnostic{ 0, 0, "Undefined symbol '" + object.imports[i] + "' used in " + object.source });
+                    continue;
+                }
+                importAddresses[i] = found->second.address;
+            }
+
+            for (const Relocation& relocation : object.relocations) {
+                Word value = relocation.symbol == Relocation::LOCAL
+                    ? (Word)(code[relocation.offset] | (code[relocation.offset + 1] << 8)) + bases[n]
+                    : importAddresses[relocation.symbol];
+                code[relocation.offset] = value & 0xFF;
+                code[relocation.offset + 1] = value >> 8;
+            }
+
+            for (BasicBlock block : object.blocks) {
+                block.start += bases[n];
+                image.blocks.blocks.push_back(block);
+            }
+        }
+
+        for (const auto& symbol : symbols) {
+            image.symbols.push_back(ImageSymbol{ std::string(symbol.first), symbol.second.address });
+        }
+        std::sort(image.symbols.begin(), image.symbols.end(), [](const ImageSymbol& a, const ImageSymbol& b) {
+            return a.address != b.address ? a.address < b.address : a.name < b.name; //Same file from the same objects
+        });
+
+        auto main = symbols.find(".main");
+        if (main == symbols.end()) {
+            image.diagnostics.push_back(Diagnostic{ 0, 0, "The program must contain the .main label" });
+        }
+        else {
+            image.entry = main->second.address;
+        }
+
+        for (Byte line = 0; line < 8; line++) {
+            auto handler = symbols.find(".irq" + std::to_string(line));
+            if (handler != symbols.end()) {
+                image.interruptVectors[line] = handler->second.address;
+                image.interruptMask |= 1 << line;
+            }
+        }
+
+        image.blocks.size = image.size;
+        image.blocks.hash = BlockMap::Hash(out.data(), image.size);
+        return image;
+    }
+
+    //Links into Image::text
+    Image Link(const std::vector<const ObjectFile*>& objects, Word origin = 0) {
+        std::vector<Byte> text(Memory::MEM_SIZE - origin);
+        Image image = Link(objects, std::span<Byte>(text), origin);
+        text.resize(image.size);
+        image.text = std::move(text);
+        return image;
+    }
+
+    //Links into guest memory at origin through the current bank mapping, and fills in the interrupt table
+    Image Link(const std::vector<const ObjectFile*>& objects, Memory& mem, Word origin = 0) {
+        Image image = Link(objects, ContiguousMemory(mem, origin), origin);
+        if (image.Ok()) {
+            WriteInterruptTable(image, mem);
+        }
+        return image;
+    }
+};
@@ -0,0 +1,415 @@
+#pragma once
+#include <array>
+#include <span>
+#include <string_view>
+#include "../cpu.h"
+
+enum Instruction {
+    INST_NOOP = 0,
+    INST_RESET,
+    INST_HALT,
+    INST_ADD,
+    INST_SUB,
+    INST_MUL,
+    INST_DIV,
+    INST_CMP,
+    INST_INC,
+    INST_DEC,
+    INST_UXT,
+    INST_MOV,
+    INST_BMOV,
+    INST_BSET,
+    INST_ADD8,
+    INST_SUB8,
+    INST_QADD8,
+    INST_QSUB8,
+    INST_UQADD8,
+    INST_UQSUB8,
+    INST_QADD16,
+    INST_QSUB16,
+    INST_UQADD16,
+    INST_UQSUB16,
+    INST_SMLAD,
+    INST_VLD,
+    INST_VST,
+    INST_VADD8,
+    INST_VSUB8,
+    INST_VUQADD8,
+    INST_VUQSUB8,
+    INST_VADD16,
+    INST_VSUB16,
+    INST_VQADD16,
+    INST_VQSUB16,
+    INST_VMUL16,
+    INST_VMLA16,
+    INST_VSMLAD,
+    INST_JSR,
+    INST_RTN,
+    INST_JMP,
+    INST_JRZ,
+    INST_JRE,
+    INST_JRN,
+    INST_JRG,
+    INST_JRGE,
+    INST_JRL,
+    INST_JRLE,
+    INST_PUSH,
+    INST_POP,
+    INST_PUSHS,
+    INST_POPS,
+    INST_SEI,
+    INST_CLI,
+
+    Count, //Keep last
+};
+
+enum Type
+{
+    Type_Word,
+    Type_Byte,
+    Type_Label,
+    Type_WordAddress,
+    Type_ByteAddress,
+    Type_Register,
+    Type_VectorRegister,
+};
+
+//Sets of operand types accepted by an operand slot
+enum TypeMask : Byte
+{
+    M_Word = 1 << Type_Word,
+    M_Byte = 1 << Type_Byte,
+    M_Label = 1 << Type_Label,
+    M_WordAddress = 1 << Type_WordAddress,
+    M_ByteAddress = 1 << Type_ByteAddress,
+    M_Register = 1 << Type_Register,
+    M_VectorRegister = 1 << Type_VectorRegister,
+
+    M_Constant = M_Word | M_Byte,
+    M_Target = M_Label | M_Word | M_Byte, //Jump target, always encoded as a word
+    M_Any = 0xFF,
+};
+
+//Which assembly operands select an opcode. How they are encoded, and in which order, is in OPCODES
+struct OperandForm
+{
+    Byte argc;
+    Byte masks[3]; //Accepted operand types per slot
+    Byte opcode; //Including the byteMode bit
+    const char* error = nullptr; //Matching this form is an error
+    bool zeroExtends = false; //Byte constant widened to a word, so any constant up to 0xFF may use this form
+};
+
+//Assembler directives, emitting data instead of instructions
+enum Directive : Byte
+{
+    Dir_Byte,   //.byte value...        Bytes
+    Dir_Word,   //.word value/label...  Little endian words
+    Dir_Fill,   //.fill count [value]   count copies of a byte, 0 by default
+    Dir_Incbin, //.incbin "path"        The contents of a file
+    Dir_Org,    //.org address          Continues the program at address
+};
+
+enum EntryKind : Byte
+{
+    Entry_Mnemonic,
+    Entry_Register,
+    Entry_VectorRegister,
+    Entry_Directive,
+};
+
+struct TableEntry
+{
+    std::string_view name;
+    EntryKind kind;
+    Byte value; //Instruction for mnemonics, register number for registers, Directive for directives
+    std::span<const OperandForm> forms;
+};
+
+namespace Forms
+{
+    constexpr Byte BYTE_MODE = 0x80;
+
+    constexpr OperandForm ZeroExtended(OperandForm form) {
+        form.zeroExtends = true;
+        return form;
+    }
+
+    constexpr std::array<OperandForm, 1> None(Opcode op) {
+        return { { { 0, {}, (Byte)op } } };
+    }
+
+    //Register, constant or memory second operand (ADD/SUB/MUL/DIV)
+    constexpr std::array<OperandForm, 5> Arithmetic(Opcode reg, Opcode constant, Opcode memory) {
+        return { {
+            { 2, { M_Register, M_Register }, (Byte)reg },
+            { 2, { M_Register, M_Word }, (Byte)constant },
+            ZeroExtended({ 2, { M_Register, M_Byte }, (Byte)(constant | BYTE_MODE) }),
+            { 2, { M_Register, M_WordAddress }, (Byte)memory },
+            { 2, { M_Register, M_ByteAddress }, (Byte)(memory | BYTE_MODE) },
+        } };
+    }
+
+    //Register or memory operand (INC/DEC)
+    constexpr std::array<OperandForm, 3> Unary(Opcode reg, Opcode memory) {
+        return { {
+            { 1, { M_Register }, (Byte)reg },
+            { 1, { M_WordAddress }, (Byte)memory },
+            { 1, { M_ByteAddress }, (Byte)(memory | BYTE_MODE) },
+        } };
+    }
+
+    //Register compared against a constant or memory, then a jump target
+    constexpr std::array<OperandForm, 4> Branch(Opcode constant, Opcode memory) {
+        return { {
+            { 3, { M_Register, M_Word, M_Target }, (Byte)constant },
+            ZeroExtended({ 3, { M_Register, M_Byte, M_Target }, (Byte)(constant | BYTE_MODE) }),
+            { 3, { M_Register, M_WordAddress, M_Target }, (Byte)memory },
+            { 3, { M_Register, M_ByteAddress, M_Target }, (Byte)(memory | BYTE_MODE) },
+        } };
+    }
+
+    constexpr std::array<OperandForm, 1> Registers2(Opcode op) {
+        return { { { 2, { M_Register, M_Register }, (Byte)op } } };
+    }
+    constexpr std::array<OperandForm, 1> Registers3(Opcode op) {
+        return { { { 3, { M_Register, M_Register, M_Register }, (Byte)op } } };
+    }
+    constexpr std::array<OperandForm, 1> Vectors2(Opcode op) {
+        return { { { 2, { M_VectorRegister, M_VectorRegister }, (Byte)op } } };
+    }
+
+    constexpr auto NOOP = None(OP_NOOP);
+    constexpr auto RESET = None(OP_RESET);
+    constexpr auto HALT = None(OP_HALT);
+    constexpr auto RTN = None(OP_RTN);
+    constexpr auto PUSHS = None(OP_PUSHS);
+    constexpr auto POPS = None(OP_POPS);
+    constexpr auto SEI = None(OP_SEI);
+    constexpr auto CLI = None(OP_CLI);
+
+    constexpr auto ADD = Arithmetic(OP_ADD, OP_ADDC, OP_ADDA);
+    constexpr auto SUB = Arithmetic(OP_SUB, OP_SUBC, OP_SUBA);
+    constexpr auto MUL = Arithmetic(OP_MUL, OP_MULC, OP_MULA);
+    constexpr auto DIV = Arithmetic(OP_DIV, OP_DIVC, OP_DIVA);
+
+    constexpr OperandForm CMP[] = {
+        { 2, { M_Register, M_Register }, OP_CMP },
+        { 2, { M_Register, M_WordAddress }, OP_CMPA },
+        { 2, { M_Register, M_ByteAddress }, OP_CMPA | BYTE_MODE },
+    };
+
+    constexpr auto INC = Unary(OP_INC, OP_INCM);
+    constexpr auto DEC = Unary(OP_DEC, OP_DECM);
+
+    constexpr OperandForm UXT[] = {
+        { 1, { M_Register }, OP_UXT },
+    };
+
+    //Stores encode the source before the destination address. PUSH and stores keep the width of
+    //their constant, so only the load (LDC) zero extends
+    constexpr OperandForm MOV[] = {
+        { 2, { M_Register, M_Register }, OP_LDR },
+        { 2, { M_Register, M_Word }, OP_LDC },
+        ZeroExtended({ 2, { M_Register, M_Byte }, OP_LDC | BYTE_MODE }),
+        { 2, { M_Register, M_WordAddress }, OP_LDM },
+        { 2, { M_Register, M_ByteAddress }, OP_LDM | BYTE_MODE },
+
+        { 2, { M_WordAddress, M_Register }, OP_STRM },
+        { 2, { M_WordAddress, M_Word }, OP_STCM },
+        { 2, { M_WordAddress, M_WordAddress }, OP_STMM },
+        { 2, { M_ByteAddress, M_Register }, OP_STRM | BYTE_MODE },
+        { 2, { M_ByteAddress, M_Byte }, OP_STCM | BYTE_MODE },
+        { 2, { M_ByteAddress, M_ByteAddress }, OP_STMM | BYTE_MODE },
+
+        { 2, { M_WordAddress, M_Byte | M_ByteAddress }, 0, "Cannot move a byte into a word location (requires implicit zero extending)" },
+        { 2, { M_ByteAddress, M_Word | M_WordAddress }, 0, "Cannot move a word into a byte location (requires implicit truncation)" },
+        { 2, { M_Constant | M_Label, M_Any }, 0, "Cannot move a value into constant or program memory" },
+    };
+
+    constexpr auto BMOV = Registers3(OP_BMOV);
+    constexpr auto BSET = Registers3(OP_BSET);
+
+    constexpr auto ADD8 = Registers2(OP_ADD8);
+    constexpr auto SUB8 = Registers2(OP_SUB8);
+    constexpr auto QADD8 = Registers2(OP_QADD8);
+    constexpr auto QSUB8 = Registers2(OP_QSUB8);
+    constexpr auto UQADD8 = Registers2(OP_UQADD8);
+    constexpr auto UQSUB8 = Registers2(OP_UQSUB8);
+    constexpr auto QADD16 = Registers2(OP_QADD16);
+    constexpr auto QSUB16 = Registers2(OP_QSUB16);
+    constexpr auto UQADD16 = Registers2(OP_UQADD16);
+    constexpr auto UQSUB16 = Registers2(OP_UQSUB16);
+    constexpr auto SMLAD = Registers3(OP_SMLAD);
+
+    constexpr OperandForm VLD[] = {
+        { 2, { M_VectorRegister, M_Register }, OP_VLD },
+    };
+    constexpr OperandForm VST[] = {
+        { 2, { M_VectorRegister, M_Register }, OP_VST },
+    };
+    constexpr auto VADD8 = Vectors2(OP_VADD8);
+    constexpr auto VSUB8 = Vectors2(OP_VSUB8);
+    constexpr auto VUQADD8 = Vectors2(OP_VUQADD8);
+    constexpr auto VUQSUB8 = Vectors2(OP_VUQSUB8);
+    constexpr auto VADD16 = Vectors2(OP_VADD16);
+    constexpr auto VSUB16 = Vectors2(OP_VSUB16);
+    constexpr auto VQADD16 = Vectors2(OP_VQADD16);
+    constexpr auto VQSUB16 = Vectors2(OP_VQSUB16);
+    constexpr auto VMUL16 = Vectors2(OP_VMUL16);
+    constexpr OperandForm VMLA16[] = {
+        { 3, { M_VectorRegister, M_VectorRegister, M_VectorRegister }, OP_VMLA16 },
+    };
+    constexpr OperandForm VSMLAD[] = {
+        { 3, { M_Register, M_VectorRegister, M_VectorRegister }, OP_VSMLAD },
+    };
+
+    constexpr OperandForm JSR[] = {
+        { 1, { M_Target }, OP_JSR },
+    };
+    constexpr OperandForm JMP[] = {
+        { 1, { M_Target }, OP_JMP },
+    };
+    constexpr OperandForm JRZ[] = {
+        { 2, { M_Register, M_Target }, OP_JRZ },
+    };
+    constexpr auto JRE = Branch(OP_JRE, OP_JREM);
+    constexpr auto JRN = Branch(OP_JRN, OP_JRNM);
+    constexpr auto JRG = Branch(OP_JRG, OP_JRGM);
+    constexpr auto JRGE = Branch(OP_JRGE, OP_JRGEM);
+    constexpr auto JRL = Branch(OP_JRL, OP_JRLM);
+    constexpr auto JRLE = Branch(OP_JRLE, OP_JRLEM);
+
+    constexpr OperandForm PUSH[] = {
+        { 1, { M_Register }, OP_PUSH },
+        { 1, { M_Word }, OP_PUSHC },
+        { 1, { M_Byte }, OP_PUSHC | BYTE_MODE },
+        { 1, { M_WordAddress }, OP_PUSHM },
+        { 1, { M_ByteAddress }, OP_PUSHM | BYTE_MODE },
+    };
+    constexpr OperandForm POP[] = {
+        { 1, { M_Register }, OP_POP },
+        { 1, { M_WordAddress }, OP_POPM },
+        { 1, { M_ByteAddress }, OP_POPM | BYTE_MODE },
+    };
+}
+
+#define MNEMONIC(name) TableEntry{ #name, Entry_Mnemonic, INST_##name, Forms::name }
+#define REGISTER(name, number) TableEntry{ name, Entry_Register, number, {} }
+#define VECTOR_REGISTER(name, number) TableEntry{ name, Entry_VectorRegister, number, {} }
+#define DIRECTIVE(name, directive) TableEntry{ name, Entry_Directive, directive, {} }
+
+constexpr TableEntry TABLE[] = {
+    TableEntry{ "NOP", Entry_Mnemonic, INST_NOOP, Forms::NOOP },
+    MNEMONIC(RESET), MNEMONIC(HALT),
+    MNEMONIC(ADD), MNEMONIC(SUB), MNEMONIC(MUL), MNEMONIC(DIV), MNEMONIC(CMP),
+    MNEMONIC(INC), MNEMONIC(DEC), MNEMONIC(UXT), MNEMONIC(MOV), MNEMONIC(BMOV), MNEMONIC(BSET),
+    MNEMONIC(ADD8), MNEMONIC(SUB8), MNEMONIC(QADD8), MNEMONIC(QSUB8), MNEMONIC(UQADD8), MNEMONIC(UQSUB8),
+    MNEMONIC(QADD16), MNEMONIC(QSUB16), MNEMONIC(UQADD16), MNEMONIC(UQSUB16), MNEMONIC(SMLAD),
+    MNEMONIC(VLD), MNEMONIC(VST), MNEMONIC(VADD8), MNEMONIC(VSUB8), MNEMONIC(VUQADD8), MNEMONIC(VUQSUB8),
+    MNEMONIC(VADD16), MNEMONIC(VSUB16), MNEMONIC(VQADD16), MNEMONIC(VQSUB16), MNEMONIC(VMUL16),
+    MNEMONIC(VMLA16), MNEMONIC(VSMLAD),
+    MNEMONIC(JSR), MNEMONIC(RTN), MNEMONIC(JMP),
+    MNEMONIC(JRZ), MNEMONIC(JRE), MNEMONIC(JRN), MNEMONIC(JRG), MNEMONIC(JRGE), MNEMONIC(JRL), MNEMONIC(JRLE),
+    MNEMONIC(PUSH), MNEMONIC(POP), MNEMONIC(PUSHS), MNEMONIC(POPS), MNEMONIC(SEI), MNEMONIC(CLI),
+
+    REGISTER("R0", 0), REGISTER("R1", 1), REGISTER("R2", 2), REGISTER("R3", 3),
+    REGISTER("R4", 4), REGISTER("R5", 5), REGISTER("R6", 6), REGISTER("R7", 7),
+    REGISTER("PC", 6), REGISTER("SP", 7),
+    VECTOR_REGISTER("V0", 0), VECTOR_REGISTER("V1", 1), VECTOR_REGISTER("V2", 2), VECTOR_REGISTER("V3", 3),
+
+    DIRECTIVE(".byte", Dir_Byte), DIRECTIVE(".word", Dir_Word), DIRECTIVE(".fill", Dir_Fill),
+    DIRECTIVE(".incbin", Dir_Incbin), DIRECTIVE(".org", Dir_Org),
+};
+
+#undef MNEMONIC
+#undef REGISTER
+#undef VECTOR_REGISTER
+#undef DIRECTIVE
+
+/*
+    Perfect hash over TABLE: a seed is searched at compile time so that every name lands in its
+    own slot, so a lookup is one hash, one slot load and one compare
+*/
+namespace PerfectHash
+{
+    constexpr size_t SLOT_COUNT = 1024;
+    constexpr Byte EMPTY = 0xFF;
+    static_assert(std::size(TABLE) < EMPTY, "Slot indices are stored as bytes");
+
+    constexpr uint32_t Hash(uint32_t seed, std::string_view name) {
+        uint32_t hash = 2166136261u ^ seed; //Seeded FNV-1a with a final mix
+        for (char c : name) {
+            hash = (hash ^ (uint8_t)c) * 16777619u;
+        }
+        hash ^= hash >> 15;
+        hash *= 0x2C1B3C6Du;
+        hash ^= hash >> 12;
+        return hash;
+    }
+
+    constexpr bool IsPerfect(uint32_t seed) {
+        std::array<bool, SLOT_COUNT> used{};
+        for (const auto& entry : TABLE) {
+            size_t slot = Hash(seed, entry.name) % SLOT_COUNT;
+            if (used[slot]) {
+                return false;
+            }
+            used[slot] = true;
+        }
+        return true;
+    }
+
+    constexpr uint32_t FindSeed() {
+        for (uint32_t seed = 0; seed < 10000; seed++) {
+            if (IsPerfect(seed)) {
+                return seed;
+            }
+        }
+        return 0xFFFFFFFF;
+    }
+
+    constexpr uint32_t SEED = FindSeed();
+    static_assert(SEED != 0xFFFFFFFF, "No perfect hash seed found, grow SLOT_COUNT");
+
+    constexpr std::array<Byte, SLOT_COUNT> BuildSlots() {
+        std::array<Byte, SLOT_COUNT> slots{};
+        for (auto& slot : slots) {
+            slot = EMPTY;
+        }
+        for (size_t i = 0; i < std::size(TABLE); i++) {
+            slots[Hash(SEED, TABLE[i].name) % SLOT_COUNT] = (Byte)i;
+        }
+        return slots;
+    }
+
+    constexpr std::array<Byte, SLOT_COUNT> SLOTS = BuildSlots();
+}
+
+//Returns nullptr for names that are not mnemonics, registers or directives
+constexpr const TableEntry* LookupName(std::string_view name) {
+    Byte index = PerfectHash::SLOTS[PerfectHash::Hash(PerfectHash::SEED, name) % PerfectHash::SLOT_COUNT];
+    if (index == PerfectHash::EMPTY || TABLE[index].name != name) {
+        return nullptr;
+    }
+    return &TABLE[index];
+}
+
+static_assert(LookupName("MUL") && LookupName("MUL")->value == INST_MUL, "Perfect hash lookup is broken");
+static_assert(LookupName("SP") && LookupName("SP")->kind == Entry_Register, "Perfect hash lookup is broken");
+static_assert(!LookupName("MUl"), "Perfect hash lookup is broken");
+
+//Every form must select an opcode of its own mnemonic, taking as many operands
+constexpr bool FormsMatchOpcodes() {
+    for (const TableEntry& entry : TABLE) {
+        for (const OperandForm& form : entry.forms) {
+            const OpcodeInfo& info = OPCODES.Info(form.opcode);
+            if (!form.error && (!info.mnemonic || entry.name != info.mnemonic || form.argc != info.argc)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static_assert(FormsMatchOpcodes(), "An operand form disagrees with OPCODES");
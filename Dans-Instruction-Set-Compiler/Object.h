@@ -0,0 +1,186 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fstream>
+#include "../blocks.h"
+#include "Lexer.h"
+
+//Exported label, at an offset into the object's code
+struct ObjectSymbol
+{
+    std::string name;
+    Word offset;
+};
+
+//A 16-bit little endian address in the code that the linker patches
+struct Relocation
+{
+    static constexpr uint32_t LOCAL = 0xFFFFFFFF;
+
+    Word offset; //Into the code
+    uint32_t symbol; //Index into imports, or LOCAL when the stored value is an offset into this object's code
+};
+
+/*
+    Relocatable output of assembling one source file
+
+    Labels are exported unless their name starts with '_'. References to labels the file does not
+    define become imports, resolved by the linker against the other objects' exports.
+
+    File format (little endian):
+        "DOBJ", u16 version, u16 source name length, source name
+        u16 code size, code
+        u16 export count, then per export: u16 name length, name, u16 offset
+        u16 import count, then per import: u16 name length, name
+        u32 relocation count, then per relocation: u16 offset, u32 symbol
+        u32 block count, then per block: u16 start, u16 size, u16 cycles
+*/
+struct ObjectFile
+{
+    static constexpr Word VERSION = 1;
+
+    std::string source; //Path of the source file, for diagnostics
+    std::vector<Byte> code;
+    std::vector<ObjectSymbol> exports;
+    std::vector<std::string> imports;
+    std::vector<Relocation> relocations;
+    std::vector<BasicBlock> blocks; //Starts are offsets into the code
+
+    static bool IsExported(std::string_view name) {
+        return !name.empty() && name[0] != '_';
+    }
+
+    std::vector<Byte> Serialize() const {
+        std::vector<Byte> out;
+        auto put16 = [&](Word value) {
+            out.push_back(value & 0xFF);
+            out.push_back(value >> 8);
+        };
+        auto put32 = [&](DWord value) {
+            put16(value & 0xFFFF);
+            put16(value >> 16);
+        };
+        auto putString = [&](std::string_view text) {
+            put16((Word)text.size());
+            out.insert(out.end(), text.begin(), text.end());
+        };
+
+        out.insert(out.end(), { 'D', 'O', 'B', 'J' });
+        put16(VERSION);
+        putString(source);
+
+        put16((Word)code.size());
+        out.insert(out.end(), code.begin(), code.end());
+
+        put16((Word)exports.size());
+        for (const ObjectSymbol& symbol : exports) {
+            putString(symbol.name);
+            put16(symbol.offset);
+        }
+
+        put16((Word)imports.size());
+        for (const std::string& name : imports) {
+            putString(name);
+        }
+
+        put32((DWord)relocations.size());
+        for (const Relocation& relocation : relocations) {
+            put16(relocation.offset);
+            put32(relocation.symbol);
+        }
+
+        put32((DWord)blocks.size());
+        for (const BasicBlock& block : blocks) {
+            put16(block.start);
+            put16(block.size);
+            put16(block.cycles);
+        }
+        return out;
+    }
+
+    //Returns false if the data is truncated, malformed or from another version
+    bool Deserialize(std::string_view data) {
+        size_t at = 0;
+        bool ok = true;
+        auto get16 = [&]() -> Word {
+            if (at + 2 > data.size()) {
+                ok = false;
+                return 0;
+            }
+            Word value = (Byte)data[at] | ((Byte)data[at + 1] << 8);
+            at += 2;
+            return value;
+        };
+        auto get32 = [&]() -> DWord {
+            DWord low = get16();
+            return low | ((DWord)get16() << 16);
+        };
+        auto getBytes = [&](size_t length) -> std::string_view {
+            if (at + length > data.size()) {
+                ok = false;
+                return {};
+            }
+            std::string_view bytes = data.substr(at, length);
+            at += length;
+            return bytes;
+        };
+
+        if (getBytes(4) != "DOBJ" || get16() != VERSION) {
+            return false;
+        }
+        source = std::string(getBytes(get16()));
+
+        std::string_view bytes = getBytes(get16());
+        code.assign(bytes.begin(), bytes.end());
+
+        exports.resize(get16());
+        for (ObjectSymbol& symbol : exports) {
+            symbol.name = std::string(getBytes(get16()));
+            symbol.offset = get16();
+        }
+
+        imports.resize(get16());
+        for (std::string& name : imports) {
+            name = std::string(getBytes(get16()));
+        }
+
+        DWord relocationCount = get32();
+        relocations.clear();
+        for (DWord i = 0; i < relocationCount && ok; i++) {
+            Word offset = get16();
+            relocations.push_back(Relocation{ offset, get32() });
+        }
+
+        DWord blockCount = get32();
+        blocks.clear();
+        for (DWord i = 0; i < blockCount && ok; i++) {
+            Word start = get16();
+            Word size = get16();
+            blocks.push_back(BasicBlock{ start, size, get16() });
+        }
+
+        for (const Relocation& relocation : relocations) {
+            ok = ok && (size_t)relocation.offset + 2 <= code.size() &&
+                (relocation.symbol == Relocation::LOCAL || relocation.symbol < imports.size());
+        }
+        return ok && at == data.size();
+    }
+
+    bool Save(const std::string& path) const {
+        std::vector<Byte> data = Serialize();
+        std::ofstream file(path, std::ios::binary);
+        file.write((const char*)data.data(), data.size());
+        return (bool)file;
+    }
+
+    bool Load(const std::string& path) {
+        try {
+            MappedFile file(path);
+            return Deserialize(View(file));
+        }
+        catch (const Except&) {
+            return false;
+        }
+    }
+};
@@ -0,0 +1,96 @@
+#pragma once
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "Assembler.h"
+
+/*
+    On-disk cache of assembled objects, so only the files that changed since the last build get assembled again
+
+    Objects are stored as <directory>/<key>.dobj, where the key is a hash of the source text, the files it
+    includes with .incbin, the assembler and object versions and the optimizer setting. A changed file
+    simply gets a new key; stale entries are never read again and can be deleted at any time. Only objects
+    that assembled without errors are stored
+*/
+struct ObjectCache
+{
+    std::string directory;
+    bool enabled = false;
+    std::atomic<size_t> hits{ 0 };
+    std::atomic<size_t> misses{ 0 };
+
+    explicit ObjectCache(std::string directory) : directory(std::move(directory)) {
+        std::error_code error;
+        std::filesystem::create_directories(this->directory, error);
+        enabled = !error;
+        if (!enabled) {
+            std::cout << "WARNING: Cannot create object cache " << this->directory << ", assembling everything\n";
+        }
+    }
+
+    //64-bit FNV-1a, a collision would need the same hash from two different sources. Files pulled in with
+    //.incbin (see Assembler::Includes) are hashed with their contents, so changing one rebuilds the object
+    static uint64_t Key(std::string_view source, bool optimize, const std::vector<std::string>& includes = {}) {
+        uint64_t hash = 14695981039346656037ull;
+        auto mix = [&](Byte value) {
+            hash = (hash ^ value) * 1099511628211ull;
+        };
+        auto mixText = [&](std::string_view text) {
+            for (char c : text) {
+                mix((Byte)c);
+            }
+            mix(0);
+        };
+
+        mixText(source);
+        for (const std::string& path : includes) {
+            mixText(path);
+            try {
+                MappedFile file(path);
+                mixText(std::string_view(file.data, file.size));
+            }
+            catch (const Except&) {
+                mix(0xFF); //Fails to assemble, so it is never stored
+            }
+        }
+        mix(Assembler::VERSION & 0xFF);
+        mix(Assembler::VERSION >> 8);
+        mix(ObjectFile::VERSION & 0xFF);
+        mix(ObjectFile::VERSION >> 8);
+        mix(optimize);
+        return hash;
+    }
+
+    std::string PathOf(uint64_t key) const {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.dobj", (unsigned long long)key);
+        return directory + "/" + name;
+    }
+
+    bool Load(uint64_t key, ObjectFile& object) {
+        bool found = enabled && object.Load(PathOf(key));
+        (found ? hits : misses)++;
+        return found;
+    }
+
+    //Written under a temporary name first, so a build that dies halfway never leaves a truncated object behind
+    void Store(uint64_t key, const ObjectFile& object, size_t writer) {
+        if (!enabled) {
+            return;
+        }
+
+        std::string path = PathOf(key);
+        std::string temporary = path + "." + std::to_string(writer) + ".tmp";
+        std::error_code error;
+        if (object.Save(temporary)) {
+            std::filesystem::rename(temporary, path, error);
+        }
+        else {
+            std::filesystem::remove(temporary, error);
+        }
+    }
+};
@@ -0,0 +1,52 @@
+#pragma once
+#include <vector>
+#include "cpu.h"
+
+struct BasicBlock
+{
+    Word start;
+    Word size; //Bytes
+    Word cycles; //Static cost of running the block once, see OpcodeTable
+};
+
+/*
+    Basic block metadata for an assembled program, so the CPU can charge the cost of a whole block when it
+    enters it instead of counting every fetched byte. It travels in the block section of the program image
+    (see ImageFile), with an FNV-1a hash of the program bytes to catch stale metadata
+
+    A block is entered at its first byte. Code reached some other way (an interrupt returning into the
+    middle of a block) runs uncharged until the next block starts
+*/
+struct BlockMap
+{
+    Word origin = 0;
+    Word size = 0;
+    DWord hash = 0;
+    std::vector<BasicBlock> blocks;
+    std::vector<Word> cyclesAt; //Per address: cost of the block starting there, 0 if none
+
+    static DWord Hash(const Byte* text, Word size) {
+        DWord hash = 2166136261u;
+        for (Word i = 0; i < size; i++) {
+            hash = (hash ^ text[i]) * 16777619u;
+        }
+        return hash;
+    }
+
+    //Checks the program in memory is the one the blocks were built for
+    bool Matches(Memory& mem) const {
+        DWord memHash = 2166136261u;
+        for (Word i = 0; i < size; i++) {
+            memHash = (memHash ^ mem[origin + i]) * 16777619u;
+        }
+        return memHash == hash;
+    }
+
+    void Attach(CPU& cpu) {
+        cyclesAt.assign(Memory::MEM_SIZE, 0);
+        for (const BasicBlock& block : blocks) {
+            cyclesAt[block.start] = block.cycles;
+        }
+        cpu.blockCycles = cyclesAt.data();
+    }
+};
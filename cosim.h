@@ -0,0 +1,132 @@
+#pragma once
+#include <utility>
+#include <vector>
+#include "cpu.h"
+
+/*
+    Co-simulation support: the guest runs until it needs the host, the host services the event and resumes it.
+    Everything a stopped CPU needs to carry on is in CPU itself, see CPU::RunUntil
+
+    HostPort is a block of device registers owned by a host side model. Any guest access to it stops the CPU
+    with STOP_IO at the end of the instruction: writes have landed in regs, reads returned what regs held
+*/
+struct HostPort : IODevice
+{
+    CPU* cpu = nullptr;
+    Word base = 0; //Guest address of the first register
+    std::vector<Byte> regs;
+
+    void Attach(CPU& cpu, Memory& mem, Byte firstBlock, Byte blockCount) {
+        mem.MapDevice(firstBlock, blockCount, this);
+        this->cpu = &cpu;
+        base = Memory::IO_BASE + firstBlock * Memory::IO_BLOCK_SIZE;
+        regs.assign(blockCount * Memory::IO_BLOCK_SIZE, 0);
+    }
+
+    Byte IORead(Word offset) override {
+        Byte value = offset < regs.size() ? regs[offset] : 0;
+        cpu->RequestIOStop(base + offset, value, false);
+        return value;
+    }
+
+    void IOWrite(Word offset, Byte value) override {
+        if (offset < regs.size()) {
+            regs[offset] = value;
+        }
+        cpu->RequestIOStop(base + offset, value, true);
+    }
+};
+
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+
+/*
+    C++20 coroutine view of RunUntil, for hosts that interleave many guests on one thread:
+
+        CoSim sim = Simulate(cpu, mem);
+        while (sim.Resume(10000)) {     //Grant more cycles and run to the next event
+            switch (sim.Event().reason) { ... }
+        }
+
+    The frame only holds the references and the budget, the guest state stays in CPU and Memory.
+    The coroutine finishes when the CPU halts
+*/
+struct CoSim
+{
+    struct promise_type
+    {
+        StopEvent event{};
+        i64 budget = 0;
+
+        CoSim get_return_object() {
+            return CoSim{ std::coroutine_handle<promise_type>::from_promise(*this) };
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        std::suspend_always yield_value(const StopEvent& stop) {
+            event = stop;
+            return {};
+        }
+        void return_void() {}
+        void unhandled_exception() { throw; }
+    };
+
+    //co_await inside Simulate to reach the promise
+    struct PromiseAccess
+    {
+        promise_type* promise = nullptr;
+
+        bool await_ready() { return false; }
+        bool await_suspend(std::coroutine_handle<promise_type> handle) {
+            promise = &handle.promise();
+            return false; //Carry on without suspending
+        }
+        promise_type& await_resume() { return *promise; }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+
+    explicit CoSim(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+    CoSim(CoSim&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    CoSim& operator=(CoSim&& other) noexcept {
+        std::swap(handle, other.handle);
+        return *this;
+    }
+    ~CoSim() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    //Adds cycles to the budget and runs to the next event. Returns false once the guest has halted
+    bool Resume(i64 cycles = 0) {
+        if (handle.done()) {
+            return false;
+        }
+        handle.promise().budget += cycles;
+        handle.resume();
+        return !handle.done();
+    }
+
+    const StopEvent& Event() const {
+        return handle.promise().event;
+    }
+
+    i64 Budget() const {
+        return handle.promise().budget;
+    }
+};
+
+inline CoSim Simulate(CPU& cpu, Memory& mem) {
+    CoSim::promise_type& promise = co_await CoSim::PromiseAccess{};
+
+    while (true) {
+        const StopEvent& stop = cpu.RunUntil(promise.budget, mem);
+        if (stop.reason == STOP_HALT) {
+            promise.event = stop;
+            co_return;
+        }
+        co_yield stop;
+    }
+}
+#endif
@@ -0,0 +1,59 @@
+#pragma once
+#include <vector>
+#include "types.h"
+
+/*
+    What the CPU records while a tracer is attached (see FuzzHarness):
+
+    Edge coverage in an AFL style bitmap: every taken jump, call and return bumps the counter for its
+    (from, to) pair, bitmap[(Scramble(from) >> 1) ^ Scramble(to)]. Counters wrap like AFL's.
+    Dirty pages: physical pages the CPU wrote, so a snapshot can be restored by copying only those
+*/
+struct CoverageTracer
+{
+    static constexpr DWord MAP_SIZE = 1 << 16;
+
+    std::vector<Byte> bitmap = std::vector<Byte>(MAP_SIZE);
+    std::vector<Word> touched; //Bitmap entries hit since the last Clear, so clearing doesn't sweep the map
+
+    std::vector<Byte> dirty; //Per physical page
+    std::vector<DWord> dirtyPages;
+
+    void Resize(DWord pageCount) {
+        dirty.assign(pageCount, 0);
+        dirtyPages.clear();
+    }
+
+    //Spreads nearby addresses over the map
+    static Word Scramble(Word address) {
+        return (Word)((address * 0x9E37u) ^ (address >> 7));
+    }
+
+    void Edge(Word from, Word to) {
+        Word index = (Word)((Scramble(from) >> 1) ^ Scramble(to));
+        if (bitmap[index]++ == 0) {
+            touched.push_back(index);
+        }
+    }
+
+    void Write(DWord page) {
+        if (page < dirty.size() && !dirty[page]) {
+            dirty[page] = 1;
+            dirtyPages.push_back(page);
+        }
+    }
+
+    void ClearEdges() {
+        for (Word index : touched) {
+            bitmap[index] = 0;
+        }
+        touched.clear();
+    }
+
+    void ClearDirty() {
+        for (DWord page : dirtyPages) {
+            dirty[page] = 0;
+        }
+        dirtyPages.clear();
+    }
+};
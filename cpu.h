@@ -1,103 +1,16 @@
 #pragma once
 #include <iostream>
-
-typedef uint8_t Byte;
-typedef uint16_t Word;
-typedef uint32_t DWord;
-
-typedef int64_t i64;
-
-enum Opcode
-{
-    // Opcodes must not excede 0x7F (01111111) due to the byteMode bit!
-
-    //Special
-    OP_NOOP = 0x00,   //No Op
-    OP_RESET = 0x7E,   //Reset the CPU (clears registers and memory, resets flags)
-    OP_HALT = 0x7F,   //Stops the CPU execution of instuctions
-
-    //Arithmetic
-    OP_ADD = 0x01,   //Add two registers, store in first
-    OP_ADDC,                //Add word constant into register
-    OP_ADDA,                //Add register and word at memory address, store in register
-
-    OP_SUB,                 //Subtract two registers, store in first
-    OP_SUBC,                //Subtract constant value from a register, store in register
-    OP_SUBA,                //Subtract the value in memory from a register, store in register
-
-    OP_MUL,                 //Multiply two registers, store in first
-    OP_MULC,                //Multiply constant value from a register, store in register
-    OP_MULA,                //Multiply the value in memory from a register, store in register
-
-    OP_DIV,                 //Divide two registers, store in first
-    OP_DIVC,                //Divide constant value from a register, store in register
-    OP_DIVA,                //Divide the value in memory from a register, store in register
-
-    OP_CMP = 0x0E,   //Subtract two registers and update status flags, discard result
-    OP_CMPA = 0x0F,   //Subtract a value in memory from a register and update status flags, discard result
-
-    //Increment
-    OP_INC = 0x10,   //Increment a value in a register
-    OP_INCM,                //Increment a value in memory
-    OP_DEC,                 //Decrement a value in a register
-    OP_DECM,                //Decrement a value in memory
-
-    //Bitwise
-    OP_UXT = 0x20,   //Zero extend a byte (truncate 16 bit value to 8 bits)
-    //TODO
-
-    //Data moving
-    OP_LDR = 0x30,          //Load value from register into register
-    OP_LDC,                 //Load value constant into register
-    OP_LDM,                 //Load value from memory into register
-
-    OP_STRM,                //Store register into memory
-    OP_STMM,                //Store memory into memory (copies memory)
-    OP_STCM,                //Store constant into memory
-
-    //Are these needed?
-    //[[ TODO
-    OP_SWPM,                //Swap memory values
-    OP_SWPR,                //Swap registers
-    OP_SWPRM,               //Swap register and memory
-    //TODO ]]
-
-    //Control2
-    OP_JSR = 0x40,          //Increment SP by 2, push the current PC to the stack, and jump to a subroutine
-    OP_RTN,                 //Pop the previous PC off the stack and jump to it, decrtant value
-    OP_JMP,                 //Set the program counter (PC) and contion execution
-
-    OP_JRZ,                 //Jump if register is equal to 0
-    OP_JRE,                 //Jump if register is equal to a constant value
-    OP_JRN,                 //Jump if register is not equal to a constant value
-    OP_JRG,                 //Jump if register is greater than a constant value
-    OP_JRL,                 //Jump if register is less than a constant value
-    OP_JRLE,                //Jump if register is less than or equal to a constant value
-    OP_JRGE,                //Jump if register is greater than or equal to a consemory
-
-    OP_JRZM,         //Jump if value in memory is equal to 0
-    OP_JREM,                //Jump if register is equal to a value in memory
-    OP_JRNM,                //Jump if register is not equal to a value in mement the SP by 2
-    OP_JRLM,                //Jump if register is less than a value in memory
-    OP_JRLEM,               //Jump if register is less than or equal to a value in memory
-    OP_JRGM,                //Jump if register is greater than a value in memory
-    OP_JRGEM,               //Jump if register is greater than or equal to a value in memory
-
-    //Stack
-    OP_PUSH = 0x60,   //Push register onto stack, decrement SP by (opsize + 1)
-    OP_PUSHM,               //Push value in memory onto stack, decrement SP by (opsize + 1)
-    OP_PUSHC,               //Push constant onto stack, decrement SP by (opsize + 1)
-
-    OP_POP,                 //Pop value from stack into register, increment SP by (opsize + 1)
-    OP_POPM,                //Pop value from stack into register, increment SP by (opsize + 1)
-
-    OP_PUSHS,               //Push status onto stack, decrement SP by (opsize + 1)
-    OP_POPS,                //Pop stack into status, increment SP by (opsize + 1)
-
-    OP_SEI = 0x70,   //Set the global interrupt enable flag
-    OP_CLI,                 //Clear the global interrupt enable flag
-
-};
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
+#include "types.h"
+#include "dsp.h"
+#include "timing.h"
+#include "coverage.h"
+#include "opcodes.h"
 
 enum Interrupt
 {
@@ -116,12 +29,21 @@ enum Opsize {
     Size_Byte,
 };
 
+struct IODevice
+{
+    //Offset is relative to the start of the first I/O block the device is mapped to
+    virtual Byte IORead(Word offset) = 0;
+    virtual void IOWrite(Word offset, Byte value) = 0;
+};
+
 struct Memory
 {
     /*
         +-----------------+ 0xFFFF
-        | SetInterrupt Table |   ->   Stores 8 interrupt handler addresses
+        | Interrupt Table |   ->   Stores 8 interrupt handler addresses
         +-----------------+ 0xFFF0
+        |    I/O Space    |   ->   15 blocks of 16 bytes (bank registers are blocks 0-1)
+        +-----------------+ 0xFF00
         |    Stack (v)    |
         +-----------------+
         |                 |
@@ -136,25 +58,262 @@ struct Memory
         +-----------------+
         |   Program (^)   |
         +-----------------+ 0x0000
+
+        The 64 KiB CPU address space is split into 16 windows of 4 KiB. Each window has a bank
+        register in I/O space selecting which 4 KiB page of the physical store it maps to, so
+        the physical store can be up to 256 MiB. On reset window N maps to page N (flat memory).
     */
 
-    static constexpr Word MEM_SIZE = 0xFFFF;
+    static constexpr DWord MEM_SIZE = 0x10000;
+    static constexpr Word IO_BASE = 0xFF00;
     static constexpr Word INTERRUPT_TABLE = 0xFFF0;
 
-    Byte* Data = new Byte[MEM_SIZE];
-    //Byte Data[MEM_SIZE];
+    static constexpr Byte PAGE_SHIFT = 12;
+    static constexpr Word PAGE_SIZE = 1 << PAGE_SHIFT;
+    static constexpr Word PAGE_MASK = PAGE_SIZE - 1;
+    static constexpr Byte WINDOW_COUNT = MEM_SIZE >> PAGE_SHIFT;
+
+    static constexpr Byte IO_BLOCK_SIZE = 16;
+    static constexpr Byte IO_BLOCK_COUNT = (INTERRUPT_TABLE - IO_BASE) / IO_BLOCK_SIZE;
+    static constexpr Byte IO_BANK_BLOCKS = (WINDOW_COUNT * 2) / IO_BLOCK_SIZE;
+
+    std::vector<Byte> Data; //Physical store
+    Word banks[WINDOW_COUNT]; //Bank register per window
+    Byte* windows[WINDOW_COUNT]; //Translation table: window -> host pointer, refilled on bank writes
+    IODevice* devices[IO_BLOCK_COUNT]{};
+    Byte deviceBase[IO_BLOCK_COUNT]{}; //First block of the device mapped at each block
+
+    Memory(DWord physicalSize = MEM_SIZE) : Data(physicalSize < MEM_SIZE ? MEM_SIZE : (physicalSize + PAGE_MASK) & ~(DWord)PAGE_MASK) {
+        ResetBanks();
+    }
+
+    //Copies must point the translation table at their own store
+    Memory(const Memory& other) : Data(other.Data) {
+        std::memcpy(devices, other.devices, sizeof(devices));
+        std::memcpy(deviceBase, other.deviceBase, sizeof(deviceBase));
+        std::memcpy(banks, other.banks, sizeof(banks));
+        for (Byte i = 0; i < WINDOW_COUNT; i++) {
+            RefillWindow(i);
+        }
+    }
+    Memory& operator=(const Memory& other) {
+        Data = other.Data;
+        std::memcpy(devices, other.devices, sizeof(devices));
+        std::memcpy(deviceBase, other.deviceBase, sizeof(deviceBase));
+        std::memcpy(banks, other.banks, sizeof(banks));
+        for (Byte i = 0; i < WINDOW_COUNT; i++) {
+            RefillWindow(i);
+        }
+        return *this;
+    }
 
     void Clear() {
-        memset(Data, 0, MEM_SIZE);
+        std::memset(Data.data(), 0, Data.size());
+        ResetBanks();
+    }
+
+    DWord PageCount() const {
+        return (DWord)(Data.size() >> PAGE_SHIFT);
+    }
+
+    void ResetBanks() {
+        for (Byte i = 0; i < WINDOW_COUNT; i++) {
+            banks[i] = i;
+            RefillWindow(i);
+        }
+    }
+
+    void SetBank(Byte window, Word bank) {
+        banks[window] = bank;
+        RefillWindow(window);
+    }
+
+    void RefillWindow(Byte window) {
+        //Out of range banks wrap around the physical store
+        windows[window] = Data.data() + ((DWord)(banks[window] % PageCount()) << PAGE_SHIFT);
+    }
+
+    void MapDevice(Byte firstBlock, Byte blockCount, IODevice* device) {
+        for (Byte i = firstBlock; i < firstBlock + blockCount && i < IO_BLOCK_COUNT; i++) {
+            devices[i] = device;
+            deviceBase[i] = firstBlock;
+        }
+    }
+
+    static bool IsIO(Word address) {
+        return address >= IO_BASE && address < INTERRUPT_TABLE;
+    }
+
+    //Guest accesses (I/O aware)
+    Byte Read(Word address) {
+        if (IsIO(address)) {
+            return IORead(address);
+        }
+        return windows[address >> PAGE_SHIFT][address & PAGE_MASK];
+    }
+    void Write(Word address, Byte value) {
+        if (IsIO(address)) {
+            IOWrite(address, value);
+            return;
+        }
+        windows[address >> PAGE_SHIFT][address & PAGE_MASK] = value;
+    }
+
+    Byte IORead(Word address) {
+        Word offset = address - IO_BASE;
+        Byte block = offset / IO_BLOCK_SIZE;
+
+        if (block < IO_BANK_BLOCKS) {
+            Word bank = banks[offset >> 1];
+            return (offset & 1) ? bank >> 8 : bank & 0xFF;
+        }
+        if (IODevice* device = devices[block]) {
+            return device->IORead(offset - deviceBase[block] * IO_BLOCK_SIZE);
+        }
+        return 0; //Unmapped I/O reads as zero
+    }
+    void IOWrite(Word address, Byte value) {
+        Word offset = address - IO_BASE;
+        Byte block = offset / IO_BLOCK_SIZE;
+
+        if (block < IO_BANK_BLOCKS) {
+            Byte window = offset >> 1;
+            Word bank = (offset & 1) ? (banks[window] & 0x00FF) | (value << 8) : (banks[window] & 0xFF00) | value;
+            SetBank(window, bank);
+            return;
+        }
+        if (IODevice* device = devices[block]) {
+            device->IOWrite(offset - deviceBase[block] * IO_BLOCK_SIZE, value);
+        }
     }
 
+    static bool TouchesIO(Word address, Word length) {
+        return address < INTERRUPT_TABLE && (DWord)address + length > IO_BASE;
+    }
+
+    //Bytes left in the window containing address
+    static Word WindowRoom(Word address) {
+        return PAGE_SIZE - (address & PAGE_MASK);
+    }
+
+    //Guest block copy with memmove semantics. Copies in chunks that never cross a window boundary,
+    //so every chunk is contiguous on the host. Chunks touching I/O space go byte by byte
+    void Move(Word dst, Word src, Word length) {
+        if (dst == src || length == 0) {
+            return;
+        }
+
+        if ((Word)(dst - src) < length) { //Destination overlaps the tail of the source, copy backwards
+            Word dstEnd = dst + length;
+            Word srcEnd = src + length;
+
+            while (length > 0) {
+                Word dstRoom = (dstEnd & PAGE_MASK) ? (dstEnd & PAGE_MASK) : PAGE_SIZE;
+                Word srcRoom = (srcEnd & PAGE_MASK) ? (srcEnd & PAGE_MASK) : PAGE_SIZE;
+                Word n = std::min({ length, dstRoom, srcRoom });
+                dstEnd -= n;
+                srcEnd -= n;
+
+                if (TouchesIO(dstEnd, n) || TouchesIO(srcEnd, n)) {
+                    for (Word i = n; i > 0; i--) {
+                        Write(dstEnd + i - 1, Read(srcEnd + i - 1));
+                    }
+                }
+                else {
+                    std::memmove(&(*this)[dstEnd], &(*this)[srcEnd], n);
+                }
+                length -= n;
+            }
+        }
+        else {
+            while (length > 0) {
+                Word n = std::min({ length, WindowRoom(dst), WindowRoom(src) });
+
+                if (TouchesIO(dst, n) || TouchesIO(src, n)) {
+                    for (Word i = 0; i < n; i++) {
+                        Write(dst + i, Read(src + i));
+                    }
+                }
+                else {
+                    std::memmove(&(*this)[dst], &(*this)[src], n);
+                }
+                dst += n;
+                src += n;
+                length -= n;
+            }
+        }
+    }
+
+    void Fill(Word dst, Byte value, Word length) {
+        while (length > 0) {
+            Word n = std::min(length, WindowRoom(dst));
+
+            if (TouchesIO(dst, n)) {
+                for (Word i = 0; i < n; i++) {
+                    Write(dst + i, value);
+                }
+            }
+            else {
+                std::memset(&(*this)[dst], value, n);
+            }
+            dst += n;
+            length -= n;
+        }
+    }
+
+    //Guest block reads/writes (I/O aware), contiguous host copies per window
+    void ReadBlock(Word address, Byte* out, Word length) {
+        while (length > 0) {
+            Word n = std::min(length, WindowRoom(address));
+
+            if (TouchesIO(address, n)) {
+                for (Word i = 0; i < n; i++) {
+                    out[i] = Read(address + i);
+                }
+            }
+            else {
+                std::memcpy(out, &(*this)[address], n);
+            }
+            address += n;
+            out += n;
+            length -= n;
+        }
+    }
+    void WriteBlock(Word address, const Byte* in, Word length) {
+        while (length > 0) {
+            Word n = std::min(length, WindowRoom(address));
+
+            if (TouchesIO(address, n)) {
+                for (Word i = 0; i < n; i++) {
+                    Write(address + i, in[i]);
+                }
+            }
+            else {
+                std::memcpy(&(*this)[address], in, n);
+            }
+            address += n;
+            in += n;
+            length -= n;
+        }
+    }
+
+    //Host accesses (translated, bypass I/O)
     Byte operator[](Word address) const {
-        return Data[address];
+        return windows[address >> PAGE_SHIFT][address & PAGE_MASK];
     }
 
     Byte& operator[](Word address) {
+        return windows[address >> PAGE_SHIFT][address & PAGE_MASK];
+    }
+
+    Byte& Physical(DWord address) {
         return Data[address];
     }
+
+    //Physical store offset a CPU address currently maps to
+    DWord PhysicalAddress(Word address) const {
+        return (DWord)(windows[address >> PAGE_SHIFT] - Data.data()) + (address & PAGE_MASK);
+    }
 };
 
 union Registers //Not including special registers
@@ -200,100 +359,625 @@ union Registers //Not including special registers
     }
 };
 
-struct CPU {
+struct CPU;
+
+struct BusMaster //A device that shares the memory bus with the CPU (e.g. DMA)
+{
+    bool active = false; //Only stepped while active
+
+    //Called after each instruction with the bus cycles the CPU just used. Returns the cycles the CPU was stalled for
+    virtual i64 Step(CPU& cpu, Memory& mem, i64 cpuCycles) = 0;
+};
+
+struct PerfCounters
+{
+    uint64_t cycles;
+    uint64_t instructions;
+    uint64_t branches; //Taken jumps, calls and returns
+    uint64_t reads; //Data reads (not instruction fetches)
+    uint64_t writes;
+    uint64_t interrupts;
+};
+
+enum StopReason : Byte
+{
+    STOP_NONE,
+    STOP_BUDGET, //The cycle budget ran out
+    STOP_HALT,
+    STOP_IO, //The guest accessed a device that asked to be serviced (see CPU::RequestIOStop)
+    STOP_BREAKPOINT, //About to execute an instruction with a breakpoint
+    STOP_FAULT, //A guest fault with no handler, or a fault while handling one. PC points at the faulting instruction
+};
+
+enum FaultCause : Byte
+{
+    FAULT_NONE,
+    FAULT_ILLEGAL, //Unknown opcode
+    FAULT_DIVIDE_BY_ZERO,
+    FAULT_STACK_OVERFLOW, //A push went below the stack limit, the write was dropped
+    FAULT_BAD_VECTOR, //An interrupt vector points into I/O space or the interrupt table
+};
+
+static constexpr const char* FAULT_NAMES[] = { "No fault", "Illegal instruction", "Divide by zero", "Stack overflow", "Bad interrupt vector" };
+
+/*
+    Fault status, mapped to I/O block 8 (0xFF80 - 0xFF8F)
+
+        +0  CAUSE       (Byte)  FaultCause being handled, write anything to acknowledge it
+        +2  PC          (Word)  Faulting instruction (for a bad vector, the instruction that was interrupted)
+        +4  ADDRESS     (Word)  Opcode, memory operand, SP or vector, depending on the cause
+        +6  STACK_LIMIT (Word)  Lowest address a push may write, 0 disables the check. Image loaders set it to the
+                                end of the program
+
+    Faults are taken through interrupt table entry 7 (the non-maskable line, doubling as HardFault) at the end of
+    the faulting instruction, which has no other effect. The handler entry stacks status and the faulting PC like
+    an interrupt, unless that would overflow the stack. A table entry of 0 means no handler: RunUntil stops with
+    STOP_FAULT instead. So does a fault raised before the last one was acknowledged (lockup)
+*/
+struct FaultRegisters : IODevice
+{
+    static constexpr Byte BLOCK = 8;
+    static constexpr Byte VECTOR_LINE = 7;
+
+    FaultCause cause = FAULT_NONE;
+    Word pc = 0;
+    Word address = 0;
+    Word stackLimit = 0;
+
+    Byte IORead(Word offset) override {
+        switch (offset)
+        {
+        case 0: return cause;
+        case 2: return pc & 0xFF;
+        case 3: return pc >> 8;
+        case 4: return address & 0xFF;
+        case 5: return address >> 8;
+        case 6: return stackLimit & 0xFF;
+        case 7: return stackLimit >> 8;
+        default: return 0;
+        }
+    }
+
+    void IOWrite(Word offset, Byte value) override {
+        switch (offset)
+        {
+        case 0: cause = FAULT_NONE; break;
+        case 6: stackLimit = (stackLimit & 0xFF00) | value; break;
+        case 7: stackLimit = (stackLimit & 0x00FF) | (value << 8); break;
+        default: break;
+        }
+    }
+};
+
+//Why RunUntil returned. PC is where execution resumes
+struct StopEvent
+{
+    StopReason reason = STOP_NONE;
+    Word pc = 0;
+
+    //STOP_IO: the first device access of the instruction, and the bytes that followed it
+    Word address = 0;
+    Word value = 0; //Little endian, up to 2 bytes
+    Byte length = 0;
+    bool write = false;
+
+    //STOP_FAULT (address is also set, see FaultRegisters)
+    FaultCause fault = FAULT_NONE;
+    bool lockup = false; //Raised while an earlier fault was unacknowledged
+};
+
+//Cycle counter handed to the access helpers while a TimingModel is attached
+struct TimedCost
+{
+    i64& cost; //Per byte costs, exactly as on the untimed path
+    i64& cycles; //Stalls are always charged here, even while whole blocks are
+    TimingModel& model;
+    Memory& mem;
+    Word pc; //Instruction the accesses are made for
+
+    void operator--(int) {
+        cost--;
+    }
+    void operator-=(i64 value) {
+        cost -= value;
+    }
+};
+
+//Cycle counter handed to the access helpers while a CoverageTracer is attached. Costs are charged as untimed
+struct TracedCost
+{
+    i64& cost;
+    CoverageTracer& tracer;
+    Memory& mem;
+
+    void operator--(int) {
+        cost--;
+    }
+    void operator-=(i64 value) {
+        cost -= value;
+    }
+};
+
+//Which access helpers Run is compiled with
+enum RunMode
+{
+    RUN_PLAIN,
+    RUN_TIMED, //TimedCost
+    RUN_TRACED, //TracedCost
+};
+
+struct CPU : IODevice {
+    /*
+        Performance counters, mapped read-only to I/O blocks 4-5 (0xFF40 - 0xFF5F)
+
+        +0  CYCLES, +4 INSTRUCTIONS, +8 BRANCHES, +12 READS, +16 WRITES, +20 INTERRUPTS (DWord each)
+        +24 CTRL    (Byte)  bit 0: reset all counters, bit 1: latch
+
+        Reads return the snapshot taken by the last latch (or reset), so a multi-byte
+        counter can't tear. The request takes effect at the end of the writing instruction
+    */
+    static constexpr Byte PERF_BLOCK = 4;
+    static constexpr Byte PERF_BLOCK_COUNT = 2;
+    static constexpr Byte PERF_CTRL = 24;
+
+    enum PerfControl
+    {
+        PERF_CTRL_RESET = 1 << 0,
+        PERF_CTRL_LATCH = 1 << 1,
+    };
+
     //Registers
     Registers registers;
+    DSP::Vector vectors[DSP::VECTOR_COUNT];
     bool halted = false;
+    bool exited = false; //Halted by a semihosting EXIT, with exitCode
+    Word exitCode = 0;
+
+    std::ostream* log = &std::cout; //Where the CPU reports, Semihost::Attach points it at the instance's batched output
+
+    Word resetPC = 0; //Where execution starts after a reset, set by the program loader
+    Word resetSP = Memory::IO_BASE; //Stack grows backwards from the start of I/O space
+
+    const Word* blockCycles = nullptr; //Per address block costs (BlockMap::Attach), charged instead of fetched bytes
+    BusMaster* busMaster = nullptr;
+    TimingModel* timing = nullptr; //Optional cache/TCM model, Execute only pays for it while attached
+    CoverageTracer* tracer = nullptr; //Edge coverage and dirty pages for FuzzHarness, takes precedence over timing
+    std::vector<Byte> breakpoints; //Per address, empty while no breakpoint is set
+    bool attention = false; //Set by devices that need servicing at the end of the current instruction
+
+    PerfCounters perf{}; //Host visible, up to date whenever Execute returns
+    PerfCounters latched{}; //Guest visible snapshot
+    Byte perfRequest = 0;
+
+    StopEvent stop{}; //Last reason RunUntil returned
+    StopEvent pendingStop{}; //Requested during the current instruction, taken at its end
+
+    FaultRegisters faults;
+    FaultCause pendingFault = FAULT_NONE; //Raised during the current instruction, taken at its end
+    Word pendingFaultAddress = 0;
+
+    void PublishCounters(PerfCounters& live, i64& cycleMark, i64 cycles) {
+        perf.cycles += cycleMark - cycles;
+        perf.instructions += live.instructions;
+        perf.branches += live.branches;
+        perf.reads += live.reads;
+        perf.writes += live.writes;
+        perf.interrupts += live.interrupts;
+
+        live = PerfCounters{};
+        cycleMark = cycles;
+    }
+
+    Byte IORead(Word offset) override {
+        if (offset >= PERF_CTRL) {
+            return 0;
+        }
+
+        const uint64_t* counters = &latched.cycles;
+        return (counters[offset / 4] >> ((offset % 4) * 8)) & 0xFF;
+    }
+
+    void IOWrite(Word offset, Byte value) override {
+        if (offset == PERF_CTRL && (value & (PERF_CTRL_RESET | PERF_CTRL_LATCH))) {
+            perfRequest |= value;
+            attention = true;
+        }
+    }
 
     void SetInterrupt(Interrupt i) {
-        registers.interruptFlags &= i;
+        registers.interruptFlags |= i;
+    }
+
+    void Exit(Word code) {
+        exitCode = code;
+        exited = true;
+        halted = true;
+    }
+
+    void RaiseFault(FaultCause cause, Word address) {
+        if (pendingFault == FAULT_NONE) {
+            pendingFault = cause;
+            pendingFaultAddress = address;
+        }
+        attention = true;
+    }
+
+    void SetBreakpoint(Word address, bool enabled = true) {
+        if (breakpoints.empty()) {
+            breakpoints.assign(Memory::MEM_SIZE, 0);
+        }
+        breakpoints[address] = enabled;
+    }
+
+    //Called by devices to hand an access to the host: RunUntil returns STOP_IO at the end of the instruction
+    void RequestIOStop(Word address, Byte value, bool write) {
+        if (pendingStop.reason == STOP_NONE) {
+            pendingStop = StopEvent{ STOP_IO, 0, address, value, 1, write };
+        }
+        else if (pendingStop.reason == STOP_IO && pendingStop.write == write && pendingStop.length < 2 && address == pendingStop.address + pendingStop.length) {
+            pendingStop.value |= value << (8 * pendingStop.length);
+            pendingStop.length++;
+        }
+        attention = true;
     }
 
     void Reset(Memory& mem) {
         mem.Clear();
+        mem.MapDevice(PERF_BLOCK, PERF_BLOCK_COUNT, this);
+        mem.MapDevice(FaultRegisters::BLOCK, 1, &faults);
+        faults.cause = FAULT_NONE;
+        pendingFault = FAULT_NONE;
 
-        registers.PC = 0;
-        registers.SP = 0xFFFF; //Stack grows backwards from end
+        registers.PC = resetPC;
+        registers.SP = resetSP;
         memset(registers.aligned, 0, 6);
     }
 
-    Byte FetchByte(i64& cycles, Memory& mem) {
-        cycles--;
-        return mem[registers.PC++];
+    //Timing hooks: no-ops on a plain cycle counter, so the untimed loop compiles to what it was
+    void MarkInstruction(i64&, Word) {}
+    void MarkInstruction(TimedCost& cycles, Word pc) {
+        cycles.pc = pc;
+    }
+    void Stall(i64&, Word, AccessKind) {}
+    void Stall(TimedCost& cycles, Word address, AccessKind kind) {
+        cycles.cycles -= cycles.model.Access(cycles.pc, address, cycles.mem.PhysicalAddress(address), kind);
+    }
+    void StallBlock(i64&, Word, Word, AccessKind) {}
+    void StallBlock(TimedCost& cycles, Word address, Word length, AccessKind kind) {
+        for (Word i = 0; i < length; i++) {
+            Stall(cycles, address + i, kind);
+        }
+    }
+
+    //Tracer hooks: only writes and taken branches are recorded
+    void MarkInstruction(TracedCost&, Word) {}
+    void Stall(TracedCost& cycles, Word address, AccessKind kind) {
+        if (kind == ACCESS_WRITE) {
+            cycles.tracer.Write(cycles.mem.PhysicalAddress(address) >> Memory::PAGE_SHIFT);
+        }
+    }
+    void StallBlock(TracedCost& cycles, Word address, Word length, AccessKind kind) {
+        if (kind != ACCESS_WRITE) {
+            return;
+        }
+        for (DWord done = 0; done < length;) { //One mark per window touched
+            Word at = (Word)(address + done);
+            cycles.tracer.Write(cycles.mem.PhysicalAddress(at) >> Memory::PAGE_SHIFT);
+            done += Memory::WindowRoom(at);
+        }
     }
-    Byte ReadByte(i64& cycles, Memory& mem, Word address) const {
+    template<typename Cost>
+    void Branch(Cost&, PerfCounters& live, Word) {
+        live.branches++;
+    }
+    void Branch(TracedCost& cycles, PerfCounters& live, Word from) {
+        live.branches++;
+        cycles.tracer.Edge(from, registers.PC);
+    }
+
+    template<typename Cost>
+    Byte FetchByte(Cost& cycles, Memory& mem) {
+        Stall(cycles, registers.PC, ACCESS_FETCH);
         cycles--;
-        return mem[address];
+        return mem[registers.PC++];
     }
-    Byte& ReadByte(i64& cycles, Memory& mem, Word address) {
+    template<typename Cost>
+    Byte ReadByte(Cost& cycles, PerfCounters& live, Memory& mem, Word address) {
+        Stall(cycles, address, ACCESS_READ);
         cycles--;
-        return mem[address];
+        live.reads++;
+        return mem.Read(address);
     }
-    void WriteByte(i64& cycles, Memory& mem, Word address, Byte value) {
-        mem[address] = value;
+    template<typename Cost>
+    void WriteByte(Cost& cycles, PerfCounters& live, Memory& mem, Word address, Byte value) {
+        Stall(cycles, address, ACCESS_WRITE);
+        mem.Write(address, value);
+        live.writes++;
         cycles--;
     }
-    void StackPushByte(i64& cycles, Memory& mem, Byte value) {
+    template<typename Cost>
+    void StackPushByte(Cost& cycles, PerfCounters& live, Memory& mem, Byte value) {
         registers.SP--;
-        WriteByte(cycles, mem, registers.SP, value);
+        if (registers.SP < faults.stackLimit) {
+            RaiseFault(FAULT_STACK_OVERFLOW, registers.SP++);
+            return;
+        }
+        WriteByte(cycles, live, mem, registers.SP, value);
     }
-    Byte StackPopByte(i64& cycles, Memory& mem) {
-        Word value = ReadByte(cycles, mem, registers.SP);
+    template<typename Cost>
+    Byte StackPopByte(Cost& cycles, PerfCounters& live, Memory& mem) {
+        Word value = ReadByte(cycles, live, mem, registers.SP);
         registers.SP++;
         return value;
     }
 
-    Word FetchWord(i64& cycles, Memory& mem) {
+    template<typename Cost>
+    Word FetchWord(Cost& cycles, Memory& mem) {
+        StallBlock(cycles, registers.PC, 2, ACCESS_FETCH);
         Word word = mem[registers.PC++];
         word |= (mem[registers.PC++] << 8); //Little endian system
 
         cycles -= 2;
         return word;
     }
-    Word ReadWord(i64& cycles, Memory& mem, Word address) const {
-        Word word = mem[address];
-        word |= (mem[address + 1] << 8); //Little endian system
+    template<typename Cost>
+    Word ReadWord(Cost& cycles, PerfCounters& live, Memory& mem, Word address) {
+        StallBlock(cycles, address, 2, ACCESS_READ);
+        Word word = mem.Read(address);
+        word |= (mem.Read(address + 1) << 8); //Little endian system
 
         cycles -= 2;
+        live.reads += 2;
         return word;
     }
-    void WriteWord(i64& cycles, Memory& mem, Word address, Word value) {
-        mem[address] = value & 0xFF; //Get the lowest 8 bits
-        mem[address + 1] = value >> 8; //Get ths highest 8 bits
+    template<typename Cost>
+    void WriteWord(Cost& cycles, PerfCounters& live, Memory& mem, Word address, Word value) {
+        StallBlock(cycles, address, 2, ACCESS_WRITE);
+        mem.Write(address, value & 0xFF); //Get the lowest 8 bits
+        mem.Write(address + 1, value >> 8); //Get ths highest 8 bits
+        live.writes += 2;
         cycles -= 2;
     }
-    void StackPushWord(i64& cycles, Memory& mem, Word value) {
+    template<typename Cost>
+    void StackPushWord(Cost& cycles, PerfCounters& live, Memory& mem, Word value) {
         registers.SP -= 2;
-        WriteWord(cycles, mem, registers.SP, value);
+        if (registers.SP < faults.stackLimit) {
+            RaiseFault(FAULT_STACK_OVERFLOW, registers.SP);
+            registers.SP += 2;
+            return;
+        }
+        WriteWord(cycles, live, mem, registers.SP, value);
     }
-    Word StackPopWord(i64& cycles, Memory& mem) {
-        Word value = ReadWord(cycles, mem, registers.SP);
+    template<typename Cost>
+    Word StackPopWord(Cost& cycles, PerfCounters& live, Memory& mem) {
+        Word value = ReadWord(cycles, live, mem, registers.SP);
         registers.SP += 2;
         return value;
     }
 
-    void ExecuteInterrupt(i64& cycles, Memory& mem, Interrupt i) {
-        StackPushByte(cycles, mem, registers.status);
-        StackPushWord(cycles, mem, registers.PC);
+    //An instruction's operand fields, in encoding order. Registers are their number
+    struct Operands
+    {
+        Word values[3];
+
+        Word operator[](Byte i) const {
+            return values[i];
+        }
+    };
+
+    template<typename Cost>
+    Word FetchOperand(Cost&, Memory&, bool, std::integral_constant<OperandKind, OPERAND_NONE>) {
+        return 0;
+    }
+    template<typename Cost>
+    Word FetchOperand(Cost& cycles, Memory& mem, bool, std::integral_constant<OperandKind, OPERAND_REGISTER>) {
+        return FetchByte(cycles, mem);
+    }
+    template<typename Cost>
+    Word FetchOperand(Cost& cycles, Memory& mem, bool, std::integral_constant<OperandKind, OPERAND_VECTOR>) {
+        return FetchByte(cycles, mem);
+    }
+    template<typename Cost>
+    Word FetchOperand(Cost& cycles, Memory& mem, bool byteMode, std::integral_constant<OperandKind, OPERAND_VALUE>) {
+        return byteMode ? FetchByte(cycles, mem) : FetchWord(cycles, mem);
+    }
+    template<typename Cost>
+    Word FetchOperand(Cost& cycles, Memory& mem, bool, std::integral_constant<OperandKind, OPERAND_ADDRESS>) {
+        return FetchWord(cycles, mem);
+    }
+    template<typename Cost>
+    Word FetchOperand(Cost& cycles, Memory& mem, bool, std::integral_constant<OperandKind, OPERAND_TARGET>) {
+        return FetchWord(cycles, mem);
+    }
 
-        registers.PC = ReadWord(cycles, mem, Memory::INTERRUPT_TABLE + (i * 2));
+    //Fetches the operands OPCODES lists for OP. The layout is a compile time constant, so this is the same
+    //sequence of FetchByte/FetchWord calls a hand written case would make
+    template<Opcode OP, typename Cost>
+    Operands Decode(Cost& cycles, Memory& mem, bool byteMode) {
+        return Operands{ {
+            FetchOperand(cycles, mem, byteMode, std::integral_constant<OperandKind, OPCODES.info[OP].operands[0]>()),
+            FetchOperand(cycles, mem, byteMode, std::integral_constant<OperandKind, OPCODES.info[OP].operands[1]>()),
+            FetchOperand(cycles, mem, byteMode, std::integral_constant<OperandKind, OPCODES.info[OP].operands[2]>()),
+        } };
+    }
+
+    static bool BadVector(Word vector) {
+        return vector >= Memory::IO_BASE;
+    }
+
+    //Line is the interrupt number (0 - 7), not the Interrupt flag
+    template<typename Cost>
+    void ExecuteInterrupt(Cost& cycles, PerfCounters& live, Memory& mem, Byte line) {
+        Word vector = ReadWord(cycles, live, mem, Memory::INTERRUPT_TABLE + (line * 2));
+        registers.interruptFlags &= ~(1 << line); //Clear the flag for this interrupt
+        if (BadVector(vector)) {
+            RaiseFault(FAULT_BAD_VECTOR, vector);
+            return;
+        }
+
+        Word sp = registers.SP;
+        StackPushByte(cycles, live, mem, registers.status);
+        StackPushWord(cycles, live, mem, registers.PC);
+        if (pendingFault) { //The entry overflowed the stack
+            registers.SP = sp;
+            return;
+        }
+
+        registers.PC = vector;
         registers.I = 0; //Disable low priority interrupts from interrupting this routine
-        registers.interruptFlags &= ~(1 << i); //Clear the flag for this interrupt
+    }
+
+    //Takes pendingFault for the instruction at pc: enters the handler, or stops when there is none
+    template<typename Cost>
+    void ExecuteFault(Cost& cycles, PerfCounters& live, Memory& mem, Word pc) {
+        FaultCause cause = pendingFault;
+        Word address = pendingFaultAddress;
+        pendingFault = FAULT_NONE;
+
+        Word vector = ReadWord(cycles, live, mem, Memory::INTERRUPT_TABLE + FaultRegisters::VECTOR_LINE * 2);
+
+        bool lockup = faults.cause != FAULT_NONE;
+        if (lockup || vector == 0 || BadVector(vector)) {
+            registers.PC = pc;
+            pendingStop = StopEvent{ STOP_FAULT, pc, address };
+            pendingStop.fault = cause;
+            pendingStop.lockup = lockup;
+            return;
+        }
+
+        faults.cause = cause;
+        faults.pc = pc;
+        faults.address = address;
+
+        //Stack like an interrupt, unless that would overflow too
+        if (registers.SP >= faults.stackLimit + 3) {
+            registers.SP -= 3;
+            WriteByte(cycles, live, mem, registers.SP + 2, registers.status);
+            WriteWord(cycles, live, mem, registers.SP, pc);
+        }
+        registers.PC = vector;
+        registers.I = 0;
+    }
+
+    //The cycle counter the helpers charge: a plain i64 untimed, or routed through the timing model or the tracer
+    i64& MakeCost(i64& cost, i64&, Memory&, std::integral_constant<RunMode, RUN_PLAIN>) {
+        return cost;
+    }
+    TimedCost MakeCost(i64& cost, i64& cycles, Memory& mem, std::integral_constant<RunMode, RUN_TIMED>) {
+        return TimedCost{ cost, cycles, *timing, mem, registers.PC };
+    }
+    TracedCost MakeCost(i64& cost, i64&, Memory& mem, std::integral_constant<RunMode, RUN_TRACED>) {
+        return TracedCost{ cost, *tracer, mem };
+    }
+
+    //Runs until the budget is used up or something needs the host, then returns why. cycles is what is left of the
+    //budget, so the host can service the event and call again to carry on. Only RESET reports, to log
+    const StopEvent& RunUntil(i64& cycles, Memory& mem) {
+        if (halted) {
+            stop = StopEvent{ STOP_HALT, registers.PC };
+            return stop;
+        }
+
+        if (tracer) {
+            Run<RUN_TRACED>(cycles, mem);
+        }
+        else if (timing) {
+            Run<RUN_TIMED>(cycles, mem);
+        }
+        else {
+            Run<RUN_PLAIN>(cycles, mem);
+        }
+        if (stop.reason == STOP_NONE) {
+            stop.reason = halted ? STOP_HALT : STOP_BUDGET;
+        }
+        stop.pc = registers.PC;
+        return stop;
+    }
+
+    //Runs for a cycle budget and returns what is left of it, negative when the last instruction overran.
+    //Device accesses and breakpoints don't stop it
+    i64 RunFor(i64 cycles, Memory& mem) {
+        while (RunUntil(cycles, mem).reason == STOP_IO || stop.reason == STOP_BREAKPOINT) {}
+        return cycles;
     }
 
     void Execute(i64 cycles, Memory& mem) {
+        bool wasHalted = halted;
+        cycles = RunFor(cycles, mem);
+
+        switch (stop.reason)
+        {
+        case STOP_HALT:
+            if (!wasHalted) {
+                if (exited) {
+                    *log << "INFO: The program exited with code " << exitCode << "\n";
+                }
+                else {
+                    *log << "INFO: HALT instruction executed. The CPU will now stop\n";
+                }
+            }
+            break;
+        case STOP_FAULT: {
+            char pc[8];
+            std::snprintf(pc, sizeof(pc), "0x%04X", stop.pc);
+            *log << "ERROR: " << FAULT_NAMES[stop.fault] << " at " << pc << (stop.lockup ? " while handling a fault" : "") << ". The CPU will now stop\n";
+        } break;
+        default: break;
+        }
+        if (cycles < 0) {
+            *log << "WARNING: CPU used additional cycles\n";
+        }
+    }
+
+    template<RunMode MODE>
+    void Run(i64& cycles, Memory& mem) {
+        PerfCounters live{}; //Counted locally, published into perf lazily
+        i64 cycleMark = cycles;
+
+        i64 untimed = 0; //Absorbs the per byte costs while whole blocks are charged
+        auto&& cost = MakeCost(blockCycles ? untimed : cycles, cycles, mem, std::integral_constant<RunMode, MODE>());
+        auto&& interruptCost = MakeCost(cycles, cycles, mem, std::integral_constant<RunMode, MODE>());
+        int resumeAt = stop.reason == STOP_BREAKPOINT ? registers.PC : -1; //Don't stop at the breakpoint we are resuming from
+        stop = StopEvent{};
+
         while (cycles > 0 && !halted)
         {
+            i64 cyclesBefore = cycles;
+
             //Is high priority interrupt flag set?
-            if (registers.interruptFlags & I_NM) {
-                ExecuteInterrupt(cycles, mem, I_NM);
+            MarkInstruction(interruptCost, registers.PC);
+            if ((registers.interruptFlags & I_NM) || (registers.I && registers.interruptFlags > 0)) {
+                int line = (registers.interruptFlags & I_NM) ? 7 : log2(registers.interruptFlags & -registers.interruptFlags); //Lowest set bit
+                ExecuteInterrupt(interruptCost, live, mem, (Byte)line);
+                live.interrupts++;
+
+                if (pendingFault) { //Bad vector, or the entry overflowed the stack
+                    ExecuteFault(interruptCost, live, mem, registers.PC);
+                    if (pendingStop.reason != STOP_NONE) {
+                        stop = pendingStop;
+                        pendingStop = StopEvent{};
+                        break;
+                    }
+                }
             }
-            else if (registers.I && registers.interruptFlags > 0) {
-                int lowestSetBit = log2(registers.interruptFlags & -registers.interruptFlags) + 1;
-                ExecuteInterrupt(cycles, mem, (Interrupt)lowestSetBit);
+
+            if (!breakpoints.empty()) {
+                if (breakpoints[registers.PC] && registers.PC != resumeAt) {
+                    stop.reason = STOP_BREAKPOINT;
+                    break;
+                }
+                resumeAt = -1;
             }
 
-            Byte instByte = FetchByte(cycles, mem);
+            if (blockCycles) {
+                cycles -= blockCycles[registers.PC]; //0 unless a block starts here
+            }
+
+            live.instructions++;
+
+            Word instructionPC = registers.PC;
+            MarkInstruction(cost, instructionPC);
+            Byte instByte = FetchByte(cost, mem);
             Opcode instruction = (Opcode)(instByte & 0x7F);
             bool byteMode = (instByte >> 7) == 1; //0 -> 16bit, 1 -> 8bit)
             
@@ -302,308 +986,440 @@ struct CPU {
             case OP_NOOP: break;
             case OP_RESET: {
                 Reset(mem);
-                std::cout << "INFO: RESET instruction executed\n";
+                *log << "INFO: RESET instruction executed\n";
             } break;
             case OP_HALT: {
                 halted = true;
-                std::cout << "INFO: HALT instruction executed. The CPU will now stop\n";
             } break;
             case OP_INC: {
-                Byte reg = FetchByte(cycles, mem);
-                registers[reg]++;
+                Operands op = Decode<OP_INC>(cost, mem, byteMode);
+                registers[op[0]]++;
             } break;
             case OP_INCM: {
-                Word address = FetchWord(cycles, mem);
-                Word value = byteMode ? ReadByte(cycles, mem, address) : ReadWord(cycles, mem, address) + 1;
-                byteMode ? WriteByte(cycles, mem, address, value & 0xFF) : WriteWord(cycles, mem, address, value);
+                Word address = Decode<OP_INCM>(cost, mem, byteMode)[0];
+                Word value = byteMode ? ReadByte(cost, live, mem, address) : ReadWord(cost, live, mem, address) + 1;
+                byteMode ? WriteByte(cost, live, mem, address, value & 0xFF) : WriteWord(cost, live, mem, address, value);
             } break;
             case OP_DEC: {
-                Byte reg = FetchByte(cycles, mem);
-                registers[reg]--;
+                Operands op = Decode<OP_DEC>(cost, mem, byteMode);
+                registers[op[0]]--;
             } break;
             case OP_DECM: {
-                Word address = FetchWord(cycles, mem);
-                Word value = byteMode ? ReadByte(cycles, mem, address) : ReadWord(cycles, mem, address) - 1;
-                byteMode ? WriteByte(cycles, mem, address, value & 0xFF) : WriteWord(cycles, mem, address, value);
+                Word address = Decode<OP_DECM>(cost, mem, byteMode)[0];
+                Word value = byteMode ? ReadByte(cost, live, mem, address) : ReadWord(cost, live, mem, address) - 1;
+                byteMode ? WriteByte(cost, live, mem, address, value & 0xFF) : WriteWord(cost, live, mem, address, value);
 
             } break;
             case OP_ADD: {
-                Byte reg1 = FetchByte(cycles, mem);
-                Byte reg2 = FetchByte(cycles, mem);
-
-                registers[reg1] = registers[reg1] + registers[reg2];
+                Operands op = Decode<OP_ADD>(cost, mem, byteMode);
+                registers[op[0]] = registers[op[0]] + registers[op[1]];
             } break;
             case OP_ADDC: {
-                Byte reg = FetchByte(cycles, mem);
-                Word value = byteMode ? FetchByte(cycles, mem) : FetchWord(cycles, mem);
-
-                registers[reg] = registers[reg] + value;
+                Operands op = Decode<OP_ADDC>(cost, mem, byteMode);
+                registers[op[0]] = registers[op[0]] + op[1];
             } break;
             case OP_ADDA: {
-                Byte reg = FetchByte(cycles, mem);
-                Word address = FetchWord(cycles, mem);
-                Word memValue = byteMode ? ReadByte(cycles, mem, address) : ReadWord(cycles, mem, address);
+                Operands op = Decode<OP_ADDA>(cost, mem, byteMode);
+                Word memValue = byteMode ? ReadByte(cost, live, mem, op[1]) : ReadWord(cost, live, mem, op[1]);
 
-                registers[reg] = registers[reg] + memValue;
+                registers[op[0]] = registers[op[0]] + memValue;
             } break;
             case OP_SUB: {
-                Byte reg1 = FetchByte(cycles, mem);
-                Byte reg2 = FetchByte(cycles, mem);
-
-                registers[reg1] = registers[reg1] - registers[reg2];
+                Operands op = Decode<OP_SUB>(cost, mem, byteMode);
+                registers[op[0]] = registers[op[0]] - registers[op[1]];
             } break;
             case OP_SUBC: {
-                Byte reg = FetchByte(cycles, mem);
-                Word value = byteMode ? FetchByte(cycles, mem) : FetchWord(cycles, mem);
-
-                registers[reg] = registers[reg] - value;
+                Operands op = Decode<OP_SUBC>(cost, mem, byteMode);
+                registers[op[0]] = registers[op[0]] - op[1];
             } break;
             case OP_SUBA: {
-                Byte reg = FetchByte(cycles, mem);
-                Word address = FetchWord(cycles, mem);
-                Word memValue = byteMode ? ReadByte(cycles, mem, address) : ReadWord(cycles, mem, address);
+                Operands op = Decode<OP_SUBA>(cost, mem, byteMode);
+                Word memValue = byteMode ? ReadByte(cost, live, mem, op[1]) : ReadWord(cost, live, mem, op[1]);
 
-                registers[reg] = registers[reg] - memValue;
+                registers[op[0]] = registers[op[0]] - memValue;
             } break;
             case OP_MUL: {
-                Byte reg1 = FetchByte(cycles, mem);
-                Byte reg2 = FetchByte(cycles, mem);
-
-                registers[reg1] = registers[reg1] * registers[reg2];
+                Operands op = Decode<OP_MUL>(cost, mem, byteMode);
+                registers[op[0]] = registers[op[0]] * registers[op[1]];
             } break;
             case OP_MULC: {
-                Byte reg = FetchByte(cycles, mem);
-                Word value = byteMode ? FetchByte(cycles, mem) : FetchWord(cycles, mem);
-
-                registers[reg] = registers[reg] * value;
+                Operands op = Decode<OP_MULC>(cost, mem, byteMode);
+                registers[op[0]] = registers[op[0]] * op[1];
             } break;
             case OP_MULA: {
-                Byte reg = FetchByte(cycles, mem);
-                Word address = FetchWord(cycles, mem);
-                Word memValue = byteMode ? ReadByte(cycles, mem, address) : ReadWord(cycles, mem, address);
+                Operands op = Decode<OP_MULA>(cost, mem, byteMode);
+                Word memValue = byteMode ? ReadByte(cost, live, mem, op[1]) : ReadWord(cost, live, mem, op[1]);
 
-                registers[reg] = registers[reg] * memValue;
+                registers[op[0]] = registers[op[0]] * memValue;
             } break;
             case OP_DIV: {
-                Byte reg1 = FetchByte(cycles, mem);
-                Byte reg2 = FetchByte(cycles, mem);
+                Operands op = Decode<OP_DIV>(cost, mem, byteMode);
 
-                registers[reg1] = registers[reg1] / registers[reg2];
+                if (registers[op[1]] == 0) {
+                    RaiseFault(FAULT_DIVIDE_BY_ZERO, 0);
+                    break;
+                }
+                registers[op[0]] = registers[op[0]] / registers[op[1]];
             } break;
             case OP_DIVC: {
-                Byte reg = FetchByte(cycles, mem);
-                Word value = byteMode ? FetchByte(cycles, mem) : FetchWord(cycles, mem);
+                Operands op = Decode<OP_DIVC>(cost, mem, byteMode);
 
-                registers[reg] = registers[reg] / value;
+                if (op[1] == 0) {
+                    RaiseFault(FAULT_DIVIDE_BY_ZERO, 0);
+                    break;
+                }
+                registers[op[0]] = registers[op[0]] / op[1];
             } break;
             case OP_DIVA: {
-                Byte reg = FetchByte(cycles, mem);
-                Word address = FetchWord(cycles, mem);
-                Word memValue = byteMode ? ReadByte(cycles, mem, address) : ReadWord(cycles, mem, address);
+                Operands op = Decode<OP_DIVA>(cost, mem, byteMode);
+                Word memValue = byteMode ? ReadByte(cost, live, mem, op[1]) : ReadWord(cost, live, mem, op[1]);
 
-                registers[reg] = registers[reg] / memValue;
+                if (memValue == 0) {
+                    RaiseFault(FAULT_DIVIDE_BY_ZERO, op[1]);
+                    break;
+                }
+                registers[op[0]] = registers[op[0]] / memValue;
+            } break;
+            case OP_ADD8:
+            case OP_SUB8:
+            case OP_QADD8:
+            case OP_QSUB8:
+            case OP_UQADD8:
+            case OP_UQSUB8:
+            case OP_QADD16:
+            case OP_QSUB16:
+            case OP_UQADD16:
+            case OP_UQSUB16: {
+                static_assert(OPCODES.SameOperands(OP_ADD8, OP_UQSUB16), "Packed operations share their decoding");
+                Operands op = Decode<OP_ADD8>(cost, mem, byteMode);
+                Word a = registers[op[0]];
+                Word b = registers[op[1]];
+                Word& d = registers[op[0]];
+
+                switch (instruction)
+                {
+                case OP_ADD8: d = DSP::Add8(a, b); break;
+                case OP_SUB8: d = DSP::Sub8(a, b); break;
+                case OP_QADD8: d = DSP::QAdd8(a, b); break;
+                case OP_QSUB8: d = DSP::QSub8(a, b); break;
+                case OP_UQADD8: d = DSP::UQAdd8(a, b); break;
+                case OP_UQSUB8: d = DSP::UQSub8(a, b); break;
+                case OP_QADD16: d = DSP::QAdd16(a, b); break;
+                case OP_QSUB16: d = DSP::QSub16(a, b); break;
+                case OP_UQADD16: d = DSP::UQAdd16(a, b); break;
+                default: d = DSP::UQSub16(a, b); break;
+                }
+            } break;
+            case OP_SMLAD: {
+                Operands op = Decode<OP_SMLAD>(cost, mem, byteMode);
+                registers[op[0]] = DSP::SMLAD(registers[op[0]], registers[op[1]], registers[op[2]]);
+            } break;
+            case OP_VLD: {
+                Operands op = Decode<OP_VLD>(cost, mem, byteMode);
+                DSP::Vector& v = vectors[op[0] % DSP::VECTOR_COUNT];
+                Word address = registers[op[1]];
+
+                StallBlock(cost, address, DSP::VECTOR_SIZE, ACCESS_READ);
+                mem.ReadBlock(address, v.bytes, DSP::VECTOR_SIZE);
+                cost -= DSP::VECTOR_SIZE;
+                live.reads += DSP::VECTOR_SIZE;
+            } break;
+            case OP_VST: {
+                Operands op = Decode<OP_VST>(cost, mem, byteMode);
+                DSP::Vector& v = vectors[op[0] % DSP::VECTOR_COUNT];
+                Word address = registers[op[1]];
+
+                StallBlock(cost, address, DSP::VECTOR_SIZE, ACCESS_WRITE);
+                mem.WriteBlock(address, v.bytes, DSP::VECTOR_SIZE);
+                cost -= DSP::VECTOR_SIZE;
+                live.writes += DSP::VECTOR_SIZE;
+            } break;
+            case OP_VADD8:
+            case OP_VSUB8:
+            case OP_VUQADD8:
+            case OP_VUQSUB8:
+            case OP_VADD16:
+            case OP_VSUB16:
+            case OP_VQADD16:
+            case OP_VQSUB16:
+            case OP_VMUL16: {
+                static_assert(OPCODES.SameOperands(OP_VADD8, OP_VMUL16), "Vector operations share their decoding");
+                Operands op = Decode<OP_VADD8>(cost, mem, byteMode);
+                DSP::Vector& d = vectors[op[0] % DSP::VECTOR_COUNT];
+                const DSP::Vector& v = vectors[op[1] % DSP::VECTOR_COUNT];
+
+                switch (instruction)
+                {
+                case OP_VADD8: DSP::VAdd8(d, v); break;
+                case OP_VSUB8: DSP::VSub8(d, v); break;
+                case OP_VUQADD8: DSP::VUQAdd8(d, v); break;
+                case OP_VUQSUB8: DSP::VUQSub8(d, v); break;
+                case OP_VADD16: DSP::VAdd16(d, v); break;
+                case OP_VSUB16: DSP::VSub16(d, v); break;
+                case OP_VQADD16: DSP::VQAdd16(d, v); break;
+                case OP_VQSUB16: DSP::VQSub16(d, v); break;
+                default: DSP::VMul16(d, v); break;
+                }
+            } break;
+            case OP_VMLA16: {
+                Operands op = Decode<OP_VMLA16>(cost, mem, byteMode);
+                DSP::VMla16(vectors[op[0] % DSP::VECTOR_COUNT], vectors[op[1] % DSP::VECTOR_COUNT], vectors[op[2] % DSP::VECTOR_COUNT]);
+            } break;
+            case OP_VSMLAD: {
+                Operands op = Decode<OP_VSMLAD>(cost, mem, byteMode);
+                registers[op[0]] = DSP::VSMLAD(registers[op[0]], vectors[op[1] % DSP::VECTOR_COUNT], vectors[op[2] % DSP::VECTOR_COUNT]);
             } break;
             case OP_UXT: {
-                Byte reg = FetchByte(cycles, mem);
-                registers[reg] &= 0xFF;
-            }
+                Operands op = Decode<OP_UXT>(cost, mem, byteMode);
+                registers[op[0]] &= 0xFF;
+            } break;
             case OP_LDR: {
-                Byte reg1 = FetchByte(cycles, mem);
-                Byte reg2 = FetchByte(cycles, mem);
-                registers[reg1] = registers[reg2];
+                Operands op = Decode<OP_LDR>(cost, mem, byteMode);
+                registers[op[0]] = registers[op[1]];
             } break;
             case OP_LDC: {
-                Byte reg = FetchByte(cycles, mem);
-                registers[reg] = byteMode ? FetchByte(cycles, mem) : FetchWord(cycles, mem);
+                Operands op = Decode<OP_LDC>(cost, mem, byteMode);
+                registers[op[0]] = op[1];
             } break;
             case OP_LDM: {
-                Byte reg = FetchByte(cycles, mem);
-                Word address = FetchWord(cycles, mem);
-                registers[reg] = byteMode ? ReadByte(cycles, mem, address) : ReadWord(cycles, mem, address);
+                Operands op = Decode<OP_LDM>(cost, mem, byteMode);
+                registers[op[0]] = byteMode ? ReadByte(cost, live, mem, op[1]) : ReadWord(cost, live, mem, op[1]);
             } break;
             case OP_STRM: {
-                Byte reg = FetchByte(cycles, mem);
-                Word address = FetchWord(cycles, mem);
+                Operands op = Decode<OP_STRM>(cost, mem, byteMode);
+                byteMode ? WriteByte(cost, live, mem, op[1], registers[op[0]]) : WriteWord(cost, live, mem, op[1], registers[op[0]]);
+            } break;
+            case OP_STMM: {
+                Operands op = Decode<OP_STMM>(cost, mem, byteMode); //Destination, source
 
-                byteMode ? WriteByte(cycles, mem, address, registers[reg]) : WriteWord(cycles, mem, address, registers[reg]);
+                if (byteMode) {
+                    WriteByte(cost, live, mem, op[0], ReadByte(cost, live, mem, op[1]));
+                }
+                else {
+                    WriteWord(cost, live, mem, op[0], ReadWord(cost, live, mem, op[1]));
+                }
+            } break;
+            case OP_BMOV: {
+                Operands op = Decode<OP_BMOV>(cost, mem, byteMode);
+                Word dstAddress = registers[op[0]];
+                Word srcAddress = registers[op[1]];
+                Word length = registers[op[2]];
+
+                StallBlock(cost, srcAddress, length, ACCESS_READ);
+                StallBlock(cost, dstAddress, length, ACCESS_WRITE);
+                mem.Move(dstAddress, srcAddress, length);
+                cycles -= 2 * (i64)length; //One read and one write per byte, same as a guest copy loop without the loop overhead
+                live.reads += length;
+                live.writes += length;
+            } break;
+            case OP_BSET: {
+                Operands op = Decode<OP_BSET>(cost, mem, byteMode);
+                Word dstAddress = registers[op[0]];
+                Byte value = registers[op[1]] & 0xFF;
+                Word length = registers[op[2]];
+
+                StallBlock(cost, dstAddress, length, ACCESS_WRITE);
+                mem.Fill(dstAddress, value, length);
+                cycles -= length; //One write per byte
+                live.writes += length;
             } break;
             case OP_STCM: {
-                Word value = byteMode ? FetchByte(cycles, mem) : FetchWord(cycles, mem);
-                Word address = FetchWord(cycles, mem);
-
-                byteMode ? WriteByte(cycles, mem, address, value) : WriteWord(cycles, mem, address, value);
+                Operands op = Decode<OP_STCM>(cost, mem, byteMode);
+                byteMode ? WriteByte(cost, live, mem, op[1], op[0] & 0xFF) : WriteWord(cost, live, mem, op[1], op[0]);
             } break;
             case OP_JMP: {
-                registers.PC = FetchWord(cycles, mem);
+                registers.PC = Decode<OP_JMP>(cost, mem, byteMode)[0];
+                Branch(cost, live, instructionPC);
             } break;
-            case OP_JRZ: {
-                if (registers[FetchByte(cycles, mem)] == 0) {
-                    registers.PC = FetchWord(cycles, mem);
+            case OP_JRZ: { //Decoded by hand, the target is only fetched when the jump is taken
+                if (registers[FetchByte(cost, mem)] == 0) {
+                    registers.PC = FetchWord(cost, mem);
+                    Branch(cost, live, instructionPC);
                 }
                 else {
                     registers.PC += 2; //Avoid wasting 2 cycles with FetchWord()
                 }
             } break;
             case OP_JRE: {
-                Byte reg = FetchByte(cycles, mem);
-                Word value = byteMode ? FetchByte(cycles, mem) : FetchWord(cycles, mem);
-                Word address = FetchWord(cycles, mem);
+                Operands op = Decode<OP_JRE>(cost, mem, byteMode);
 
-                if (registers[reg] == value) {
-                    registers.PC = address;
+                if (registers[op[0]] == op[1]) {
+                    registers.PC = op[2];
+                    Branch(cost, live, instructionPC);
                 }
             } break;
             case OP_JRN: {
-                Byte reg = FetchByte(cycles, mem);
-                Word value = byteMode ? FetchByte(cycles, mem) : FetchWord(cycles, mem);
-                Word address = FetchWord(cycles, mem);
+                Operands op = Decode<OP_JRN>(cost, mem, byteMode);
 
-                if (registers[reg] != value) {
-                    registers.PC = address;
+                if (registers[op[0]] != op[1]) {
+                    registers.PC = op[2];
+                    Branch(cost, live, instructionPC);
                 }
             } break;
             case OP_JRG: {
-                Byte reg = FetchByte(cycles, mem);
-                Word value = byteMode ? FetchByte(cycles, mem) : FetchWord(cycles, mem);
-                Word address = FetchWord(cycles, mem);
+                Operands op = Decode<OP_JRG>(cost, mem, byteMode);
 
-                if (registers[reg] > value) {
-                    registers.PC = address;
+                if (registers[op[0]] > op[1]) {
+                    registers.PC = op[2];
+                    Branch(cost, live, instructionPC);
                 }
             } break;
             case OP_JRGE: {
-                Byte reg = FetchByte(cycles, mem);
-                Word value = byteMode ? FetchByte(cycles, mem) : FetchWord(cycles, mem);
-                Word address = FetchWord(cycles, mem);
+                Operands op = Decode<OP_JRGE>(cost, mem, byteMode);
 
-                if (registers[reg] >= value) {
-                    registers.PC = address;
+                if (registers[op[0]] >= op[1]) {
+                    registers.PC = op[2];
+                    Branch(cost, live, instructionPC);
                 }
             } break;
             case OP_JRL: {
-                Byte reg = FetchByte(cycles, mem);
-                Word value = byteMode ? FetchByte(cycles, mem) : FetchWord(cycles, mem);
-                Word address = FetchWord(cycles, mem);
+                Operands op = Decode<OP_JRL>(cost, mem, byteMode);
 
-                if (registers[reg] < value) {
-                    registers.PC = address;
+                if (registers[op[0]] < op[1]) {
+                    registers.PC = op[2];
+                    Branch(cost, live, instructionPC);
                 }
             } break;
             case OP_JRLE: {
-                Byte reg = FetchByte(cycles, mem);
-                Word value = byteMode ? FetchByte(cycles, mem) : FetchWord(cycles, mem);
-                Word address = FetchWord(cycles, mem);
+                Operands op = Decode<OP_JRLE>(cost, mem, byteMode);
 
-                if (registers[reg] <= value) {
-                    registers.PC = address;
+                if (registers[op[0]] <= op[1]) {
+                    registers.PC = op[2];
+                    Branch(cost, live, instructionPC);
                 }
             } break;
             case OP_JREM: {
-                Byte reg = FetchByte(cycles, mem);
-                Word memAddress = FetchWord(cycles, mem);
-                Word memValue = byteMode ? ReadByte(cycles, mem, memAddress) : ReadWord(cycles, mem, memAddress);
-                Word jumpAddress = FetchWord(cycles, mem);
+                Operands op = Decode<OP_JREM>(cost, mem, byteMode);
+                Word memValue = byteMode ? ReadByte(cost, live, mem, op[1]) : ReadWord(cost, live, mem, op[1]);
 
-                if (registers[reg] == memValue) {
-                    registers.PC = jumpAddress;
+                if (registers[op[0]] == memValue) {
+                    registers.PC = op[2];
+                    Branch(cost, live, instructionPC);
                 }
             } break;
             case OP_JRNM: {
-                Byte reg = FetchByte(cycles, mem);
-                Word memAddress = FetchWord(cycles, mem);
-                Word memValue = byteMode ? ReadByte(cycles, mem, memAddress) : ReadWord(cycles, mem, memAddress);
-                Word jumpAddress = FetchWord(cycles, mem);
+                Operands op = Decode<OP_JRNM>(cost, mem, byteMode);
+                Word memValue = byteMode ? ReadByte(cost, live, mem, op[1]) : ReadWord(cost, live, mem, op[1]);
 
-                if (registers[reg] != memValue) {
-                    registers.PC = jumpAddress;
+                if (registers[op[0]] != memValue) {
+                    registers.PC = op[2];
+                    Branch(cost, live, instructionPC);
                 }
             } break;
             case OP_JRGM: {
-                Byte reg = FetchByte(cycles, mem);
-                Word memAddress = FetchWord(cycles, mem);
-                Word memValue = byteMode ? ReadByte(cycles, mem, memAddress) : ReadWord(cycles, mem, memAddress);
-                Word jumpAddress = FetchWord(cycles, mem);
+                Operands op = Decode<OP_JRGM>(cost, mem, byteMode);
+                Word memValue = byteMode ? ReadByte(cost, live, mem, op[1]) : ReadWord(cost, live, mem, op[1]);
 
-                if (registers[reg] > memValue) {
-                    registers.PC = jumpAddress;
+                if (registers[op[0]] > memValue) {
+                    registers.PC = op[2];
+                    Branch(cost, live, instructionPC);
                 }
             } break;
             case OP_JRGEM: {
-                Byte reg = FetchByte(cycles, mem);
-                Word memAddress = FetchWord(cycles, mem);
-                Word memValue = byteMode ? ReadByte(cycles, mem, memAddress) : ReadWord(cycles, mem, memAddress);
-                Word jumpAddress = FetchWord(cycles, mem);
+                Operands op = Decode<OP_JRGEM>(cost, mem, byteMode);
+                Word memValue = byteMode ? ReadByte(cost, live, mem, op[1]) : ReadWord(cost, live, mem, op[1]);
 
-                if (registers[reg] >= memValue) {
-                    registers.PC = jumpAddress;
+                if (registers[op[0]] >= memValue) {
+                    registers.PC = op[2];
+                    Branch(cost, live, instructionPC);
                 }
             } break;
             case OP_JRLM: {
-                Byte reg = FetchByte(cycles, mem);
-                Word memAddress = FetchWord(cycles, mem);
-                Word memValue = byteMode ? ReadByte(cycles, mem, memAddress) : ReadWord(cycles, mem, memAddress);
-                Word jumpAddress = FetchWord(cycles, mem);
+                Operands op = Decode<OP_JRLM>(cost, mem, byteMode);
+                Word memValue = byteMode ? ReadByte(cost, live, mem, op[1]) : ReadWord(cost, live, mem, op[1]);
 
-                if (registers[reg] < memValue) {
-                    registers.PC = jumpAddress;
+                if (registers[op[0]] < memValue) {
+                    registers.PC = op[2];
+                    Branch(cost, live, instructionPC);
                 }
             } break;
             case OP_JRLEM: {
-                Byte reg = FetchByte(cycles, mem);
-                Word memAddress = FetchWord(cycles, mem);
-                Word memValue = byteMode ? ReadByte(cycles, mem, memAddress) : ReadWord(cycles, mem, memAddress);
-                Word jumpAddress = FetchWord(cycles, mem);
+                Operands op = Decode<OP_JRLEM>(cost, mem, byteMode);
+                Word memValue = byteMode ? ReadByte(cost, live, mem, op[1]) : ReadWord(cost, live, mem, op[1]);
 
-                if (registers[reg] <= memValue) {
-                    registers.PC = jumpAddress;
+                if (registers[op[0]] <= memValue) {
+                    registers.PC = op[2];
+                    Branch(cost, live, instructionPC);
                 }
             } break;
             case OP_JSR: {
-                Word newPC = FetchWord(cycles, mem);
-                StackPushWord(cycles, mem, registers.PC); //Push program counter to stack
+                Word newPC = Decode<OP_JSR>(cost, mem, byteMode)[0];
+                StackPushWord(cost, live, mem, registers.PC); //Push program counter to stack
+                if (pendingFault) { //Stack overflow, the call never happened
+                    break;
+                }
                 registers.PC = newPC; //Jump to start of subroutine
+                Branch(cost, live, instructionPC);
             } break;
             case OP_RTN: {
-                registers.PC = StackPopWord(cycles, mem);
+                registers.PC = StackPopWord(cost, live, mem);
+                Branch(cost, live, instructionPC);
             } break;
             case OP_PUSH: {
-                Byte reg = FetchByte(cycles, mem);
-                StackPushWord(cycles, mem, registers[reg]);
+                Operands op = Decode<OP_PUSH>(cost, mem, byteMode);
+                StackPushWord(cost, live, mem, registers[op[0]]);
             } break;
             case OP_PUSHM: {
-                Byte reg = FetchByte(cycles, mem);
-                Word address = FetchWord(cycles, mem);
-                Word memValue = byteMode ? ReadByte(cycles, mem, address) : ReadWord(cycles, mem, address);
-                StackPushWord(cycles, mem, registers[reg]);
+                Word address = Decode<OP_PUSHM>(cost, mem, byteMode)[0];
+                Word memValue = byteMode ? ReadByte(cost, live, mem, address) : ReadWord(cost, live, mem, address);
+                byteMode ? StackPushByte(cost, live, mem, memValue & 0xFF) : StackPushWord(cost, live, mem, memValue);
             } break;
             case OP_PUSHC: {
-                Byte reg = FetchByte(cycles, mem);
-                Word value = byteMode ? FetchByte(cycles, mem) : FetchWord(cycles, mem);
-                StackPushWord(cycles, mem, registers[reg]);
+                Word value = Decode<OP_PUSHC>(cost, mem, byteMode)[0];
+                byteMode ? StackPushByte(cost, live, mem, value & 0xFF) : StackPushWord(cost, live, mem, value);
             } break;
             case OP_PUSHS: {
-                StackPushByte(cycles, mem, registers.status);
+                StackPushByte(cost, live, mem, registers.status);
             } break;
             case OP_POP: {
-                Byte reg = FetchByte(cycles, mem);
-                registers[reg] = byteMode ? StackPopByte(cycles, mem) : StackPopWord(cycles, mem);
+                Operands op = Decode<OP_POP>(cost, mem, byteMode);
+                registers[op[0]] = byteMode ? StackPopByte(cost, live, mem) : StackPopWord(cost, live, mem);
             } break;
             case OP_POPM: {
-                Word address = FetchWord(cycles, mem);
-                Word stackValue = byteMode ? StackPopByte(cycles, mem) : StackPopWord(cycles, mem);
-                byteMode ? WriteByte(cycles, mem, address, stackValue & 0xFF) : WriteWord(cycles, mem, address, stackValue);
+                Word address = Decode<OP_POPM>(cost, mem, byteMode)[0];
+                Word stackValue = byteMode ? StackPopByte(cost, live, mem) : StackPopWord(cost, live, mem);
+                byteMode ? WriteByte(cost, live, mem, address, stackValue & 0xFF) : WriteWord(cost, live, mem, address, stackValue);
             } break;
             case OP_POPS: {
-                registers.status = StackPopByte(cycles, mem);
+                registers.status = StackPopByte(cost, live, mem);
+            } break;
+            case OP_SEI: {
+                registers.I = 1;
+            } break;
+            case OP_CLI: {
+                registers.I = 0;
             } break;
             default:
-                std::cout << "ERROR: Illegal instruction\n";
-                throw;
+                RaiseFault(FAULT_ILLEGAL, instByte);
             }
-        }
 
-        if (cycles < 0) {
-            std::cout << "WARNING: CPU used additional cycles\n";
+            //Slow path, only taken when a device asked for it during this instruction
+            if (attention) {
+                attention = false;
+
+                if (busMaster && busMaster->active) {
+                    cycles -= busMaster->Step(*this, mem, cyclesBefore - cycles);
+                    attention |= busMaster->active;
+                }
+                if (perfRequest) {
+                    PublishCounters(live, cycleMark, cycles);
+                    if (perfRequest & PERF_CTRL_RESET) {
+                        perf = PerfCounters{};
+                    }
+                    latched = perf;
+                    perfRequest = 0;
+                }
+                if (pendingFault) {
+                    ExecuteFault(interruptCost, live, mem, instructionPC);
+                }
+                if (pendingStop.reason != STOP_NONE) {
+                    stop = pendingStop;
+                    pendingStop = StopEvent{};
+                    break;
+                }
+            }
         }
+
+        PublishCounters(live, cycleMark, cycles);
     }
 };
\ No newline at end of file
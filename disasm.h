@@ -0,0 +1,112 @@
+#pragma once
+#include "cpu.h"
+
+/*
+    Table driven disassembler, writing the syntax the assembler reads. Opcodes no instruction uses, and
+    instructions cut off by the end of the input, come out as .byte
+
+    The byteMode bit is only visible where it changes an operand (byte constants and [address]:1), so
+    code the assembler produced reassembles to the same bytes but a byteMode bit it would never set is lost.
+    No allocation and no formatting library, so traces can be turned into text at millions of
+    instructions per second
+*/
+namespace Disassembler
+{
+    constexpr size_t MAX_TEXT = 48; //Longest line Disassemble writes, terminator included
+    constexpr Byte MAX_LENGTH = 7; //Longest instruction, opcode included
+
+    inline char* Append(char* out, const char* text) {
+        while (*text) {
+            *out++ = *text++;
+        }
+        return out;
+    }
+
+    inline char* AppendHex(char* out, Word value, int digits) {
+        static const char HEX[] = "0123456789ABCDEF";
+        *out++ = '0';
+        *out++ = 'x';
+        for (int shift = (digits - 1) * 4; shift >= 0; shift -= 4) {
+            *out++ = HEX[(value >> shift) & 0xF];
+        }
+        return out;
+    }
+
+    inline char* AppendNumber(char* out, Byte value) {
+        if (value >= 100) {
+            *out++ = '0' + value / 100;
+        }
+        if (value >= 10) {
+            *out++ = '0' + (value / 10) % 10;
+        }
+        *out++ = '0' + value % 10;
+        return out;
+    }
+
+    inline char* AppendOperand(char* out, OperandKind kind, Word value, bool byteMode) {
+        switch (kind)
+        {
+        case OPERAND_REGISTER: {
+            if (value == 6 || value == 7) {
+                return Append(out, value == 6 ? "PC" : "SP");
+            }
+            *out++ = 'R';
+            return AppendNumber(out, (Byte)value);
+        }
+        case OPERAND_VECTOR: {
+            *out++ = 'V';
+            return AppendNumber(out, (Byte)value);
+        }
+        case OPERAND_VALUE: return AppendHex(out, value, byteMode ? 2 : 4); //Hex digits give the width back to the assembler
+        case OPERAND_ADDRESS: {
+            *out++ = '[';
+            out = AppendHex(out, value, 4);
+            *out++ = ']';
+            return byteMode ? Append(out, ":1") : out;
+        }
+        case OPERAND_TARGET: return AppendHex(out, value, 4);
+        default: return out;
+        }
+    }
+
+    //Decodes the instruction at the start of code (available bytes long) into text, which needs MAX_TEXT chars.
+    //Returns the instruction's length, 1 for a .byte
+    inline Byte Disassemble(const Byte* code, size_t available, char* text) {
+        Byte instByte = code[0];
+        const OpcodeInfo& info = OPCODES.Info(instByte);
+        Byte length = OPCODES.Length(instByte);
+        bool byteMode = instByte >> 7;
+
+        if (!info.mnemonic || available < length) {
+            char* out = AppendHex(Append(text, ".byte "), instByte, 2);
+            *out = 0;
+            return 1;
+        }
+
+        Word fields[3] = {};
+        Byte at = 1;
+        for (Byte i = 0; i < info.argc; i++) {
+            Byte size = OpcodeTable::OperandSize(info.operands[i], byteMode);
+            fields[i] = size == 1 ? code[at] : (Word)(code[at] | (code[at + 1] << 8)); //Little endian system
+            at += size;
+        }
+
+        char* out = Append(text, info.mnemonic);
+        for (Byte operand = 0; operand < info.argc; operand++) {
+            Byte field = info.order[operand]; //order only ever swaps two operands, so it is its own inverse
+            *out++ = ' ';
+            out = AppendOperand(out, info.operands[field], fields[field], byteMode);
+        }
+        *out = 0;
+        return length;
+    }
+
+    //Same, reading through the CPU's address space (without touching I/O), for traces of a running guest
+    inline Byte Disassemble(const Memory& mem, Word address, char* text) {
+        Byte code[MAX_LENGTH];
+        for (Byte i = 0; i < MAX_LENGTH; i++) {
+            code[i] = mem[(Word)(address + i)];
+        }
+        return Disassemble(code, MAX_LENGTH, text);
+    }
+}
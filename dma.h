@@ -0,0 +1,183 @@
+#pragma once
+#include "cpu.h"
+
+/*
+    Memory mapped DMA controller with 4 channels, mapped to I/O blocks 2-3 (0xFF20 - 0xFF3F)
+
+    Channel N registers start at 0xFF20 + N * 8:
+        +0  SRC     (Word)  Source address, or the fill value in its low byte when FILL is set
+        +2  DST     (Word)  Destination address
+        +4  LEN     (Word)  Number of bytes to transfer
+        +6  CTRL    (Byte)  bit 0: START (write 1 to start, reads 1 while busy)
+                            bit 1: IRQ enable, raise an interrupt when the transfer completes
+                            bit 2: FILL, write the low byte of SRC instead of copying
+                            bits 4-6: interrupt line (0 - 7, 7 is non-maskable)
+        +7  STATUS  (Byte)  bit 0: busy, bit 1: done (write anything to clear)
+
+    Bus model: the CPU and the DMA share one bus and are arbitrated round robin. While any channel
+    is busy, each CPU bus cycle is matched by one DMA bus cycle, which stalls the CPU for the same
+    number of cycles. A copied byte costs the DMA 2 bus cycles (read + write), a filled byte costs 1.
+    Data is moved on the host in chunks of CHUNK_SIZE bytes once enough bus cycles have been granted.
+    Channels are served in fixed priority order (channel 0 first).
+*/
+struct DMAController : IODevice, BusMaster
+{
+    static constexpr Byte FIRST_BLOCK = 2;
+    static constexpr Byte BLOCK_COUNT = 2;
+    static constexpr Byte CHANNEL_COUNT = 4;
+    static constexpr Byte CHANNEL_SIZE = 8;
+    static constexpr Word CHUNK_SIZE = 32;
+
+    enum Control
+    {
+        CTRL_START = 1 << 0,
+        CTRL_IRQ = 1 << 1,
+        CTRL_FILL = 1 << 2,
+    };
+
+    enum Status
+    {
+        STATUS_BUSY = 1 << 0,
+        STATUS_DONE = 1 << 1,
+    };
+
+    struct Channel
+    {
+        Word src;
+        Word dst;
+        Word length;
+        Byte control;
+        Byte status;
+
+        Word transferred; //Bytes already moved
+        i64 credit; //Bus cycles granted but not yet spent
+    };
+
+    Channel channels[CHANNEL_COUNT]{};
+    CPU* cpu = nullptr;
+
+    void Attach(CPU& cpu, Memory& mem) {
+        mem.MapDevice(FIRST_BLOCK, BLOCK_COUNT, this);
+        cpu.busMaster = this;
+        this->cpu = &cpu;
+    }
+
+    void Reset() {
+        for (auto& channel : channels) {
+            channel = Channel{};
+        }
+        active = false;
+    }
+
+    Byte IORead(Word offset) override {
+        Channel& channel = channels[(offset / CHANNEL_SIZE) % CHANNEL_COUNT];
+
+        switch (offset % CHANNEL_SIZE)
+        {
+        case 0: return channel.src & 0xFF;
+        case 1: return channel.src >> 8;
+        case 2: return channel.dst & 0xFF;
+        case 3: return channel.dst >> 8;
+        case 4: return channel.length & 0xFF;
+        case 5: return channel.length >> 8;
+        case 6: return (channel.control & ~CTRL_START) | ((channel.status & STATUS_BUSY) ? CTRL_START : 0);
+        default: return channel.status;
+        }
+    }
+
+    void IOWrite(Word offset, Byte value) override {
+        Channel& channel = channels[(offset / CHANNEL_SIZE) % CHANNEL_COUNT];
+
+        //Registers are locked while a transfer is in flight
+        if ((channel.status & STATUS_BUSY) && offset % CHANNEL_SIZE != 6) {
+            return;
+        }
+
+        switch (offset % CHANNEL_SIZE)
+        {
+        case 0: channel.src = (channel.src & 0xFF00) | value; break;
+        case 1: channel.src = (channel.src & 0x00FF) | (value << 8); break;
+        case 2: channel.dst = (channel.dst & 0xFF00) | value; break;
+        case 3: channel.dst = (channel.dst & 0x00FF) | (value << 8); break;
+        case 4: channel.length = (channel.length & 0xFF00) | value; break;
+        case 5: channel.length = (channel.length & 0x00FF) | (value << 8); break;
+        case 6: {
+            channel.control = value;
+            if ((value & CTRL_START) && !(channel.status & STATUS_BUSY)) {
+                channel.status = STATUS_BUSY;
+                channel.transferred = 0;
+                channel.credit = 0;
+                active = true;
+                if (cpu) {
+                    cpu->attention = true; //Start stepping after this instruction
+                }
+            }
+        } break;
+        default: channel.status &= ~STATUS_DONE; break;
+        }
+    }
+
+    i64 Step(CPU& cpu, Memory& mem, i64 cpuCycles) override {
+        i64 budget = cpuCycles; //One DMA bus cycle per CPU bus cycle
+        i64 used = 0;
+
+        for (auto& channel : channels) {
+            if (!(channel.status & STATUS_BUSY)) {
+                continue;
+            }
+
+            bool fill = channel.control & CTRL_FILL;
+            i64 costPerByte = fill ? 1 : 2;
+
+            channel.credit += budget;
+            used += budget;
+            budget = 0;
+
+            Word remaining = channel.length - channel.transferred;
+            i64 affordable = channel.credit / costPerByte;
+
+            //Move whole chunks, or whatever is left to finish the transfer
+            Word n = 0;
+            if (affordable >= remaining) {
+                n = remaining;
+            }
+            else if (affordable >= CHUNK_SIZE) {
+                n = (Word)(affordable - affordable % CHUNK_SIZE);
+            }
+
+            if (n > 0) {
+                if (fill) {
+                    mem.Fill(channel.dst + channel.transferred, channel.src & 0xFF, n);
+                }
+                else {
+                    mem.Move(channel.dst + channel.transferred, channel.src + channel.transferred, n);
+                }
+                channel.transferred += n;
+                channel.credit -= n * costPerByte;
+            }
+
+            if (channel.transferred == channel.length) {
+                //Unspent credit goes back to the next channel, the CPU was not stalled for it
+                budget = channel.credit;
+                used -= channel.credit;
+
+                channel.status = STATUS_DONE;
+                channel.credit = 0;
+                if (channel.control & CTRL_IRQ) {
+                    cpu.SetInterrupt((Interrupt)(1 << ((channel.control >> 4) & 0x7)));
+                }
+            }
+
+            if (budget == 0) {
+                break;
+            }
+        }
+
+        active = false;
+        for (auto& channel : channels) {
+            active |= (channel.status & STATUS_BUSY) != 0;
+        }
+
+        return used;
+    }
+};
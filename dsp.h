@@ -0,0 +1,167 @@
+#pragma once
+#include <cstring>
+#include "types.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define DSP_SSE2 1
+#include <emmintrin.h>
+#else
+#define DSP_SSE2 0
+#endif
+
+/*
+    Packed arithmetic used by the DSP instructions
+
+    Scalar forms work on the two 8-bit lanes of a Word (low byte is lane 0)
+    Vector forms work on 128-bit vector registers (16 x 8-bit or 8 x 16-bit lanes, little endian)
+    and use SSE2 on the host when available
+*/
+namespace DSP
+{
+    static constexpr Byte VECTOR_SIZE = 16;
+    static constexpr Byte VECTOR_COUNT = 4;
+
+    struct alignas(16) Vector
+    {
+        Byte bytes[VECTOR_SIZE];
+    };
+
+    //Saturation helpers
+    inline Byte SatU8(int value) {
+        return value < 0 ? 0 : value > 0xFF ? 0xFF : (Byte)value;
+    }
+    inline Byte SatS8(int value) {
+        return (Byte)(value < -128 ? -128 : value > 127 ? 127 : value);
+    }
+    inline Word SatU16(int value) {
+        return value < 0 ? 0 : value > 0xFFFF ? 0xFFFF : (Word)value;
+    }
+    inline Word SatS16(int value) {
+        return (Word)(value < -32768 ? -32768 : value > 32767 ? 32767 : value);
+    }
+
+    //Scalar (2 x 8-bit lanes)
+    inline Word Add8(Word a, Word b) {
+        return ((a & 0x7F7F) + (b & 0x7F7F)) ^ ((a ^ b) & 0x8080); //Add without carrying between lanes
+    }
+    inline Word Sub8(Word a, Word b) {
+        return ((a | 0x8080) - (b & 0x7F7F)) ^ ((a ^ ~b) & 0x8080); //Subtract without borrowing between lanes
+    }
+
+    template<typename Op>
+    inline Word Lanes8(Word a, Word b, Op op) {
+        return op(a & 0xFF, b & 0xFF) | (op(a >> 8, b >> 8) << 8);
+    }
+    inline Word QAdd8(Word a, Word b) {
+        return Lanes8(a, b, [](int x, int y) -> Word { return SatS8((int8_t)x + (int8_t)y); });
+    }
+    inline Word QSub8(Word a, Word b) {
+        return Lanes8(a, b, [](int x, int y) -> Word { return SatS8((int8_t)x - (int8_t)y); });
+    }
+    inline Word UQAdd8(Word a, Word b) {
+        return Lanes8(a, b, [](int x, int y) -> Word { return SatU8(x + y); });
+    }
+    inline Word UQSub8(Word a, Word b) {
+        return Lanes8(a, b, [](int x, int y) -> Word { return SatU8(x - y); });
+    }
+
+    //Scalar (1 x 16-bit lane)
+    inline Word QAdd16(Word a, Word b) {
+        return SatS16((int16_t)a + (int16_t)b);
+    }
+    inline Word QSub16(Word a, Word b) {
+        return SatS16((int16_t)a - (int16_t)b);
+    }
+    inline Word UQAdd16(Word a, Word b) {
+        return SatU16(a + b);
+    }
+    inline Word UQSub16(Word a, Word b) {
+        return SatU16(a - b);
+    }
+
+    //Dual signed 8-bit multiply, added to the accumulator
+    inline Word SMLAD(Word acc, Word a, Word b) {
+        int lo = (int8_t)(a & 0xFF) * (int8_t)(b & 0xFF);
+        int hi = (int8_t)(a >> 8) * (int8_t)(b >> 8);
+        return (Word)(acc + lo + hi);
+    }
+
+    //Vector
+#if DSP_SSE2
+    inline __m128i Load(const Vector& v) {
+        return _mm_load_si128((const __m128i*)v.bytes);
+    }
+    inline void Store(Vector& v, __m128i value) {
+        _mm_store_si128((__m128i*)v.bytes, value);
+    }
+
+    inline void VAdd8(Vector& d, const Vector& s) { Store(d, _mm_add_epi8(Load(d), Load(s))); }
+    inline void VSub8(Vector& d, const Vector& s) { Store(d, _mm_sub_epi8(Load(d), Load(s))); }
+    inline void VUQAdd8(Vector& d, const Vector& s) { Store(d, _mm_adds_epu8(Load(d), Load(s))); }
+    inline void VUQSub8(Vector& d, const Vector& s) { Store(d, _mm_subs_epu8(Load(d), Load(s))); }
+    inline void VAdd16(Vector& d, const Vector& s) { Store(d, _mm_add_epi16(Load(d), Load(s))); }
+    inline void VSub16(Vector& d, const Vector& s) { Store(d, _mm_sub_epi16(Load(d), Load(s))); }
+    inline void VQAdd16(Vector& d, const Vector& s) { Store(d, _mm_adds_epi16(Load(d), Load(s))); }
+    inline void VQSub16(Vector& d, const Vector& s) { Store(d, _mm_subs_epi16(Load(d), Load(s))); }
+    inline void VMul16(Vector& d, const Vector& s) { Store(d, _mm_mullo_epi16(Load(d), Load(s))); }
+
+    inline void VMla16(Vector& d, const Vector& a, const Vector& b) {
+        Store(d, _mm_add_epi16(Load(d), _mm_mullo_epi16(Load(a), Load(b))));
+    }
+
+    //Sum of the signed 16-bit products of all lanes, added to the accumulator
+    inline Word VSMLAD(Word acc, const Vector& a, const Vector& b) {
+        __m128i sums = _mm_madd_epi16(Load(a), Load(b)); //4 x 32-bit pairwise sums
+        sums = _mm_add_epi32(sums, _mm_shuffle_epi32(sums, _MM_SHUFFLE(1, 0, 3, 2)));
+        sums = _mm_add_epi32(sums, _mm_shuffle_epi32(sums, _MM_SHUFFLE(2, 3, 0, 1)));
+        return (Word)(acc + _mm_cvtsi128_si32(sums));
+    }
+#else
+    inline int16_t Lane16(const Vector& v, int i) {
+        int16_t value;
+        std::memcpy(&value, v.bytes + i * 2, 2);
+        return value;
+    }
+    inline void SetLane16(Vector& v, int i, int value) {
+        int16_t lane = (int16_t)value;
+        std::memcpy(v.bytes + i * 2, &lane, 2);
+    }
+
+    template<typename Op>
+    inline void Each8(Vector& d, const Vector& s, Op op) {
+        for (int i = 0; i < VECTOR_SIZE; i++) {
+            d.bytes[i] = (Byte)op(d.bytes[i], s.bytes[i]);
+        }
+    }
+    template<typename Op>
+    inline void Each16(Vector& d, const Vector& s, Op op) {
+        for (int i = 0; i < VECTOR_SIZE / 2; i++) {
+            SetLane16(d, i, op(Lane16(d, i), Lane16(s, i)));
+        }
+    }
+
+    inline void VAdd8(Vector& d, const Vector& s) { Each8(d, s, [](int x, int y) { return x + y; }); }
+    inline void VSub8(Vector& d, const Vector& s) { Each8(d, s, [](int x, int y) { return x - y; }); }
+    inline void VUQAdd8(Vector& d, const Vector& s) { Each8(d, s, [](int x, int y) { return SatU8(x + y); }); }
+    inline void VUQSub8(Vector& d, const Vector& s) { Each8(d, s, [](int x, int y) { return SatU8(x - y); }); }
+    inline void VAdd16(Vector& d, const Vector& s) { Each16(d, s, [](int x, int y) { return x + y; }); }
+    inline void VSub16(Vector& d, const Vector& s) { Each16(d, s, [](int x, int y) { return x - y; }); }
+    inline void VQAdd16(Vector& d, const Vector& s) { Each16(d, s, [](int x, int y) { return (int16_t)SatS16(x + y); }); }
+    inline void VQSub16(Vector& d, const Vector& s) { Each16(d, s, [](int x, int y) { return (int16_t)SatS16(x - y); }); }
+    inline void VMul16(Vector& d, const Vector& s) { Each16(d, s, [](int x, int y) { return x * y; }); }
+
+    inline void VMla16(Vector& d, const Vector& a, const Vector& b) {
+        for (int i = 0; i < VECTOR_SIZE / 2; i++) {
+            SetLane16(d, i, Lane16(d, i) + Lane16(a, i) * Lane16(b, i));
+        }
+    }
+
+    inline Word VSMLAD(Word acc, const Vector& a, const Vector& b) {
+        int32_t sum = 0;
+        for (int i = 0; i < VECTOR_SIZE / 2; i++) {
+            sum += Lane16(a, i) * Lane16(b, i);
+        }
+        return (Word)(acc + sum);
+    }
+#endif
+}
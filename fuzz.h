@@ -0,0 +1,192 @@
+#pragma once
+#include <cstring>
+#include <vector>
+#include "cpu.h"
+
+struct FuzzResult
+{
+    StopReason reason; //STOP_HALT, STOP_FAULT or STOP_BUDGET (a hang)
+    Word pc;
+    FaultCause fault; //STOP_FAULT, or a fault the guest's handler took
+    bool exited; //Semihosting EXIT, with exitCode
+    Word exitCode;
+    bool newCoverage; //Hit an edge, or an edge hit count bucket, no earlier input hit
+    i64 cycles; //Guest cycles used
+
+    bool Crashed() const {
+        return reason == STOP_FAULT || fault != FAULT_NONE;
+    }
+};
+
+/*
+    In-process fuzzing of a guest program, one input per Run:
+
+        cpu.Reset(mem); image.Load(cpu, mem);    //Initialize as usual, and run any setup code
+        FuzzHarness fuzz(cpu, mem, 0x8000, 0x1000);
+        fuzz.Snapshot();
+        while (...) {
+            FuzzResult result = fuzz.Run(input, size);
+        }
+
+    Run restores the snapshot, copies the input to the guest buffer (truncated to its capacity) and starts the
+    guest at the snapshot's PC with R0 = input length and R1 = buffer address. The guest ends a case with HALT
+    or a semihosting EXIT; a fault with no handler is a crash and running out of the cycle budget is a hang.
+
+    Restoring copies back only the physical pages written since the last case, found by the tracer the
+    harness attaches to the CPU, plus the bank registers and the CPU state a guest can change. CPU::Reset is
+    not run again. State in other devices (Semihost, DMA, host ports) is not restored, and writes made by bus
+    masters are not tracked, so call FullRestore between cases when the guest uses DMA.
+
+    tracer.bitmap holds the raw AFL style edge counters of the last case, newCoverage compares their AFL hit
+    count buckets against everything seen since Snapshot
+*/
+struct FuzzHarness
+{
+    static constexpr i64 DEFAULT_BUDGET = 1000000;
+
+    CPU& cpu;
+    Memory& mem;
+    Word inputAddress;
+    Word inputCapacity;
+    i64 budget;
+
+    CoverageTracer tracer;
+    std::vector<Byte> virgin = std::vector<Byte>(CoverageTracer::MAP_SIZE, 0xFF); //Hit count buckets not seen yet, per edge
+    uint64_t executions = 0;
+    DWord edges = 0; //Edges hit by any input
+
+    FuzzHarness(CPU& cpu, Memory& mem, Word inputAddress, Word inputCapacity, i64 budget = DEFAULT_BUDGET)
+        : cpu(cpu), mem(mem), inputAddress(inputAddress), inputCapacity(inputCapacity), budget(budget) {}
+    FuzzHarness(const FuzzHarness&) = delete;
+    FuzzHarness& operator=(const FuzzHarness&) = delete;
+    ~FuzzHarness() {
+        if (cpu.tracer == &tracer) {
+            cpu.tracer = nullptr;
+        }
+    }
+
+    //Takes the state every case starts from
+    void Snapshot() {
+        saved = cpu;
+        savedData = mem.Data;
+        std::memcpy(savedBanks, mem.banks, sizeof(savedBanks));
+
+        tracer.Resize(mem.PageCount());
+        tracer.ClearEdges();
+        cpu.tracer = &tracer;
+    }
+
+    FuzzResult Run(const Byte* input, size_t size) {
+        Restore();
+        tracer.ClearEdges();
+
+        Word length = size < inputCapacity ? (Word)size : inputCapacity;
+        WriteInput(input, length);
+        cpu.registers.R0 = length;
+        cpu.registers.R1 = inputAddress;
+
+        i64 left = cpu.RunFor(budget, mem);
+        executions++;
+
+        FuzzResult result{};
+        result.reason = cpu.stop.reason;
+        result.pc = cpu.stop.pc;
+        result.fault = cpu.stop.reason == STOP_FAULT ? cpu.stop.fault : cpu.faults.cause;
+        result.exited = cpu.exited;
+        result.exitCode = cpu.exitCode;
+        result.newCoverage = UpdateCoverage();
+        result.cycles = budget - left;
+        return result;
+    }
+
+    //Copies back the pages written since the last restore
+    void Restore() {
+        for (DWord page : tracer.dirtyPages) {
+            DWord offset = page << Memory::PAGE_SHIFT;
+            std::memcpy(&mem.Data[offset], &savedData[offset], Memory::PAGE_SIZE);
+        }
+        tracer.ClearDirty();
+        RestoreState();
+    }
+
+    //Copies back the whole physical store, for guests whose devices write memory
+    void FullRestore() {
+        std::memcpy(mem.Data.data(), savedData.data(), savedData.size());
+        tracer.ClearDirty();
+        RestoreState();
+    }
+
+private:
+    CPU saved;
+    std::vector<Byte> savedData;
+    Word savedBanks[Memory::WINDOW_COUNT];
+
+    void RestoreState() {
+        if (std::memcmp(mem.banks, savedBanks, sizeof(savedBanks)) != 0) {
+            for (Byte i = 0; i < Memory::WINDOW_COUNT; i++) {
+                mem.SetBank(i, savedBanks[i]);
+            }
+        }
+
+        cpu.registers = saved.registers;
+        for (Byte i = 0; i < DSP::VECTOR_COUNT; i++) {
+            cpu.vectors[i] = saved.vectors[i];
+        }
+        cpu.halted = saved.halted;
+        cpu.exited = saved.exited;
+        cpu.exitCode = saved.exitCode;
+        cpu.attention = saved.attention;
+        cpu.perf = saved.perf;
+        cpu.latched = saved.latched;
+        cpu.perfRequest = saved.perfRequest;
+        cpu.stop = saved.stop;
+        cpu.pendingStop = saved.pendingStop;
+        cpu.faults.cause = saved.faults.cause;
+        cpu.faults.pc = saved.faults.pc;
+        cpu.faults.address = saved.faults.address;
+        cpu.faults.stackLimit = saved.faults.stackLimit;
+        cpu.pendingFault = saved.pendingFault;
+        cpu.pendingFaultAddress = saved.pendingFaultAddress;
+    }
+
+    void WriteInput(const Byte* input, Word length) {
+        mem.WriteBlock(inputAddress, input, length);
+        for (DWord done = 0; done < length;) {
+            Word at = (Word)(inputAddress + done);
+            tracer.Write(mem.PhysicalAddress(at) >> Memory::PAGE_SHIFT);
+            done += Memory::WindowRoom(at);
+        }
+    }
+
+    //AFL hit count buckets: 1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+
+    static Byte Bucket(Byte count) {
+        if (count <= 3) {
+            return count == 3 ? 4 : count;
+        }
+        if (count < 8) {
+            return 8;
+        }
+        if (count < 16) {
+            return 16;
+        }
+        if (count < 32) {
+            return 32;
+        }
+        return count < 128 ? 64 : 128;
+    }
+
+    bool UpdateCoverage() {
+        bool found = false;
+        for (Word index : tracer.touched) {
+            Byte bucket = Bucket(tracer.bitmap[index]);
+            if (virgin[index] & bucket) {
+                if (virgin[index] == 0xFF) {
+                    edges++;
+                }
+                virgin[index] &= ~bucket;
+                found = true;
+            }
+        }
+        return found;
+    }
+};
@@ -0,0 +1,550 @@
+#pragma once
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "blocks.h"
+#include "mapped.h"
+
+//Bytes copied to a physical address when the image is loaded
+struct ImageSegment
+{
+    DWord address; //Physical, with the banks as after a reset the first 64 KiB are the CPU address space
+    DWord size;
+    const Byte* data; //Into the mapped file or ImageFile::storage once opened, into the caller's buffer when saving. nullptr: zeros
+};
+
+struct ImageSymbol
+{
+    std::string name;
+    Word address;
+};
+
+/*
+    Program image produced by the assembler and loaded by the emulator, which can also load Intel HEX
+    and 32-bit little endian ELF files made by other tools
+
+    The file is mapped and only its tables are decoded. Segment data is copied straight from the
+    mapping into the physical store, one memcpy per segment, so loading a large image costs about as
+    much as faulting its pages in. Intel HEX is decoded in one pass into a single buffer
+
+    File format (little endian):
+        "DIMG", u16 version, u16 entry, u16 stack, u16 interrupt mask, u16 interrupt vectors[8]
+        u32 segment count, u32 symbol count, u32 block count
+        u16 block origin, u16 block size, u32 block hash                 See BlockMap
+        Per segment: u32 address, u32 size, u32 offset of its data in the file
+        Per symbol: u16 address, u16 name length, name
+        Per block: u16 start, u16 size, u16 cycles
+        Segment data, each starting on a 16 byte boundary
+*/
+struct ImageFile
+{
+    static constexpr Word VERSION = 1;
+    static constexpr DWord HEADER_SIZE = 48;
+    static constexpr DWord DATA_ALIGNMENT = 16;
+    static constexpr Word MACHINE_ARM = 40; //ELF e_machine of firmware for the Thumb frontend (thumb.h)
+
+    Word entry = 0;
+    Word stack = Memory::IO_BASE; //Initial SP
+    Byte interruptMask = 0; //Lines with a handler in interruptVectors
+    Word interruptVectors[8]{};
+    std::vector<ImageSegment> segments;
+    std::vector<ImageSymbol> symbols;
+    BlockMap blocks; //Empty if the image has no block metadata
+    Word machine = 0; //ELF e_machine, 0 for the other formats
+    DWord foreignEntry = 0; //ELF entry point as written, for cores that address more than 64 KiB
+    std::unique_ptr<MappedFile> file; //Backs the segment data of an opened image
+    std::vector<Byte> storage; //Decoded segment data of formats that are not binary (Intel HEX)
+
+    bool Save(const std::string& path) const {
+        std::vector<Byte> out;
+        auto put16 = [&](Word value) {
+            out.push_back(value & 0xFF);
+            out.push_back(value >> 8);
+        };
+        auto put32 = [&](DWord value) {
+            put16(value & 0xFFFF);
+            put16(value >> 16);
+        };
+
+        out.insert(out.end(), { 'D', 'I', 'M', 'G' });
+        put16(VERSION);
+        put16(entry);
+        put16(stack);
+        put16(interruptMask);
+        for (Word vector : interruptVectors) {
+            put16(vector);
+        }
+        put32((DWord)segments.size());
+        put32((DWord)symbols.size());
+        put32((DWord)blocks.blocks.size());
+        put16(blocks.origin);
+        put16(blocks.size);
+        put32(blocks.hash);
+
+        //Offsets of the segment data are only known once the tables are laid out
+        size_t segmentTable = out.size();
+        out.resize(out.size() + segments.size() * 12);
+
+        for (const ImageSymbol& symbol : symbols) {
+            put16(symbol.address);
+            put16((Word)symbol.name.size());
+            out.insert(out.end(), symbol.name.begin(), symbol.name.end());
+        }
+        for (const BasicBlock& block : blocks.blocks) {
+            put16(block.start);
+            put16(block.size);
+            put16(block.cycles);
+        }
+
+        DWord offset = (DWord)out.size();
+        for (size_t i = 0; i < segments.size(); i++) {
+            offset = (offset + DATA_ALIGNMENT - 1) & ~(DATA_ALIGNMENT - 1);
+            Byte* record = out.data() + segmentTable + i * 12;
+            DWord fields[3] = { segments[i].address, segments[i].size, offset };
+            for (DWord field : fields) {
+                for (int shift = 0; shift < 32; shift += 8) {
+                    *record++ = (field >> shift) & 0xFF;
+                }
+            }
+            offset += segments[i].size;
+        }
+
+        std::ofstream stream(path, std::ios::binary);
+        if (!stream) {
+            std::cout << "ERROR: Cannot write image " << path << "\n";
+            return false;
+        }
+        stream.write((const char*)out.data(), out.size());
+        static const char padding[DATA_ALIGNMENT]{};
+        DWord written = (DWord)out.size();
+        for (const ImageSegment& segment : segments) {
+            DWord aligned = (written + DATA_ALIGNMENT - 1) & ~(DATA_ALIGNMENT - 1);
+            stream.write(padding, aligned - written);
+            stream.write((const char*)segment.data, segment.size);
+            written = aligned + segment.size;
+        }
+        return (bool)stream;
+    }
+
+    //Maps the file and decodes its tables, telling the format from its first bytes. The file stays
+    //mapped until the ImageFile is destroyed
+    bool Open(const std::string& path) {
+        std::unique_ptr<MappedFile> mapped;
+        try {
+            mapped = std::make_unique<MappedFile>(path);
+        }
+        catch (const Except&) {
+            std::cout << "ERROR: Cannot open image " << path << "\n";
+            return false;
+        }
+
+        *this = ImageFile{}; //Nothing left from a previously opened file
+        file = std::move(mapped);
+        const char* data = file->data;
+        size_t fileSize = file->size;
+
+        if (fileSize >= 4 && std::memcmp(data, "\x7F" "ELF", 4) == 0) {
+            return ParseElf(path);
+        }
+        if (fileSize >= 1 && data[0] == ':') {
+            return ParseHex(path);
+        }
+        return ParseImage(path);
+    }
+
+    //Physical memory the segments need, at least the 64 KiB address space
+    DWord PhysicalSize() const {
+        uint64_t size = Memory::MEM_SIZE;
+        for (const ImageSegment& segment : segments) {
+            size = std::max<uint64_t>(size, (uint64_t)segment.address + segment.size);
+        }
+        return (DWord)std::min<uint64_t>(size, 0xFFFFFFFF);
+    }
+
+    //Copies the segments into the physical store, writes the interrupt table and makes the entry point
+    //and stack what the CPU starts from, now and on every reset. The stack may grow down to the end of
+    //the highest segment below it
+    bool Load(CPU& cpu, Memory& mem) const {
+        for (const ImageSegment& segment : segments) {
+            if ((uint64_t)segment.address + segment.size > mem.Data.size()) {
+                std::cout << "ERROR: Image segment at " << segment.address << " does not fit in " << mem.Data.size() << " bytes of memory\n";
+                return false;
+            }
+        }
+
+        for (const ImageSegment& segment : segments) {
+            if (segment.size == 0) {
+                continue;
+            }
+            if (segment.data) {
+                std::memcpy(&mem.Physical(segment.address), segment.data, segment.size);
+            }
+            else {
+                std::memset(&mem.Physical(segment.address), 0, segment.size);
+            }
+        }
+        for (Byte line = 0; line < 8; line++) {
+            if (interruptMask & (1 << line)) {
+                mem[Memory::INTERRUPT_TABLE + line * 2] = interruptVectors[line] & 0xFF;
+                mem[Memory::INTERRUPT_TABLE + line * 2 + 1] = interruptVectors[line] >> 8;
+            }
+        }
+
+        DWord stackTop = stack ? stack : Memory::MEM_SIZE;
+        DWord stackLimit = 0;
+        for (const ImageSegment& segment : segments) {
+            DWord end = segment.address + segment.size;
+            if (segment.size && end <= stackTop) {
+                stackLimit = std::max(stackLimit, end);
+            }
+        }
+
+        cpu.resetPC = entry;
+        cpu.resetSP = stack;
+        cpu.registers.PC = entry;
+        cpu.registers.SP = stack;
+        cpu.faults.stackLimit = (Word)stackLimit;
+        return true;
+    }
+
+private:
+    static Word Get16(const char* p) {
+        return (Byte)p[0] | ((Byte)p[1] << 8);
+    }
+    static DWord Get32(const char* p) {
+        return Get16(p) | ((DWord)Get16(p + 2) << 16);
+    }
+
+    //The CPU only addresses 64 KiB. An entry point or stack from a foreign file that does not fit (often
+    //just the load address of a data only file) is ignored
+    void SetStart(const std::string& path, DWord pc, DWord sp) {
+        if (pc < Memory::MEM_SIZE) {
+            entry = (Word)pc;
+        }
+        else {
+            std::cout << "WARNING: " << path << " starts at " << pc << ", outside the 64 KiB address space. Starting at " << entry << "\n";
+        }
+        if (sp <= Memory::MEM_SIZE) {
+            stack = (Word)sp; //0x10000 wraps to 0, the first push lands at the top of memory
+        }
+        else {
+            std::cout << "WARNING: " << path << " puts the stack at " << sp << ", outside the 64 KiB address space. Using " << stack << "\n";
+        }
+    }
+
+    /*
+        Intel HEX: ":" count address type data checksum, in hex digits, one record per line
+        Records 00 (data), 01 (end of file), 02 and 04 (extended segment and linear address), 03 and 05
+        (start address) are understood. Consecutive data records are merged into one segment
+    */
+    bool ParseHex(const std::string& path) {
+        const char* p = file->data;
+        const char* end = p + file->size;
+        storage.reserve(file->size / 2); //Never reallocates: the data is at most half the text
+
+        struct Pending
+        {
+            DWord address;
+            DWord size;
+            size_t offset; //Into storage
+        };
+        std::vector<Pending> pending;
+
+        DWord base = 0;
+        DWord start = entry;
+        uint32_t line = 1;
+        bool ended = false;
+
+        auto fail = [&](const char* message) {
+            std::cout << "ERROR: " << path << ":" << line << ": " << message << "\n";
+            return false;
+        };
+        auto digit = [](char c) -> int {
+            return c >= '0' && c <= '9' ? c - '0'
+                : c >= 'A' && c <= 'F' ? c - 'A' + 10
+                : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                : -1;
+        };
+
+        while (p < end && !ended) {
+            if (*p == '\n' || *p == '\r' || *p == ' ' || *p == '\t') {
+                line += *p++ == '\n';
+                continue;
+            }
+            if (*p++ != ':') {
+                return fail("Expected ':' at the start of a record");
+            }
+
+            //Header and checksum are 5 bytes, the data count more
+            Byte header[4];
+            Byte sum = 0;
+            bool valid = true;
+            auto next = [&]() -> Byte {
+                if (end - p < 2) {
+                    valid = false;
+                    return 0;
+                }
+                int high = digit(p[0]);
+                int low = digit(p[1]);
+                valid = valid && high >= 0 && low >= 0;
+                p += 2;
+                Byte value = (Byte)((high << 4) | low);
+                sum += value;
+                return value;
+            };
+
+            for (Byte& value : header) {
+                value = next();
+            }
+            Byte count = header[0];
+            DWord offset = (header[1] << 8) | header[2];
+            Byte type = header[3];
+
+            size_t dataAt = storage.size();
+            for (Byte i = 0; i < count; i++) {
+                storage.push_back(next());
+            }
+            next();
+            if (!valid) {
+                return fail("Invalid hex digits in record");
+            }
+            if (sum != 0) {
+                return fail("Checksum mismatch");
+            }
+
+            const Byte* data = storage.data() + dataAt;
+            switch (type)
+            {
+            case 0x00: {
+                DWord address = base + offset;
+                if (!pending.empty() && pending.back().address + pending.back().size == address && pending.back().offset + pending.back().size == dataAt) {
+                    pending.back().size += count;
+                }
+                else if (count > 0) {
+                    pending.push_back(Pending{ address, count, dataAt });
+                }
+            } break;
+            case 0x01:
+                ended = true;
+                break;
+            case 0x02:
+            case 0x04:
+                if (count != 2) {
+                    return fail("Address records carry 2 bytes");
+                }
+                base = ((data[0] << 8) | data[1]) << (type == 0x02 ? 4 : 16);
+                storage.resize(dataAt);
+                break;
+            case 0x03:
+            case 0x05:
+                if (count != 4) {
+                    return fail("Start address records carry 4 bytes");
+                }
+                start = type == 0x03
+                    ? (((data[0] << 8) | data[1]) << 4) + ((data[2] << 8) | data[3]) //CS:IP
+                    : ((DWord)data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+                storage.resize(dataAt);
+                break;
+            default:
+                return fail("Unknown record type");
+            }
+        }
+
+        if (!ended) {
+            return fail("Missing end of file record");
+        }
+
+        for (const Pending& segment : pending) {
+            segments.push_back(ImageSegment{ segment.address, segment.size, storage.data() + segment.offset });
+        }
+        SetStart(path, start, stack);
+        return true;
+    }
+
+    /*
+        32-bit little endian ELF: every PT_LOAD program header becomes a segment at its physical address,
+        with the part past the file size (.bss) zero filled. The entry point comes from the header, the
+        stack from a __stack, _estack or __StackTop symbol if the file has one
+    */
+    bool ParseElf(const std::string& path) {
+        const char* data = file->data;
+        size_t fileSize = file->size;
+
+        constexpr Byte ELF_CLASS_32 = 1;
+        constexpr Byte ELF_DATA_LSB = 1; //Little endian
+        constexpr DWord ELF_PT_LOAD = 1;
+        constexpr DWord ELF_SHT_SYMTAB = 2;
+
+        if (fileSize < 52 || data[4] != ELF_CLASS_32 || data[5] != ELF_DATA_LSB) {
+            std::cout << "ERROR: " << path << " is not a 32-bit little endian ELF file\n";
+            return false;
+        }
+
+        machine = Get16(data + 18);
+        DWord start = Get32(data + 24);
+        DWord programHeaders = Get32(data + 28);
+        DWord sectionHeaders = Get32(data + 32);
+        Word programHeaderSize = Get16(data + 42);
+        Word programHeaderCount = Get16(data + 44);
+        Word sectionHeaderSize = Get16(data + 46);
+        Word sectionHeaderCount = Get16(data + 48);
+
+        auto fits = [&](uint64_t offset, uint64_t size) {
+            return offset + size <= fileSize;
+        };
+        auto corrupt = [&]() {
+            std::cout << "ERROR: " << path << " is truncated or corrupt\n";
+            return false;
+        };
+
+        if (programHeaderSize < 32 || !fits(programHeaders, (uint64_t)programHeaderSize * programHeaderCount)) {
+            return corrupt();
+        }
+        for (Word i = 0; i < programHeaderCount; i++) {
+            const char* header = data + programHeaders + (size_t)i * programHeaderSize;
+            if (Get32(header) != ELF_PT_LOAD) {
+                continue;
+            }
+
+            DWord offset = Get32(header + 4);
+            DWord address = Get32(header + 12);
+            DWord size = Get32(header + 16);
+            DWord memorySize = Get32(header + 20);
+            if (!fits(offset, size) || memorySize < size) {
+                return corrupt();
+            }
+
+            if (size > 0) {
+                segments.push_back(ImageSegment{ address, size, (const Byte*)data + offset });
+            }
+            if (memorySize > size) {
+                segments.push_back(ImageSegment{ address + size, memorySize - size, nullptr });
+            }
+        }
+
+        //Symbols are optional, a stripped file just keeps the default stack
+        DWord sp = stack;
+        if (sectionHeaderSize >= 40 && fits(sectionHeaders, (uint64_t)sectionHeaderSize * sectionHeaderCount)) {
+            for (Word i = 0; i < sectionHeaderCount; i++) {
+                const char* section = data + sectionHeaders + (size_t)i * sectionHeaderSize;
+                Word link = (Word)Get32(section + 24);
+                if (Get32(section + 4) != ELF_SHT_SYMTAB || link >= sectionHeaderCount) {
+                    continue;
+                }
+
+                DWord symbolsAt = Get32(section + 16);
+                DWord symbolsSize = Get32(section + 20);
+                DWord symbolSize = Get32(section + 36);
+                const char* strings = data + sectionHeaders + (size_t)link * sectionHeaderSize;
+                DWord namesAt = Get32(strings + 16);
+                DWord namesSize = Get32(strings + 20);
+                if (symbolSize < 16 || !fits(symbolsAt, symbolsSize) || !fits(namesAt, namesSize)) {
+                    return corrupt();
+                }
+
+                for (DWord at = symbolSize; at + symbolSize <= symbolsSize; at += symbolSize) { //Entry 0 is reserved
+                    const char* symbol = data + symbolsAt + at;
+                    DWord name = Get32(symbol);
+                    DWord value = Get32(symbol + 4);
+                    if (name == 0 || name >= namesSize) {
+                        continue;
+                    }
+
+                    const char* text = data + namesAt + name;
+                    std::string nameText(text, strnlen(text, namesSize - name));
+                    if (nameText == "__stack" || nameText == "_estack" || nameText == "__StackTop") {
+                        sp = value;
+                    }
+                    if (value < Memory::MEM_SIZE) {
+                        symbols.push_back(ImageSymbol{ std::move(nameText), (Word)value });
+                    }
+                }
+            }
+        }
+
+        foreignEntry = start;
+        if (machine != MACHINE_ARM) {
+            SetStart(path, start, sp); //ARM firmware starts from its vector table instead
+        }
+        return true;
+    }
+
+    //This project's own format, see the top of the file
+    bool ParseImage(const std::string& path) {
+        const Byte* data = (const Byte*)file->data;
+        size_t fileSize = file->size;
+        size_t at = 0;
+        bool ok = true;
+        auto get16 = [&]() -> Word {
+            if (at + 2 > fileSize) {
+                ok = false;
+                return 0;
+            }
+            Word value = data[at] | (data[at + 1] << 8);
+            at += 2;
+            return value;
+        };
+        auto get32 = [&]() -> DWord {
+            DWord low = get16();
+            return low | ((DWord)get16() << 16);
+        };
+
+        if (fileSize < HEADER_SIZE || std::memcmp(data, "DIMG", 4) != 0) {
+            std::cout << "ERROR: " << path << " is not a program image\n";
+            return false;
+        }
+        at = 4;
+        Word version = get16();
+        if (version != VERSION) {
+            std::cout << "ERROR: " << path << " has image version " << version << ", expected " << VERSION << "\n";
+            return false;
+        }
+
+        entry = get16();
+        stack = get16();
+        interruptMask = (Byte)get16();
+        for (Word& vector : interruptVectors) {
+            vector = get16();
+        }
+        DWord segmentCount = get32();
+        DWord symbolCount = get32();
+        DWord blockCount = get32();
+        blocks = BlockMap{};
+        blocks.origin = get16();
+        blocks.size = get16();
+        blocks.hash = get32();
+
+        segments.clear();
+        for (DWord i = 0; i < segmentCount && ok; i++) {
+            DWord address = get32();
+            DWord size = get32();
+            DWord offset = get32();
+            ok = ok && (size_t)offset + size <= fileSize;
+            segments.push_back(ImageSegment{ address, size, data + offset });
+        }
+
+        symbols.clear();
+        for (DWord i = 0; i < symbolCount && ok; i++) {
+            Word address = get16();
+            Word length = get16();
+            ok = ok && at + length <= fileSize;
+            if (ok) {
+                symbols.push_back(ImageSymbol{ std::string((const char*)data + at, length), address });
+                at += length;
+            }
+        }
+
+        for (DWord i = 0; i < blockCount && ok; i++) {
+            Word start = get16();
+            Word size = get16();
+            blocks.blocks.push_back(BasicBlock{ start, size, get16() });
+        }
+
+        if (!ok) {
+            std::cout << "ERROR: " << path << " is truncated or corrupt\n";
+        }
+        return ok;
+    }
+};
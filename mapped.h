@@ -0,0 +1,94 @@
+#pragma once
+#include <stdexcept>
+#include <string>
+#include <cstddef>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+typedef std::runtime_error Except; //Portable, std::exception has no message constructor outside MSVC
+
+//Read-only view of a whole file, mapped into memory
+struct MappedFile
+{
+    const char* data = nullptr;
+    size_t size = 0;
+
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    explicit MappedFile(const std::string& path) {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            throw Except("Cannot open " + path);
+        }
+
+        //The destructor doesn't run when the constructor throws, so the handles are closed here
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize)) {
+            CloseHandle(file);
+            throw Except("Cannot read the size of " + path);
+        }
+        size = (size_t)fileSize.QuadPart;
+
+        if (size > 0) {
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            data = mapping ? (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+            if (!data) {
+                if (mapping) {
+                    CloseHandle(mapping);
+                }
+                CloseHandle(file);
+                throw Except("Cannot map " + path);
+            }
+        }
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw Except("Cannot open " + path);
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw Except("Cannot read the size of " + path);
+        }
+        size = (size_t)st.st_size;
+
+        if (size > 0) {
+            void* view = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (view == MAP_FAILED) {
+                close(fd);
+                throw Except("Cannot map " + path);
+            }
+            madvise(view, size, MADV_SEQUENTIAL);
+            data = (const char*)view;
+        }
+        close(fd); //The mapping keeps the file alive
+#endif
+    }
+
+    ~MappedFile() {
+#ifdef _WIN32
+        if (data) UnmapViewOfFile(data);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+        if (data) munmap((void*)data, size);
+#endif
+    }
+};
@@ -0,0 +1,297 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "cpu.h"
+#include "semihost.h"
+
+/*
+    Inter-core mailbox, mapped to I/O block 7 (0xFF70 - 0xFF7F) of every core
+
+        +0  ID      (Byte)  This core's number (read only)
+        +1  COUNT   (Byte)  Number of cores (read only)
+        +2  DATA    (Word)  Message to send
+        +4  SEND    (Byte)  Write a mask of target cores: each target receives DATA and has its interrupt raised (SEV)
+        +5  LINE    (Byte)  Interrupt line (0 - 7, 7 is non-maskable) raised on this core when a message arrives
+        +6  INBOX   (Word)  Last message received
+        +8  FROM    (Byte)  Core that sent the last message
+        +9  STATUS  (Byte)  bit 0: message pending, bit 1: a pending message was overwritten (write anything to clear)
+
+    Sends are queued during a quantum and delivered at the next barrier, lowest sending core first
+*/
+struct Mailbox : IODevice
+{
+    static constexpr Byte BLOCK = 7;
+    static constexpr Byte BLOCK_COUNT = 1;
+
+    enum Status
+    {
+        STATUS_PENDING = 1 << 0,
+        STATUS_OVERRUN = 1 << 1,
+    };
+
+    Byte id = 0;
+    Byte coreCount = 1;
+    Word data = 0;
+    Byte line = 0;
+    Word inbox = 0;
+    Byte from = 0;
+    Byte status = 0;
+
+    std::vector<std::pair<Byte, Word>> outbox; //Target mask and message, in send order
+
+    Byte IORead(Word offset) override {
+        switch (offset)
+        {
+        case 0: return id;
+        case 1: return coreCount;
+        case 2: return data & 0xFF;
+        case 3: return data >> 8;
+        case 5: return line;
+        case 6: return inbox & 0xFF;
+        case 7: return inbox >> 8;
+        case 8: return from;
+        case 9: return status;
+        default: return 0;
+        }
+    }
+
+    void IOWrite(Word offset, Byte value) override {
+        switch (offset)
+        {
+        case 2: data = (data & 0xFF00) | value; break;
+        case 3: data = (data & 0x00FF) | (value << 8); break;
+        case 4: outbox.emplace_back(value, data); break;
+        case 5: line = value & 7; break;
+        case 9: status = 0; break;
+        default: break;
+        }
+    }
+
+    void Receive(CPU& cpu, Byte sender, Word message) {
+        if (status & STATUS_PENDING) {
+            status |= STATUS_OVERRUN;
+        }
+        inbox = message;
+        from = sender;
+        status |= STATUS_PENDING;
+        cpu.SetInterrupt((Interrupt)(1 << line));
+    }
+};
+
+//Reusable thread barrier. The last thread to arrive runs the serial step before anyone is released
+struct QuantumBarrier
+{
+    std::mutex mutex;
+    std::condition_variable released;
+    size_t count;
+    size_t waiting = 0;
+    uint64_t generation = 0;
+
+    QuantumBarrier(size_t count) : count(count) {}
+
+    template<typename Serial>
+    void Arrive(Serial serial) {
+        std::unique_lock<std::mutex> lock(mutex);
+        uint64_t arrivedIn = generation;
+
+        if (++waiting == count) {
+            serial();
+            waiting = 0;
+            generation++;
+            released.notify_all();
+            return;
+        }
+        released.wait(lock, [&] { return generation != arrivedIn; });
+    }
+};
+
+/*
+    Several CPUs sharing one physical store, each on its own host thread
+
+    Every core runs a quantum of cycles against a private copy of memory, then all cores meet at a barrier.
+    There the pages each core changed are merged into the shared store byte by byte, in core order (the
+    highest core wins when two cores write the same byte in the same quantum), mailbox messages are
+    delivered, and the merged pages are copied back to every core. Nothing a core can observe depends on
+    host thread timing, so a run is deterministic for a given quantum.
+
+    Each core has its own registers, bank registers, performance counters, fault registers, mailbox and
+    semihosting port. Other devices mapped in the shared memory are not visible to the cores, and the boot
+    CPU's timing model, coverage tracer and breakpoints are not copied. Core N starts from the boot CPU's
+    registers with its stack N * STACK_SIZE bytes below the boot stack.
+    Changed pages are found by comparing against the shared store, so a barrier costs a pass over the
+    physical store per core: use longer quanta with large stores
+*/
+struct MultiCore
+{
+    static constexpr Byte MAX_CORES = 8; //Mailbox masks are a byte
+    static constexpr Word STACK_SIZE = 0x400;
+    static constexpr i64 DEFAULT_QUANTUM = 100000;
+
+    struct Core
+    {
+        CPU cpu;
+        Memory mem;
+        Mailbox mailbox;
+        Semihost semihost; //Output is batched per core
+        i64 carry = 0; //Cycles overrun in the last quantum, taken out of the next one
+        std::vector<DWord> dirty; //Pages changed during the last quantum
+
+        Core(const CPU& boot, const Memory& shared) : cpu(boot), mem(shared) {}
+    };
+
+    Memory& shared;
+    i64 quantum;
+    std::vector<std::unique_ptr<Core>> cores;
+    uint64_t quanta = 0;
+
+    std::vector<DWord> merged; //Pages changed by any core in the last quantum
+    std::vector<Byte> dirtyBy; //Per page: mask of the cores that changed it
+    std::vector<Byte> before; //Page contents before the merge
+
+    MultiCore(const CPU& boot, Memory& shared, Byte coreCount, i64 quantum = DEFAULT_QUANTUM) : shared(shared), quantum(quantum > 0 ? quantum : (i64)DEFAULT_QUANTUM) {
+        if (coreCount == 0 || coreCount > MAX_CORES) {
+            Byte clamped = coreCount == 0 ? 1 : (Byte)MAX_CORES;
+            std::cout << "WARNING: " << (int)coreCount << " cores requested, using " << (int)clamped << "\n";
+            coreCount = clamped;
+        }
+
+        for (Byte i = 0; i < coreCount; i++) {
+            cores.emplace_back(new Core(boot, shared));
+            Core& core = *cores.back();
+
+            core.cpu.registers.SP = boot.registers.SP - i * STACK_SIZE;
+            core.cpu.busMaster = nullptr;
+            core.cpu.timing = nullptr;
+            core.cpu.tracer = nullptr;
+            core.cpu.breakpoints.clear();
+            core.cpu.attention = false;
+            core.cpu.perf = PerfCounters{};
+            core.cpu.latched = PerfCounters{};
+
+            core.mailbox.id = i;
+            core.mailbox.coreCount = coreCount;
+
+            core.mem.MapDevice(Memory::IO_BANK_BLOCKS, Memory::IO_BLOCK_COUNT - Memory::IO_BANK_BLOCKS, nullptr);
+            core.mem.MapDevice(CPU::PERF_BLOCK, CPU::PERF_BLOCK_COUNT, &core.cpu);
+            core.mem.MapDevice(Mailbox::BLOCK, Mailbox::BLOCK_COUNT, &core.mailbox);
+            core.mem.MapDevice(FaultRegisters::BLOCK, 1, &core.cpu.faults);
+            core.semihost.Attach(core.cpu, core.mem);
+        }
+
+        dirtyBy.assign(shared.PageCount(), 0);
+        before.resize(Memory::PAGE_SIZE);
+    }
+
+    bool Running() const {
+        for (const auto& core : cores) {
+            if (!core->cpu.halted) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    //Runs every core for a number of cycles (per core), or until they all halt
+    void Run(i64 cycles) {
+        i64 remaining = cycles;
+        i64 grant = std::min(quantum, remaining);
+        bool running = remaining > 0 && Running();
+        QuantumBarrier barrier(cores.size());
+
+        auto worker = [&](Core& core) {
+            while (running) {
+                if (!core.cpu.halted) {
+                    core.carry = std::min<i64>(core.cpu.RunFor(grant + core.carry, core.mem), 0); //Cycles left after a stop are not banked
+                }
+                FindDirtyPages(core);
+
+                barrier.Arrive([&] {
+                    Exchange();
+                    remaining -= grant;
+                    grant = std::min(quantum, remaining);
+                    running = remaining > 0 && Running();
+                });
+
+                CopyMergedPages(core);
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < cores.size(); i++) {
+            threads.emplace_back(worker, std::ref(*cores[i]));
+        }
+        worker(*cores[0]);
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    }
+
+private:
+    //Runs on the core's thread, only reads the shared store
+    void FindDirtyPages(Core& core) {
+        core.dirty.clear();
+        for (DWord page = 0; page < shared.PageCount(); page++) {
+            DWord offset = page << Memory::PAGE_SHIFT;
+            if (std::memcmp(&core.mem.Data[offset], &shared.Data[offset], Memory::PAGE_SIZE) != 0) {
+                core.dirty.push_back(page);
+            }
+        }
+    }
+
+    void CopyMergedPages(Core& core) {
+        for (DWord page : merged) {
+            DWord offset = page << Memory::PAGE_SHIFT;
+            std::memcpy(&core.mem.Data[offset], &shared.Data[offset], Memory::PAGE_SIZE);
+        }
+    }
+
+    //Serial step at the barrier: merge memory in core order, then deliver mail
+    void Exchange() {
+        merged.clear();
+        for (size_t i = 0; i < cores.size(); i++) {
+            for (DWord page : cores[i]->dirty) {
+                if (!dirtyBy[page]) {
+                    merged.push_back(page);
+                }
+                dirtyBy[page] |= 1 << i;
+            }
+        }
+
+        for (DWord page : merged) {
+            DWord offset = page << Memory::PAGE_SHIFT;
+            Byte* target = &shared.Data[offset];
+            std::memcpy(before.data(), target, Memory::PAGE_SIZE);
+
+            for (size_t i = 0; i < cores.size(); i++) {
+                if (dirtyBy[page] & (1 << i)) {
+                    const Byte* source = &cores[i]->mem.Data[offset];
+                    for (Word b = 0; b < Memory::PAGE_SIZE; b++) {
+                        if (source[b] != before[b]) {
+                            target[b] = source[b];
+                        }
+                    }
+                }
+            }
+            dirtyBy[page] = 0;
+        }
+
+        for (size_t i = 0; i < cores.size(); i++) {
+            Mailbox& sender = cores[i]->mailbox;
+            for (const auto& message : sender.outbox) {
+                for (size_t target = 0; target < cores.size(); target++) {
+                    if (message.first & (1 << target)) {
+                        cores[target]->mailbox.Receive(cores[target]->cpu, (Byte)i, message.second);
+                    }
+                }
+            }
+            sender.outbox.clear();
+        }
+        quanta++;
+    }
+};
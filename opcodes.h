@@ -0,0 +1,303 @@
+#pragma once
+#include "types.h"
+#include "dsp.h"
+
+enum Opcode
+{
+    // Opcodes must not excede 0x7F (01111111) due to the byteMode bit!
+
+    //Special
+    OP_NOOP = 0x00,   //No Op
+    OP_RESET = 0x7E,   //Reset the CPU (clears registers and memory, resets flags)
+    OP_HALT = 0x7F,   //Stops the CPU execution of instuctions
+
+    //Arithmetic
+    OP_ADD = 0x01,   //Add two registers, store in first
+    OP_ADDC,                //Add word constant into register
+    OP_ADDA,                //Add register and word at memory address, store in register
+
+    OP_SUB,                 //Subtract two registers, store in first
+    OP_SUBC,                //Subtract constant value from a register, store in register
+    OP_SUBA,                //Subtract the value in memory from a register, store in register
+
+    OP_MUL,                 //Multiply two registers, store in first
+    OP_MULC,                //Multiply constant value from a register, store in register
+    OP_MULA,                //Multiply the value in memory from a register, store in register
+
+    OP_DIV,                 //Divide two registers, store in first
+    OP_DIVC,                //Divide constant value from a register, store in register
+    OP_DIVA,                //Divide the value in memory from a register, store in register
+
+    OP_CMP = 0x0E,   //Subtract two registers and update status flags, discard result
+    OP_CMPA = 0x0F,   //Subtract a value in memory from a register and update status flags, discard result
+
+    //Increment
+    OP_INC = 0x10,   //Increment a value in a register
+    OP_INCM,                //Increment a value in memory
+    OP_DEC,                 //Decrement a value in a register
+    OP_DECM,                //Decrement a value in memory
+
+    //DSP (packed lanes of a register: 2 x 8-bit, or 1 x 16-bit saturating)
+    OP_ADD8 = 0x14,         //Add 8-bit lanes of two registers, store in first
+    OP_SUB8,                //Subtract 8-bit lanes of two registers, store in first
+    OP_QADD8,               //Signed saturating add of 8-bit lanes
+    OP_QSUB8,               //Signed saturating subtract of 8-bit lanes
+    OP_UQADD8,              //Unsigned saturating add of 8-bit lanes
+    OP_UQSUB8,              //Unsigned saturating subtract of 8-bit lanes
+    OP_QADD16,              //Signed saturating add of two registers
+    OP_QSUB16,              //Signed saturating subtract of two registers
+    OP_UQADD16,             //Unsigned saturating add of two registers
+    OP_UQSUB16,             //Unsigned saturating subtract of two registers
+    OP_SMLAD,               //Multiply signed 8-bit lanes of two registers, add both products to a third (first operand)
+
+    //Bitwise
+    OP_UXT = 0x20,   //Zero extend a byte (truncate 16 bit value to 8 bits)
+    //TODO
+
+    //Data moving
+    OP_LDR = 0x30,          //Load value from register into register
+    OP_LDC,                 //Load value constant into register
+    OP_LDM,                 //Load value from memory into register
+
+    OP_STRM,                //Store register into memory
+    OP_STMM,                //Store memory into memory (copies memory)
+    OP_STCM,                //Store constant into memory
+
+    //Are these needed?
+    //[[ TODO
+    OP_SWPM,                //Swap memory values
+    OP_SWPR,                //Swap registers
+    OP_SWPRM,               //Swap register and memory
+    //TODO ]]
+
+    OP_BMOV,                //Copy (register) bytes from the address in a register to the address in another (overlap safe)
+    OP_BSET,                //Fill (register) bytes at the address in a register with the low byte of a register
+
+    //Control2
+    OP_JSR = 0x40,          //Increment SP by 2, push the current PC to the stack, and jump to a subroutine
+    OP_RTN,                 //Pop the previous PC off the stack and jump to it, decrtant value
+    OP_JMP,                 //Set the program counter (PC) and contion execution
+
+    OP_JRZ,                 //Jump if register is equal to 0
+    OP_JRE,                 //Jump if register is equal to a constant value
+    OP_JRN,                 //Jump if register is not equal to a constant value
+    OP_JRG,                 //Jump if register is greater than a constant value
+    OP_JRL,                 //Jump if register is less than a constant value
+    OP_JRLE,                //Jump if register is less than or equal to a constant value
+    OP_JRGE,                //Jump if register is greater than or equal to a consemory
+
+    OP_JRZM,         //Jump if value in memory is equal to 0
+    OP_JREM,                //Jump if register is equal to a value in memory
+    OP_JRNM,                //Jump if register is not equal to a value in mement the SP by 2
+    OP_JRLM,                //Jump if register is less than a value in memory
+    OP_JRLEM,               //Jump if register is less than or equal to a value in memory
+    OP_JRGM,                //Jump if register is greater than a value in memory
+    OP_JRGEM,               //Jump if register is greater than or equal to a value in memory
+
+    //Vector (4 x 128-bit vector registers, 16 x 8-bit or 8 x 16-bit lanes)
+    OP_VLD = 0x51,          //Load 16 bytes from the address in a register into a vector register
+    OP_VST,                 //Store a vector register to the address in a register
+    OP_VADD8,               //Add 8-bit lanes of two vector registers, store in first
+    OP_VSUB8,               //Subtract 8-bit lanes of two vector registers, store in first
+    OP_VUQADD8,             //Unsigned saturating add of 8-bit lanes
+    OP_VUQSUB8,             //Unsigned saturating subtract of 8-bit lanes
+    OP_VADD16,              //Add 16-bit lanes of two vector registers, store in first
+    OP_VSUB16,              //Subtract 16-bit lanes of two vector registers, store in first
+    OP_VQADD16,             //Signed saturating add of 16-bit lanes
+    OP_VQSUB16,             //Signed saturating subtract of 16-bit lanes
+    OP_VMUL16,              //Multiply 16-bit lanes of two vector registers, keep the low 16 bits
+    OP_VMLA16,              //Multiply 16-bit lanes of two vector registers, add to a third (first operand)
+    OP_VSMLAD,              //Multiply signed 16-bit lanes of two vector registers, add the sum of all products to a register
+
+    //Stack
+    OP_PUSH = 0x60,   //Push register onto stack, decrement SP by (opsize + 1)
+    OP_PUSHM,               //Push value in memory onto stack, decrement SP by (opsize + 1)
+    OP_PUSHC,               //Push constant onto stack, decrement SP by (opsize + 1)
+
+    OP_POP,                 //Pop value from stack into register, increment SP by (opsize + 1)
+    OP_POPM,                //Pop value from stack into register, increment SP by (opsize + 1)
+
+    OP_PUSHS,               //Push status onto stack, decrement SP by (opsize + 1)
+    OP_POPS,                //Pop stack into status, increment SP by (opsize + 1)
+
+    OP_SEI = 0x70,   //Set the global interrupt enable flag
+    OP_CLI,                 //Clear the global interrupt enable flag
+
+};
+
+//Fields that follow the opcode byte
+enum OperandKind : Byte
+{
+    OPERAND_NONE,
+    OPERAND_REGISTER, //Byte: register number
+    OPERAND_VECTOR, //Byte: vector register number
+    OPERAND_VALUE, //Constant: a byte in byteMode, otherwise a word
+    OPERAND_ADDRESS, //Word: a memory operand, whose data is a byte in byteMode
+    OPERAND_TARGET, //Word: jump target
+};
+
+//What an instruction does to the status register
+enum FlagsEffect : Byte
+{
+    FLAGS_NONE,
+    FLAGS_INTERRUPT, //Only I
+    FLAGS_ARITHMETIC, //N, O, Z and C from the result
+    FLAGS_ALL, //The whole register is replaced
+};
+
+enum OpcodeAttribute : Byte
+{
+    OPA_WRITES_FIRST = 1 << 0, //Writes the register given as its first assembly operand
+    OPA_BRANCH = 1 << 1, //May continue anywhere but the next instruction (jumps, calls, returns)
+    OPA_STOP = 1 << 2, //Stops or restarts the CPU
+};
+
+struct OpcodeInfo
+{
+    const char* mnemonic; //As written in assembly, nullptr for opcodes no instruction uses
+    Byte argc;
+    OperandKind operands[3]; //In encoding order
+    Byte order[3]; //Assembly operand encoded at each position (stores encode their source first)
+    Byte dataCycles[2]; //[byteMode] Memory bytes read or written
+    FlagsEffect flags;
+    Byte attributes; //OpcodeAttribute
+};
+
+/*
+    The one description of the instruction set: the assembler encodes from it (Mnemonics.h only adds
+    which assembly operand types pick which opcode), Execute fetches operands with CPU::Decode, the
+    disassembler (disasm.h) decodes from it and the cycle estimates come from it
+
+    An instruction costs one cycle per fetched byte plus one per data byte read or written.
+    Costs that depend on run time values are not included: BMOV adds 2 cycles and BSET 1 cycle per byte
+    moved, and a JRZ that is not taken skips its 2 address bytes
+*/
+struct OpcodeTable
+{
+    OpcodeInfo info[0x80];
+
+    constexpr OpcodeTable() : info{} {
+        constexpr OperandKind R = OPERAND_REGISTER;
+        constexpr OperandKind V = OPERAND_VECTOR;
+        constexpr OperandKind C = OPERAND_VALUE;
+        constexpr OperandKind M = OPERAND_ADDRESS;
+        constexpr OperandKind T = OPERAND_TARGET;
+        constexpr Byte W = OPA_WRITES_FIRST;
+        constexpr Byte VECTOR = DSP::VECTOR_SIZE;
+
+        Set(OP_NOOP, "NOP", {}, 0, 0);
+        Set(OP_RESET, "RESET", {}, 0, 0, OPA_STOP, FLAGS_ALL);
+        Set(OP_HALT, "HALT", {}, 0, 0, OPA_STOP);
+
+        Set(OP_ADD, "ADD", { R, R }, 0, 0, W); Set(OP_ADDC, "ADD", { R, C }, 0, 0, W); Set(OP_ADDA, "ADD", { R, M }, 2, 1, W);
+        Set(OP_SUB, "SUB", { R, R }, 0, 0, W); Set(OP_SUBC, "SUB", { R, C }, 0, 0, W); Set(OP_SUBA, "SUB", { R, M }, 2, 1, W);
+        Set(OP_MUL, "MUL", { R, R }, 0, 0, W); Set(OP_MULC, "MUL", { R, C }, 0, 0, W); Set(OP_MULA, "MUL", { R, M }, 2, 1, W);
+        Set(OP_DIV, "DIV", { R, R }, 0, 0, W); Set(OP_DIVC, "DIV", { R, C }, 0, 0, W); Set(OP_DIVA, "DIV", { R, M }, 2, 1, W);
+        Set(OP_CMP, "CMP", { R, R }, 0, 0, 0, FLAGS_ARITHMETIC); Set(OP_CMPA, "CMP", { R, M }, 2, 1, 0, FLAGS_ARITHMETIC);
+
+        Set(OP_INC, "INC", { R }, 0, 0, W); Set(OP_INCM, "INC", { M }, 4, 2); //Read and write back
+        Set(OP_DEC, "DEC", { R }, 0, 0, W); Set(OP_DECM, "DEC", { M }, 4, 2);
+
+        Set(OP_ADD8, "ADD8", { R, R }, 0, 0, W); Set(OP_SUB8, "SUB8", { R, R }, 0, 0, W);
+        Set(OP_QADD8, "QADD8", { R, R }, 0, 0, W); Set(OP_QSUB8, "QSUB8", { R, R }, 0, 0, W);
+        Set(OP_UQADD8, "UQADD8", { R, R }, 0, 0, W); Set(OP_UQSUB8, "UQSUB8", { R, R }, 0, 0, W);
+        Set(OP_QADD16, "QADD16", { R, R }, 0, 0, W); Set(OP_QSUB16, "QSUB16", { R, R }, 0, 0, W);
+        Set(OP_UQADD16, "UQADD16", { R, R }, 0, 0, W); Set(OP_UQSUB16, "UQSUB16", { R, R }, 0, 0, W);
+        Set(OP_SMLAD, "SMLAD", { R, R, R }, 0, 0, W);
+
+        Set(OP_UXT, "UXT", { R }, 0, 0, W);
+
+        Set(OP_LDR, "MOV", { R, R }, 0, 0, W); Set(OP_LDC, "MOV", { R, C }, 0, 0, W); Set(OP_LDM, "MOV", { R, M }, 2, 1, W);
+        Set(OP_STRM, "MOV", { R, M }, 2, 1); Set(OP_STMM, "MOV", { M, M }, 4, 2); Set(OP_STCM, "MOV", { C, M }, 2, 1);
+        Swap(OP_STRM); Swap(OP_STCM); //MOV [address] source
+        Set(OP_BMOV, "BMOV", { R, R, R }, 0, 0); Set(OP_BSET, "BSET", { R, R, R }, 0, 0);
+
+        Set(OP_JSR, "JSR", { T }, 2, 2, OPA_BRANCH); Set(OP_RTN, "RTN", {}, 2, 2, OPA_BRANCH); //Return address
+        Set(OP_JMP, "JMP", { T }, 0, 0, OPA_BRANCH);
+        Set(OP_JRZ, "JRZ", { R, T }, 0, 0, OPA_BRANCH);
+        Set(OP_JRE, "JRE", { R, C, T }, 0, 0, OPA_BRANCH); Set(OP_JRN, "JRN", { R, C, T }, 0, 0, OPA_BRANCH);
+        Set(OP_JRG, "JRG", { R, C, T }, 0, 0, OPA_BRANCH); Set(OP_JRGE, "JRGE", { R, C, T }, 0, 0, OPA_BRANCH);
+        Set(OP_JRL, "JRL", { R, C, T }, 0, 0, OPA_BRANCH); Set(OP_JRLE, "JRLE", { R, C, T }, 0, 0, OPA_BRANCH);
+        Set(OP_JREM, "JRE", { R, M, T }, 2, 1, OPA_BRANCH); Set(OP_JRNM, "JRN", { R, M, T }, 2, 1, OPA_BRANCH);
+        Set(OP_JRGM, "JRG", { R, M, T }, 2, 1, OPA_BRANCH); Set(OP_JRGEM, "JRGE", { R, M, T }, 2, 1, OPA_BRANCH);
+        Set(OP_JRLM, "JRL", { R, M, T }, 2, 1, OPA_BRANCH); Set(OP_JRLEM, "JRLE", { R, M, T }, 2, 1, OPA_BRANCH);
+
+        Set(OP_VLD, "VLD", { V, R }, VECTOR, VECTOR); Set(OP_VST, "VST", { V, R }, VECTOR, VECTOR);
+        Set(OP_VADD8, "VADD8", { V, V }, 0, 0); Set(OP_VSUB8, "VSUB8", { V, V }, 0, 0);
+        Set(OP_VUQADD8, "VUQADD8", { V, V }, 0, 0); Set(OP_VUQSUB8, "VUQSUB8", { V, V }, 0, 0);
+        Set(OP_VADD16, "VADD16", { V, V }, 0, 0); Set(OP_VSUB16, "VSUB16", { V, V }, 0, 0);
+        Set(OP_VQADD16, "VQADD16", { V, V }, 0, 0); Set(OP_VQSUB16, "VQSUB16", { V, V }, 0, 0);
+        Set(OP_VMUL16, "VMUL16", { V, V }, 0, 0); Set(OP_VMLA16, "VMLA16", { V, V, V }, 0, 0);
+        Set(OP_VSMLAD, "VSMLAD", { R, V, V }, 0, 0, W);
+
+        Set(OP_PUSH, "PUSH", { R }, 2, 2); Set(OP_PUSHC, "PUSH", { C }, 2, 1); Set(OP_PUSHM, "PUSH", { M }, 4, 2);
+        Set(OP_POP, "POP", { R }, 2, 1, W); Set(OP_POPM, "POP", { M }, 4, 2);
+        Set(OP_PUSHS, "PUSHS", {}, 1, 1); Set(OP_POPS, "POPS", {}, 1, 1, 0, FLAGS_ALL);
+        Set(OP_SEI, "SEI", {}, 0, 0, 0, FLAGS_INTERRUPT); Set(OP_CLI, "CLI", {}, 0, 0, 0, FLAGS_INTERRUPT);
+    }
+
+    struct Operands
+    {
+        OperandKind kinds[3];
+    };
+
+    constexpr void Set(Opcode op, const char* mnemonic, Operands operands, Byte wordCycles, Byte byteCycles, Byte attributes = 0, FlagsEffect flags = FLAGS_NONE) {
+        OpcodeInfo& entry = info[op];
+        entry.mnemonic = mnemonic;
+        entry.argc = 0;
+        for (Byte i = 0; i < 3; i++) {
+            entry.operands[i] = operands.kinds[i];
+            entry.order[i] = i;
+            entry.argc += operands.kinds[i] != OPERAND_NONE;
+        }
+        entry.dataCycles[0] = wordCycles;
+        entry.dataCycles[1] = byteCycles;
+        entry.flags = flags;
+        entry.attributes = attributes;
+    }
+
+    constexpr void Swap(Opcode op) {
+        info[op].order[0] = 1;
+        info[op].order[1] = 0;
+    }
+
+    //instByte includes the byteMode bit
+    constexpr const OpcodeInfo& Info(Byte instByte) const {
+        return info[instByte & 0x7F];
+    }
+
+    constexpr Byte DataCycles(Byte instByte) const {
+        return Info(instByte).dataCycles[instByte >> 7];
+    }
+
+    static constexpr Byte OperandSize(OperandKind kind, bool byteMode) {
+        return kind == OPERAND_NONE ? 0 : kind == OPERAND_REGISTER || kind == OPERAND_VECTOR || (kind == OPERAND_VALUE && byteMode) ? 1 : 2;
+    }
+
+    //Bytes the instruction occupies, opcode included
+    constexpr Byte Length(Byte instByte) const {
+        const OpcodeInfo& entry = Info(instByte);
+        Byte length = 1;
+        for (Byte i = 0; i < entry.argc; i++) {
+            length += OperandSize(entry.operands[i], instByte >> 7);
+        }
+        return length;
+    }
+
+    //Whether every opcode in [first, last] has the same operands, for Execute cases that share their decoding
+    constexpr bool SameOperands(Opcode first, Opcode last) const {
+        for (Byte op = first; op <= last; op++) {
+            for (Byte i = 0; i < 3; i++) {
+                if (info[op].operands[i] != info[first].operands[i]) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+};
+
+static constexpr OpcodeTable OPCODES{};
+
+static_assert(OPCODES.Length(OP_JRE) == 6 && OPCODES.Length(OP_JRE | 0x80) == 5, "Opcode table lengths are broken");
+static_assert(OPCODES.DataCycles(OP_STMM | 0x80) == 2, "Opcode table costs are broken");
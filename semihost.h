@@ -0,0 +1,153 @@
+#pragma once
+#include <chrono>
+#include <ostream>
+#include <vector>
+#include "cpu.h"
+
+/*
+    Per instance output buffer. Text collects here without any locking and reaches the sink in one write per
+    batch, so thousands of instances writing at once only meet on the console every batchSize bytes.
+    Flushed when full, on Flush()/std::flush, and when destroyed
+*/
+struct BatchedOutput : std::streambuf
+{
+    static constexpr size_t DEFAULT_BATCH = 4096;
+
+    std::ostream* sink;
+    std::vector<char> buffer;
+
+    BatchedOutput(std::ostream& sink = std::cout, size_t batchSize = DEFAULT_BATCH) : sink(&sink), buffer(batchSize ? batchSize : 1) {
+        setp(buffer.data(), buffer.data() + buffer.size());
+    }
+    BatchedOutput(const BatchedOutput&) = delete;
+    BatchedOutput& operator=(const BatchedOutput&) = delete;
+    ~BatchedOutput() {
+        Flush();
+    }
+
+    void Flush() {
+        if (pptr() == pbase()) {
+            return;
+        }
+        sink->write(pbase(), pptr() - pbase());
+        sink->flush();
+        setp(buffer.data(), buffer.data() + buffer.size());
+    }
+
+protected:
+    int overflow(int c) override {
+        Flush();
+        if (c != traits_type::eof()) {
+            *pptr() = (char)c;
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync() override {
+        Flush();
+        return 0;
+    }
+};
+
+/*
+    Semihosting port, mapped to I/O block 6 (0xFF60 - 0xFF6F)
+
+        +0  PUTC    (Byte)  Write a character to the output
+        +1  CMD     (Byte)  Write to run a command, see Command
+        +2  ADDR    (Word)  WRITE: address of the text
+        +4  ARG     (Word)  WRITE: length in bytes, EXIT: exit code
+        +6  TIME    (DWord) Microseconds of host time since the port was attached, latched by the TIME command
+
+    Host calls take no guest cycles. Guest output and the CPU's own messages go to the same per instance
+    BatchedOutput, in the order they were made
+*/
+struct Semihost : IODevice
+{
+    static constexpr Byte BLOCK = 6;
+
+    enum Command
+    {
+        CMD_WRITE = 1, //Write ARG bytes from ADDR
+        CMD_EXIT, //Stop the CPU with exit code ARG
+        CMD_TIME, //Latch TIME
+        CMD_FLUSH, //Flush the output now
+    };
+
+    CPU* cpu = nullptr;
+    Memory* mem = nullptr;
+    BatchedOutput output;
+    std::ostream out{ &output };
+
+    Word address = 0;
+    Word argument = 0;
+    DWord time = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    Semihost(std::ostream& sink = std::cout, size_t batchSize = BatchedOutput::DEFAULT_BATCH) : output(sink, batchSize) {}
+
+    void Attach(CPU& cpu, Memory& mem) {
+        mem.MapDevice(BLOCK, 1, this);
+        this->cpu = &cpu;
+        this->mem = &mem;
+        cpu.log = &out;
+        start = std::chrono::steady_clock::now();
+    }
+
+    void Flush() {
+        output.Flush();
+    }
+
+    Byte IORead(Word offset) override {
+        switch (offset)
+        {
+        case 2: return address & 0xFF;
+        case 3: return address >> 8;
+        case 4: return argument & 0xFF;
+        case 5: return argument >> 8;
+        case 6:
+        case 7:
+        case 8:
+        case 9: return (time >> ((offset - 6) * 8)) & 0xFF;
+        default: return 0;
+        }
+    }
+
+    void IOWrite(Word offset, Byte value) override {
+        switch (offset)
+        {
+        case 0: out.put((char)value); break;
+        case 1: Run((Command)value); break;
+        case 2: address = (address & 0xFF00) | value; break;
+        case 3: address = (address & 0x00FF) | (value << 8); break;
+        case 4: argument = (argument & 0xFF00) | value; break;
+        case 5: argument = (argument & 0x00FF) | (value << 8); break;
+        default: break;
+        }
+    }
+
+private:
+    void Run(Command command) {
+        switch (command)
+        {
+        case CMD_WRITE: {
+            char chunk[256];
+            Word from = address;
+            for (Word left = argument; left > 0;) {
+                Word n = left < sizeof(chunk) ? left : (Word)sizeof(chunk);
+                mem->ReadBlock(from, (Byte*)chunk, n);
+                out.write(chunk, n);
+                from += n;
+                left -= n;
+            }
+        } break;
+        case CMD_EXIT: cpu->Exit(argument); break;
+        case CMD_TIME: {
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            time = (DWord)std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+        } break;
+        case CMD_FLUSH: Flush(); break;
+        default: break;
+        }
+    }
+};
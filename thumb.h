@@ -0,0 +1,1528 @@
+#pragma once
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include "cpu.h"
+#include "image.h"
+
+/*
+    Thumb-2 frontend: runs ARMv7-M firmware (the integer subset of ARMv7E-M) on a Memory's physical store.
+    The 16-bit CPU is untouched, the two cores only share the Memory type
+
+    Supported: 16 and 32-bit data processing (immediate, modified immediate, shifted and register
+    shifted operands), multiply, long multiply and divide, bit field, extend and byte reverse
+    instructions, every load/store addressing mode (literal, immediate, register, pre/post indexed,
+    dual, multiple, exclusive), B/BL/BX/BLX/CBZ/CBNZ/TBB/TBH, IT blocks, PUSH/POP, MRS/MSR/CPS and the
+    hints. Not supported: the DSP (SIMD, saturating arithmetic, SMULxy) and floating point extensions,
+    and the exception model. Those decode as undefined and stop the core
+
+    Instructions are decoded once per address into a ThumbOp, a fixed size micro-op with its operands
+    already extracted. Decoded ops live in pages parallel to the physical store and are found by
+    physical address, so every alias of the flash shares them; branch and literal offsets stay PC
+    relative for that reason. A store to a page holding decoded ops clears the slots it overlaps, which
+    keeps code copied to RAM and self-modifying code correct. Writes made behind the core's back (the
+    host, DMA) must call Invalidate
+
+    Guest addresses go through a small map of regions onto the physical store. Accesses outside every
+    region read as zero and ignore writes, like unmapped I/O on the 16-bit CPU, and are counted
+
+    Timing is approximate: each op has a fixed cost and a taken branch adds BRANCH_PENALTY
+*/
+
+//A guest address range backed by the physical store, in whole pages
+struct ThumbRegion
+{
+    DWord base; //Guest address
+    DWord size;
+    DWord physical; //Offset in the physical store
+};
+
+enum ThumbOpcode : Byte
+{
+    T_UNDEFINED, //imm holds the encoding
+
+    //Data processing: rd = rn <op> operand, the operand is imm or rm shifted by amount (or by the value of ra)
+    T_AND, T_EOR, T_ORR, T_ORN, T_BIC, T_MOV, T_MVN,
+    T_ADD, T_ADC, T_SUB, T_SBC, T_RSB,
+    T_ADR, //rd = Align(PC, 4) + imm
+    T_TST, T_TEQ, T_CMP, T_CMN,
+
+    //Multiply and divide. Long forms: rd is RdLo, ra is RdHi
+    T_MUL, T_MLA, T_MLS, T_UMULL, T_SMULL, T_UMLAL, T_SMLAL, T_UDIV, T_SDIV,
+
+    //Bit manipulation. Extends rotate rm right by amount and add rn unless rn is PC
+    T_CLZ, T_RBIT, T_REV, T_REV16, T_REVSH,
+    T_SXTB, T_SXTH, T_UXTB, T_UXTH,
+    T_MOVT, T_BFI, T_BFC, T_UBFX, T_SBFX, T_SSAT, T_USAT, //Bit fields: amount is the lsb, imm the width
+
+    //Memory: the register is rd, the offset imm or rm << amount. Dual: second register in ra. Multiple: list in imm
+    T_LDR, T_LDRB, T_LDRH, T_LDRSB, T_LDRSH, T_STR, T_STRB, T_STRH,
+    T_LDRD, T_STRD, T_LDM, T_STM,
+    T_LDREX, T_STREX, T_CLREX, //Size in amount. STREX: status register in ra
+    T_TBB, T_TBH,
+
+    //Control: branch offsets are relative to the instruction address + 4
+    T_B, T_BL, T_BX, T_BLX, T_CBZ, T_CBNZ,
+    T_IT, T_NOP, T_WFI, T_SVC, T_BKPT,
+    T_MRS, T_MSR, T_CPS, //Special register in imm, MSR mask and CPS disable bit in amount
+};
+
+enum ThumbShift : Byte
+{
+    TS_LSL, TS_LSR, TS_ASR, TS_ROR, TS_RRX,
+};
+
+enum ThumbOpFlags : Byte
+{
+    TF_SETS = 1 << 0, //Sets the flags
+    TF_SETS_OUTSIDE_IT = 1 << 1, //16-bit encodings: sets the flags unless inside an IT block
+    TF_IMMEDIATE = 1 << 2, //The operand or offset is imm
+    TF_SHIFT_REGISTER = 1 << 3, //rm is shifted by the value of ra
+    TF_INDEX = 1 << 4, //Memory: the offset applies before the access
+    TF_ADD = 1 << 5, //Memory: the offset is added. LDM/STM: increment after, otherwise decrement before
+    TF_WRITEBACK = 1 << 6,
+};
+
+struct ThumbOp
+{
+    Byte opcode;
+    Byte length; //2 or 4, 0 while the slot is not decoded
+    Byte flags; //ThumbOpFlags
+    Byte cycles;
+    Byte rd, rn, rm, ra;
+    Byte shift; //ThumbShift
+    Byte amount;
+    Byte cond; //B<cond>, COND_ALWAYS for everything else
+    Byte carry; //Shifter carry out of a modified immediate, 2 when it leaves C unchanged
+    DWord imm;
+};
+
+struct ThumbCPU
+{
+    //Cortex-M7 memory map, sized like a typical part
+    static constexpr DWord SRAM_BASE = 0x20000000; //DTCM and the SRAMs, as one block
+    static constexpr DWord SRAM_SIZE = 1 << 20;
+    static constexpr DWord FLASH_BASE = 0x08000000;
+    static constexpr DWord FLASH_SIZE = 2 << 20;
+    static constexpr DWord ITCM_FLASH_BASE = 0x00200000; //The same flash, through the ITCM interface
+    static constexpr DWord ITCM_BASE = 0x00000000;
+    static constexpr DWord ITCM_SIZE = 64 << 10;
+
+    static constexpr Byte PAGE_SHIFT = 12;
+    static constexpr DWord PAGE_SIZE = 1 << PAGE_SHIFT;
+    static constexpr DWord PAGE_MASK = PAGE_SIZE - 1;
+    static constexpr DWord OPS_PER_PAGE = PAGE_SIZE / 2; //One slot per halfword
+
+    static constexpr Byte COND_ALWAYS = 14;
+    static constexpr Byte BRANCH_PENALTY = 2; //Pipeline refill
+    static constexpr DWord RESET_LR = 0xFFFFFFFF; //Returning here ends the run
+
+    enum Register
+    {
+        SP = 13,
+        LR = 14,
+        PC = 15,
+    };
+
+    //Special registers (MRS/MSR SYSm)
+    enum SpecialRegister
+    {
+        SYS_APSR = 0,
+        SYS_MSP = 8,
+        SYS_PSP = 9,
+        SYS_PRIMASK = 16,
+        SYS_BASEPRI = 17,
+        SYS_BASEPRI_MAX = 18,
+        SYS_FAULTMASK = 19,
+        SYS_CONTROL = 20,
+    };
+
+    DWord R[16]{}; //R[PC] reads as the address of the current instruction + 4
+    bool n = false, z = false, c = false, v = false, q = false;
+    Byte itState = 0; //ITSTATE: condition of the next instruction in bits 4-7, the rest of the block below
+    DWord pc = 0;
+    DWord primask = 0, basepri = 0, faultmask = 0, control = 0;
+    bool halted = false;
+
+    DWord resetPC = 0; //Set by Load from the vector table
+    DWord resetSP = SRAM_BASE + SRAM_SIZE;
+
+    std::vector<ThumbRegion> regions;
+    std::vector<std::unique_ptr<ThumbOp[]>> pages; //Decoded ops per physical page, allocated on the first fetch
+    PerfCounters perf{};
+    uint64_t decodes = 0; //Including decodes again after invalidation
+    uint64_t unmappedAccesses = 0;
+
+    DWord exclusiveAddress = 0; //Local monitor for LDREX/STREX
+    bool exclusive = false;
+
+    DWord fetchBase = 1; //Guest page of the last fetch (never page aligned when nothing is cached)
+    ThumbOp* fetchOps = nullptr;
+
+    //SRAM first, it takes most of the data accesses
+    ThumbCPU() {
+        regions = {
+            { SRAM_BASE, SRAM_SIZE, FLASH_SIZE + ITCM_SIZE },
+            { FLASH_BASE, FLASH_SIZE, 0 },
+            { ITCM_FLASH_BASE, FLASH_SIZE, 0 },
+            { ITCM_BASE, ITCM_SIZE, FLASH_SIZE },
+        };
+    }
+
+    //Physical store the regions need
+    DWord PhysicalSize() const {
+        DWord size = 0;
+        for (const ThumbRegion& region : regions) {
+            size = std::max(size, region.physical + region.size);
+        }
+        return size;
+    }
+
+    //Host pointer to size bytes at a guest address, nullptr unless they are all inside one region
+    Byte* Translate(Memory& mem, DWord address, DWord size) {
+        for (const ThumbRegion& region : regions) {
+            DWord offset = address - region.base;
+            if (offset < region.size && size <= region.size - offset) {
+                return &mem.Data[region.physical + offset];
+            }
+        }
+        return nullptr;
+    }
+
+    /*
+        Copies the segments of a firmware image to their guest addresses and resets from the vector table,
+        which every Cortex-M linker script places first: the initial SP, then the reset handler. An image
+        without one starts at its entry point with the stack at the top of SRAM
+    */
+    bool Load(const ImageFile& image, Memory& mem) {
+        if (mem.Data.size() < PhysicalSize()) {
+            std::cout << "ERROR: The Thumb memory map needs " << PhysicalSize() << " bytes of physical memory\n";
+            return false;
+        }
+        pages.clear();
+        pages.resize(mem.Data.size() >> PAGE_SHIFT);
+        fetchBase = 1;
+
+        DWord vectorTable = 0xFFFFFFFF;
+        for (const ImageSegment& segment : image.segments) {
+            if (segment.size == 0) {
+                continue;
+            }
+            Byte* target = Translate(mem, segment.address, segment.size);
+            if (!target) {
+                std::cout << "ERROR: Image segment at " << Hex(segment.address) << " is outside the Thumb memory map\n";
+                return false;
+            }
+            if (segment.data) {
+                std::memcpy(target, segment.data, segment.size);
+            }
+            else {
+                std::memset(target, 0, segment.size);
+            }
+            vectorTable = std::min(vectorTable, segment.address);
+        }
+
+        resetSP = SRAM_BASE + SRAM_SIZE;
+        resetPC = image.foreignEntry & ~1u;
+        const Byte* vectors = vectorTable != 0xFFFFFFFF ? Translate(mem, vectorTable, 8) : nullptr;
+        if (vectors) {
+            DWord sp = Read32(vectors);
+            DWord reset = Read32(vectors + 4);
+            if ((reset & 1) && Translate(mem, reset & ~1u, 2) && Translate(mem, sp - 4, 4)) {
+                resetSP = sp;
+                resetPC = reset & ~1u;
+            }
+            else {
+                std::cout << "WARNING: No vector table at " << Hex(vectorTable) << ", starting at " << Hex(resetPC) << "\n";
+            }
+        }
+        Reset();
+        return true;
+    }
+
+    void Reset() {
+        std::memset(R, 0, sizeof(R));
+        n = z = c = v = q = false;
+        itState = 0;
+        primask = basepri = faultmask = control = 0;
+        exclusive = false;
+        halted = false;
+        fetchBase = 1;
+
+        R[SP] = resetSP & ~3u;
+        R[LR] = RESET_LR;
+        pc = resetPC;
+    }
+
+    //Forgets the decoded ops overlapping size bytes at a guest address, after writes made outside Execute
+    void Invalidate(Memory& mem, DWord address, DWord size) {
+        if (const Byte* host = Translate(mem, address, size)) {
+            InvalidatePhysical((DWord)(host - mem.Data.data()), size);
+        }
+    }
+
+    void Execute(i64 cycles, Memory& mem) {
+        if (pages.size() < (mem.Data.size() >> PAGE_SHIFT)) {
+            pages.resize(mem.Data.size() >> PAGE_SHIFT);
+        }
+
+        i64 start = cycles;
+        uint64_t instructions = 0;
+        uint64_t branches = 0;
+
+        while (cycles > 0 && !halted)
+        {
+            const ThumbOp* fetched = Fetch(mem);
+            if (!fetched) {
+                break;
+            }
+            const ThumbOp& op = *fetched;
+
+            R[PC] = pc + 4;
+            DWord sequential = pc + op.length; //A store can clear op (self-modifying code), its fields stay readable
+            DWord next = sequential;
+            cycles -= op.cycles;
+            instructions++;
+
+            //Inside an IT block every instruction is conditional and the 16-bit forms leave the flags alone
+            bool inIT = itState != 0;
+            bool pass = true;
+            if (inIT) {
+                pass = Passed(itState >> 4);
+                itState = (itState & 0x7) ? (itState & 0xE0) | ((itState << 1) & 0x1F) : 0;
+            }
+
+            if (pass) {
+                bool sets = (op.flags & TF_SETS) || ((op.flags & TF_SETS_OUTSIDE_IT) && !inIT);
+                bool carry = c;
+
+                switch (op.opcode)
+                {
+                case T_AND: Logical(op, R[op.rn] & Operand(op, carry), carry, sets, next); break;
+                case T_EOR: Logical(op, R[op.rn] ^ Operand(op, carry), carry, sets, next); break;
+                case T_ORR: Logical(op, R[op.rn] | Operand(op, carry), carry, sets, next); break;
+                case T_ORN: Logical(op, R[op.rn] | ~Operand(op, carry), carry, sets, next); break;
+                case T_BIC: Logical(op, R[op.rn] & ~Operand(op, carry), carry, sets, next); break;
+                case T_MOV: Logical(op, Operand(op, carry), carry, sets, next); break;
+                case T_MVN: Logical(op, ~Operand(op, carry), carry, sets, next); break;
+                case T_TST: Flags(R[op.rn] & Operand(op, carry), carry); break;
+                case T_TEQ: Flags(R[op.rn] ^ Operand(op, carry), carry); break;
+
+                case T_ADD: Arithmetic(op, R[op.rn], Operand(op, carry), false, sets, next); break;
+                case T_ADC: Arithmetic(op, R[op.rn], Operand(op, carry), c, sets, next); break;
+                case T_SUB: Arithmetic(op, R[op.rn], ~Operand(op, carry), true, sets, next); break;
+                case T_SBC: Arithmetic(op, R[op.rn], ~Operand(op, carry), c, sets, next); break;
+                case T_RSB: Arithmetic(op, ~R[op.rn], Operand(op, carry), true, sets, next); break;
+                case T_CMP: AddWithCarry(R[op.rn], ~Operand(op, carry), true, true); break;
+                case T_CMN: AddWithCarry(R[op.rn], Operand(op, carry), false, true); break;
+                case T_ADR: R[op.rd] = (R[PC] & ~3u) + op.imm; break;
+
+                case T_MUL: {
+                    DWord result = R[op.rn] * R[op.rm];
+                    R[op.rd] = result;
+                    if (sets) {
+                        n = result >> 31;
+                        z = result == 0;
+                    }
+                } break;
+                case T_MLA: R[op.rd] = R[op.rn] * R[op.rm] + R[op.ra]; break;
+                case T_MLS: R[op.rd] = R[op.ra] - R[op.rn] * R[op.rm]; break;
+                case T_UMULL: SetLong(op, (uint64_t)R[op.rn] * R[op.rm]); break;
+                case T_SMULL: SetLong(op, (uint64_t)((int64_t)(int32_t)R[op.rn] * (int32_t)R[op.rm])); break;
+                case T_UMLAL: SetLong(op, GetLong(op) + (uint64_t)R[op.rn] * R[op.rm]); break;
+                case T_SMLAL: SetLong(op, GetLong(op) + (uint64_t)((int64_t)(int32_t)R[op.rn] * (int32_t)R[op.rm])); break;
+                case T_UDIV: R[op.rd] = R[op.rm] ? R[op.rn] / R[op.rm] : 0; break; //Divide by zero gives 0 unless trapped (DIV_0_TRP)
+                case T_SDIV: {
+                    int32_t dividend = (int32_t)R[op.rn];
+                    int32_t divisor = (int32_t)R[op.rm];
+                    R[op.rd] = divisor == 0 ? 0
+                        : divisor == -1 ? 0u - (DWord)dividend //INT32_MIN / -1 wraps instead of trapping the host
+                        : (DWord)(dividend / divisor);
+                } break;
+
+                case T_CLZ: R[op.rd] = CountLeadingZeros(R[op.rm]); break;
+                case T_RBIT: {
+                    DWord value = R[op.rm];
+                    DWord result = 0;
+                    for (int bit = 0; bit < 32; bit++) {
+                        result = (result << 1) | ((value >> bit) & 1);
+                    }
+                    R[op.rd] = result;
+                } break;
+                case T_REV: {
+                    DWord value = R[op.rm];
+                    R[op.rd] = (value >> 24) | ((value >> 8) & 0xFF00) | ((value << 8) & 0xFF0000) | (value << 24);
+                } break;
+                case T_REV16: R[op.rd] = ((R[op.rm] >> 8) & 0x00FF00FF) | ((R[op.rm] << 8) & 0xFF00FF00); break;
+                case T_REVSH: R[op.rd] = (DWord)(int16_t)(((R[op.rm] & 0xFF) << 8) | ((R[op.rm] >> 8) & 0xFF)); break;
+                case T_SXTB: R[op.rd] = (DWord)(int8_t)Rotate(R[op.rm], op.amount) + Accumulator(op); break;
+                case T_SXTH: R[op.rd] = (DWord)(int16_t)Rotate(R[op.rm], op.amount) + Accumulator(op); break;
+                case T_UXTB: R[op.rd] = (Rotate(R[op.rm], op.amount) & 0xFF) + Accumulator(op); break;
+                case T_UXTH: R[op.rd] = (Rotate(R[op.rm], op.amount) & 0xFFFF) + Accumulator(op); break;
+
+                case T_MOVT: R[op.rd] = (R[op.rd] & 0xFFFF) | (op.imm << 16); break;
+                case T_BFI: {
+                    DWord mask = WidthMask(op.imm) << op.amount;
+                    R[op.rd] = (R[op.rd] & ~mask) | ((R[op.rn] << op.amount) & mask);
+                } break;
+                case T_BFC: R[op.rd] &= ~(WidthMask(op.imm) << op.amount); break;
+                case T_UBFX: R[op.rd] = (R[op.rn] >> op.amount) & WidthMask(op.imm); break;
+                case T_SBFX: {
+                    DWord field = (R[op.rn] >> op.amount) & WidthMask(op.imm);
+                    DWord sign = 1u << (op.imm - 1);
+                    R[op.rd] = (field ^ sign) - sign;
+                } break;
+                case T_SSAT: {
+                    int64_t value = (int32_t)Shift(R[op.rn], op.shift, op.amount, carry);
+                    int64_t limit = (int64_t)1 << (op.imm - 1);
+                    R[op.rd] = (DWord)Saturate(value, -limit, limit - 1);
+                } break;
+                case T_USAT: {
+                    int64_t value = (int32_t)Shift(R[op.rn], op.shift, op.amount, carry);
+                    R[op.rd] = (DWord)Saturate(value, 0, ((int64_t)1 << op.imm) - 1);
+                } break;
+
+                case T_LDR: LoadSingle(mem, op, 4, false, next); break;
+                case T_LDRB: LoadSingle(mem, op, 1, false, next); break;
+                case T_LDRH: LoadSingle(mem, op, 2, false, next); break;
+                case T_LDRSB: LoadSingle(mem, op, 1, true, next); break;
+                case T_LDRSH: LoadSingle(mem, op, 2, true, next); break;
+                case T_STR: StoreSingle(mem, op, 4); break;
+                case T_STRB: StoreSingle(mem, op, 1); break;
+                case T_STRH: StoreSingle(mem, op, 2); break;
+                case T_LDRD: {
+                    DWord target;
+                    DWord address = Address(op, target);
+                    R[op.rd] = Load(mem, address, 4);
+                    R[op.ra] = Load(mem, address + 4, 4);
+                    if (op.flags & TF_WRITEBACK) {
+                        R[op.rn] = target;
+                    }
+                } break;
+                case T_STRD: {
+                    DWord target;
+                    DWord address = Address(op, target);
+                    Store(mem, address, 4, R[op.rd]);
+                    Store(mem, address + 4, 4, R[op.ra]);
+                    if (op.flags & TF_WRITEBACK) {
+                        R[op.rn] = target;
+                    }
+                } break;
+                case T_LDM: LoadMultiple(mem, op, next); break;
+                case T_STM: StoreMultiple(mem, op); break;
+                case T_LDREX: {
+                    exclusiveAddress = R[op.rn] + op.imm;
+                    exclusive = true;
+                    R[op.rd] = Load(mem, exclusiveAddress, op.amount);
+                } break;
+                case T_STREX: {
+                    DWord address = R[op.rn] + op.imm;
+                    bool owned = exclusive && exclusiveAddress == address;
+                    if (owned) {
+                        Store(mem, address, op.amount, R[op.rd]);
+                    }
+                    R[op.ra] = owned ? 0 : 1;
+                    exclusive = false;
+                } break;
+                case T_CLREX: exclusive = false; break;
+                case T_TBB: next = pc + 4 + 2 * Load(mem, R[op.rn] + R[op.rm], 1); break;
+                case T_TBH: next = pc + 4 + 2 * Load(mem, R[op.rn] + R[op.rm] * 2, 2); break;
+
+                case T_B: {
+                    if (op.cond == COND_ALWAYS || Passed(op.cond)) {
+                        next = pc + 4 + op.imm;
+                    }
+                } break;
+                case T_BL: {
+                    R[LR] = next | 1;
+                    next = pc + 4 + op.imm;
+                } break;
+                case T_BX: BXWritePC(R[op.rm], next); break;
+                case T_BLX: {
+                    DWord target = R[op.rm];
+                    R[LR] = next | 1;
+                    BXWritePC(target, next);
+                } break;
+                case T_CBZ: {
+                    if (R[op.rn] == 0) {
+                        next = pc + 4 + op.imm;
+                    }
+                } break;
+                case T_CBNZ: {
+                    if (R[op.rn] != 0) {
+                        next = pc + 4 + op.imm;
+                    }
+                } break;
+                case T_IT: itState = (Byte)op.imm; break;
+                case T_NOP: break;
+                case T_WFI: {
+                    halted = true;
+                    std::cout << "INFO: WFI at " << Hex(pc) << " with no interrupt source. The Thumb core will now stop\n";
+                } break;
+                case T_SVC: {
+                    halted = true;
+                    std::cout << "INFO: SVC #" << op.imm << " at " << Hex(pc) << ". The Thumb core will now stop\n";
+                } break;
+                case T_BKPT: {
+                    halted = true;
+                    std::cout << "INFO: BKPT #" << op.imm << " at " << Hex(pc) << ". The Thumb core will now stop\n";
+                } break;
+                case T_MRS: R[op.rd] = ReadSpecial(op.imm); break;
+                case T_MSR: WriteSpecial(op.imm, op.amount, R[op.rn]); break;
+                case T_CPS: {
+                    if (op.imm & 2) {
+                        primask = op.amount;
+                    }
+                    if (op.imm & 1) {
+                        faultmask = op.amount;
+                    }
+                } break;
+
+                default: {
+                    halted = true;
+                    std::cout << "ERROR: Undefined Thumb instruction " << Hex(op.imm, op.length * 2) << " at " << Hex(pc) << "\n";
+                } break;
+                }
+            }
+
+            if (next != sequential) {
+                cycles -= BRANCH_PENALTY;
+                branches++;
+            }
+            pc = next;
+        }
+
+        perf.cycles += start - cycles;
+        perf.instructions += instructions;
+        perf.branches += branches;
+    }
+
+    //Decodes the instruction starting with halfword hw1. hw2 is only read when hw1 starts a 32-bit encoding
+    static ThumbOp Decode(Word hw1, Word hw2) {
+        return IsWide(hw1) ? Decode32(hw1, hw2) : Decode16(hw1);
+    }
+
+    static bool IsWide(Word hw) {
+        return (hw >> 11) >= 0x1D;
+    }
+
+    static std::string Hex(DWord value, int digits = 8) {
+        char text[16];
+        std::snprintf(text, sizeof(text), "0x%0*X", digits, value);
+        return text;
+    }
+
+private:
+    static Word Read16(const Byte* p) {
+        return p[0] | (p[1] << 8);
+    }
+    static DWord Read32(const Byte* p) {
+        return Read16(p) | ((DWord)Read16(p + 2) << 16);
+    }
+
+    static DWord Rotate(DWord value, Byte amount) {
+        amount &= 31;
+        return amount ? (value >> amount) | (value << (32 - amount)) : value;
+    }
+    static DWord WidthMask(DWord width) {
+        return width >= 32 ? 0xFFFFFFFF : (1u << width) - 1;
+    }
+    static DWord CountLeadingZeros(DWord value) {
+        DWord count = 0;
+        for (DWord bit = 0x80000000; bit && !(value & bit); bit >>= 1) {
+            count++;
+        }
+        return count;
+    }
+    int64_t Saturate(int64_t value, int64_t low, int64_t high) {
+        if (value < low || value > high) {
+            q = true;
+            return value < low ? low : high;
+        }
+        return value;
+    }
+
+    //Barrel shifter. Immediate LSR/ASR #32 arrive as amount 32, register shifts use the bottom byte of the register
+    static DWord Shift(DWord value, Byte type, DWord amount, bool& carry) {
+        if (type == TS_RRX) {
+            DWord result = ((DWord)carry << 31) | (value >> 1);
+            carry = value & 1;
+            return result;
+        }
+        if (amount == 0) {
+            return value;
+        }
+
+        switch (type)
+        {
+        case TS_LSL:
+            carry = amount <= 32 && ((value >> (32 - amount)) & 1);
+            return amount < 32 ? value << amount : 0;
+        case TS_LSR:
+            carry = amount <= 32 && ((value >> (amount - 1)) & 1);
+            return amount < 32 ? value >> amount : 0;
+        case TS_ASR:
+            if (amount >= 32) {
+                carry = value >> 31;
+                return carry ? 0xFFFFFFFF : 0;
+            }
+            carry = ((int32_t)value >> (amount - 1)) & 1;
+            return (DWord)((int32_t)value >> amount);
+        default: {
+            DWord result = Rotate(value, (Byte)amount);
+            carry = result >> 31;
+            return result;
+        }
+        }
+    }
+
+    DWord Operand(const ThumbOp& op, bool& carry) const {
+        if (op.flags & TF_IMMEDIATE) {
+            if (op.carry != 2) {
+                carry = op.carry;
+            }
+            return op.imm;
+        }
+        DWord amount = op.flags & TF_SHIFT_REGISTER ? R[op.ra] & 0xFF : op.amount;
+        return Shift(R[op.rm], op.shift, amount, carry);
+    }
+    DWord Accumulator(const ThumbOp& op) const {
+        return op.rn == PC ? 0 : R[op.rn];
+    }
+
+    bool Passed(Byte cond) const {
+        bool result;
+        switch (cond >> 1)
+        {
+        case 0: result = z; break; //EQ
+        case 1: result = c; break; //CS
+        case 2: result = n; break; //MI
+        case 3: result = v; break; //VS
+        case 4: result = c && !z; break; //HI
+        case 5: result = n == v; break; //GE
+        case 6: result = n == v && !z; break; //GT
+        default: return true; //AL
+        }
+        return (cond & 1) ? !result : result;
+    }
+
+    void Flags(DWord result, bool carry) {
+        n = result >> 31;
+        z = result == 0;
+        c = carry;
+    }
+    DWord AddWithCarry(DWord x, DWord y, bool carryIn, bool sets) {
+        uint64_t sum = (uint64_t)x + y + carryIn;
+        DWord result = (DWord)sum;
+        if (sets) {
+            n = result >> 31;
+            z = result == 0;
+            c = sum >> 32;
+            v = ((x ^ result) & (y ^ result)) >> 31;
+        }
+        return result;
+    }
+
+    //A data processing result written to PC is a branch (BranchWritePC ignores bit 0)
+    void WriteResult(Byte rd, DWord value, DWord& next) {
+        if (rd == PC) {
+            next = value & ~1u;
+        }
+        else {
+            R[rd] = value;
+        }
+    }
+    void Logical(const ThumbOp& op, DWord result, bool carry, bool sets, DWord& next) {
+        if (sets) {
+            Flags(result, carry);
+        }
+        WriteResult(op.rd, result, next);
+    }
+    void Arithmetic(const ThumbOp& op, DWord x, DWord y, bool carryIn, bool sets, DWord& next) {
+        WriteResult(op.rd, AddWithCarry(x, y, carryIn, sets), next);
+    }
+
+    uint64_t GetLong(const ThumbOp& op) const {
+        return ((uint64_t)R[op.ra] << 32) | R[op.rd];
+    }
+    void SetLong(const ThumbOp& op, uint64_t value) {
+        R[op.rd] = (DWord)value;
+        R[op.ra] = (DWord)(value >> 32);
+    }
+
+    //Interworking branch: M profile cores only run Thumb code, a target with bit 0 clear is an INVSTATE fault
+    void BXWritePC(DWord target, DWord& next) {
+        if (target & 1) {
+            next = target & ~1u;
+            return;
+        }
+        halted = true;
+        next = pc;
+        std::cout << "ERROR: Branch to " << Hex(target) << " at " << Hex(pc) << " leaves Thumb state\n";
+    }
+
+    DWord ReadSpecial(DWord sysm) const {
+        switch (sysm)
+        {
+        case SYS_MSP:
+        case SYS_PSP: return R[SP]; //One stack, CONTROL.SPSEL is not modelled
+        case SYS_PRIMASK: return primask;
+        case SYS_BASEPRI:
+        case SYS_BASEPRI_MAX: return basepri;
+        case SYS_FAULTMASK: return faultmask;
+        case SYS_CONTROL: return control;
+        default: //xPSR views: the flags, IPSR and EPSR read as 0 outside an exception
+            return sysm < 8 ? ((DWord)n << 31) | ((DWord)z << 30) | ((DWord)c << 29) | ((DWord)v << 28) | ((DWord)q << 27) : 0;
+        }
+    }
+    void WriteSpecial(DWord sysm, Byte mask, DWord value) {
+        switch (sysm)
+        {
+        case SYS_MSP:
+        case SYS_PSP: R[SP] = value & ~3u; break;
+        case SYS_PRIMASK: primask = value & 1; break;
+        case SYS_BASEPRI: basepri = value & 0xFF; break;
+        case SYS_BASEPRI_MAX: {
+            value &= 0xFF;
+            if (value && (!basepri || value < basepri)) {
+                basepri = value;
+            }
+        } break;
+        case SYS_FAULTMASK: faultmask = value & 1; break;
+        case SYS_CONTROL: control = value & 3; break;
+        default: {
+            if (sysm < 8 && !(sysm & 4) && (mask & 2)) { //APSR_nzcvq
+                n = value >> 31 & 1;
+                z = value >> 30 & 1;
+                c = value >> 29 & 1;
+                v = value >> 28 & 1;
+                q = value >> 27 & 1;
+            }
+        } break;
+        }
+    }
+
+    //Memory. Unaligned word and halfword accesses are allowed, as with CCR.UNALIGN_TRP clear
+    DWord Load(Memory& mem, DWord address, Byte size) {
+        perf.reads++;
+        const Byte* host = Translate(mem, address, size);
+        if (!host) {
+            unmappedAccesses++;
+            return 0;
+        }
+        return size == 4 ? Read32(host) : size == 2 ? Read16(host) : host[0];
+    }
+    void Store(Memory& mem, DWord address, Byte size, DWord value) {
+        perf.writes++;
+        Byte* host = Translate(mem, address, size);
+        if (!host) {
+            unmappedAccesses++;
+            return;
+        }
+        for (Byte i = 0; i < size; i++) {
+            host[i] = (value >> (i * 8)) & 0xFF;
+        }
+
+        //A 32-bit op starting in the page before can cover the first halfword of this one
+        DWord physical = (DWord)(host - mem.Data.data());
+        DWord page = physical >> PAGE_SHIFT;
+        if (pages[page] || ((physical & PAGE_MASK) < 2 && page > 0 && pages[page - 1])) {
+            InvalidatePhysical(physical, size);
+        }
+    }
+
+    DWord Address(const ThumbOp& op, DWord& target) const {
+        DWord base = op.rn == PC ? R[PC] & ~3u : R[op.rn]; //Literal accesses use the word aligned PC
+        DWord offset = op.flags & TF_IMMEDIATE ? op.imm : R[op.rm] << op.amount;
+        target = op.flags & TF_ADD ? base + offset : base - offset;
+        return op.flags & TF_INDEX ? target : base;
+    }
+    void LoadSingle(Memory& mem, const ThumbOp& op, Byte size, bool sign, DWord& next) {
+        DWord target;
+        DWord value = Load(mem, Address(op, target), size);
+        if (sign) {
+            value = size == 1 ? (DWord)(int8_t)value : (DWord)(int16_t)value;
+        }
+        if (op.flags & TF_WRITEBACK) {
+            R[op.rn] = target;
+        }
+        if (op.rd == PC) {
+            BXWritePC(value, next);
+        }
+        else {
+            R[op.rd] = value;
+        }
+    }
+    void StoreSingle(Memory& mem, const ThumbOp& op, Byte size) {
+        DWord target;
+        Store(mem, Address(op, target), size, R[op.rd]);
+        if (op.flags & TF_WRITEBACK) {
+            R[op.rn] = target;
+        }
+    }
+
+    //Registers go to ascending addresses whichever the direction, the lowest register to the lowest address
+    void LoadMultiple(Memory& mem, const ThumbOp& op, DWord& next) {
+        DWord count = CountRegisters(op.imm);
+        DWord base = R[op.rn];
+        DWord address = op.flags & TF_ADD ? base : base - count * 4;
+        DWord loadedPC = 0;
+        for (Byte r = 0; r < 16; r++) {
+            if (op.imm & (1 << r)) {
+                DWord value = Load(mem, address, 4);
+                address += 4;
+                if (r == PC) {
+                    loadedPC = value;
+                }
+                else {
+                    R[r] = value;
+                }
+            }
+        }
+        if ((op.flags & TF_WRITEBACK) && !(op.imm & (1 << op.rn))) {
+            R[op.rn] = op.flags & TF_ADD ? base + count * 4 : base - count * 4;
+        }
+        if (op.imm & (1 << PC)) {
+            BXWritePC(loadedPC, next);
+        }
+    }
+    void StoreMultiple(Memory& mem, const ThumbOp& op) {
+        DWord count = CountRegisters(op.imm);
+        DWord base = R[op.rn];
+        DWord address = op.flags & TF_ADD ? base : base - count * 4;
+        for (Byte r = 0; r < 16; r++) {
+            if (op.imm & (1 << r)) {
+                Store(mem, address, 4, R[r]);
+                address += 4;
+            }
+        }
+        if (op.flags & TF_WRITEBACK) {
+            R[op.rn] = op.flags & TF_ADD ? base + count * 4 : base - count * 4;
+        }
+    }
+    static DWord CountRegisters(DWord list) {
+        DWord count = 0;
+        for (; list; list &= list - 1) {
+            count++;
+        }
+        return count;
+    }
+
+    //Decoded op at pc, decoding it on the first visit. nullptr (and halted) when pc is not mapped
+    const ThumbOp* Fetch(Memory& mem) {
+        DWord base = pc & ~PAGE_MASK;
+        if (base != fetchBase) {
+            const Byte* host = Translate(mem, base, PAGE_SIZE);
+            if (!host) {
+                halted = true;
+                if (pc == (RESET_LR & ~1u)) {
+                    std::cout << "INFO: The reset handler returned. The Thumb core will now stop\n";
+                }
+                else {
+                    std::cout << "ERROR: Thumb fetch from unmapped address " << Hex(pc) << "\n";
+                }
+                return nullptr;
+            }
+
+            DWord page = (DWord)(host - mem.Data.data()) >> PAGE_SHIFT;
+            if (!pages[page]) {
+                pages[page].reset(new ThumbOp[OPS_PER_PAGE]());
+            }
+            fetchBase = base;
+            fetchOps = pages[page].get();
+        }
+
+        ThumbOp* op = &fetchOps[(pc & PAGE_MASK) >> 1];
+        if (op->length == 0) {
+            Word hw1 = Read16(Translate(mem, pc, 2));
+            const Byte* second = IsWide(hw1) ? Translate(mem, pc + 2, 2) : nullptr;
+            *op = Decode(hw1, second ? Read16(second) : 0);
+            if (IsWide(hw1) && !second) {
+                op->opcode = T_UNDEFINED;
+            }
+            decodes++;
+        }
+        return op;
+    }
+
+    //Clears the decoded slots overlapping size bytes of the physical store, and a 32-bit op just before them
+    void InvalidatePhysical(DWord physical, DWord size) {
+        if (size == 0) {
+            return;
+        }
+        DWord first = physical >= 2 ? (physical - 2) & ~1u : 0;
+        DWord last = physical + size - 1;
+        for (DWord page = first >> PAGE_SHIFT; page <= (last >> PAGE_SHIFT) && page < pages.size(); page++) {
+            if (!pages[page]) {
+                continue;
+            }
+            DWord from = std::max(first, page << PAGE_SHIFT);
+            DWord to = std::min(last, (page << PAGE_SHIFT) | PAGE_MASK);
+            for (DWord at = from & ~1u; at <= to; at += 2) {
+                pages[page][(at & PAGE_MASK) >> 1].length = 0;
+            }
+        }
+    }
+
+    /*
+        Decoders. Each takes the encoding apart once, into the fields the executor reads
+    */
+    static ThumbOp NewOp(Byte length) {
+        ThumbOp op{};
+        op.length = length;
+        op.cycles = 1;
+        op.cond = COND_ALWAYS;
+        op.carry = 2;
+        return op;
+    }
+    static ThumbOp Undefined(ThumbOp op, DWord encoding) {
+        op.opcode = T_UNDEFINED;
+        op.imm = encoding;
+        return op;
+    }
+    static DWord SignExtend(DWord value, Byte bits) {
+        DWord sign = 1u << (bits - 1);
+        return (value ^ sign) - sign;
+    }
+
+    //Immediate shifts: LSR/ASR #0 mean #32 and ROR #0 means RRX
+    static void ImmediateShift(ThumbOp& op, Byte type, Byte amount) {
+        op.shift = type;
+        op.amount = amount;
+        if (amount == 0 && (type == TS_LSR || type == TS_ASR)) {
+            op.amount = 32;
+        }
+        else if (amount == 0 && type == TS_ROR) {
+            op.shift = TS_RRX;
+        }
+    }
+
+    //ThumbExpandImm_C: a byte pattern repeated across the word, or a rotated 8-bit value
+    static void ModifiedImmediate(ThumbOp& op, DWord imm12) {
+        DWord imm8 = imm12 & 0xFF;
+        op.flags |= TF_IMMEDIATE;
+        if ((imm12 >> 10) == 0) {
+            switch ((imm12 >> 8) & 3)
+            {
+            case 0: op.imm = imm8; break;
+            case 1: op.imm = (imm8 << 16) | imm8; break;
+            case 2: op.imm = (imm8 << 24) | (imm8 << 8); break;
+            default: op.imm = imm8 * 0x01010101; break;
+            }
+            return;
+        }
+        op.imm = Rotate(0x80 | (imm12 & 0x7F), (Byte)(imm12 >> 7));
+        op.carry = op.imm >> 31;
+    }
+
+    //Shared by the shifted register and modified immediate forms. The compare forms write no register (Rd is PC)
+    static bool DataProcessing(ThumbOp& op, Byte opc, bool sets, Byte rn, Byte rd) {
+        op.rd = rd;
+        op.rn = rn;
+        if (sets) {
+            op.flags |= TF_SETS;
+        }
+        bool compare = rd == PC && sets;
+        switch (opc)
+        {
+        case 0x0: op.opcode = compare ? T_TST : T_AND; break;
+        case 0x1: op.opcode = T_BIC; break;
+        case 0x2: op.opcode = rn == PC ? T_MOV : T_ORR; break;
+        case 0x3: op.opcode = rn == PC ? T_MVN : T_ORN; break;
+        case 0x4: op.opcode = compare ? T_TEQ : T_EOR; break;
+        case 0x8: op.opcode = compare ? T_CMN : T_ADD; break;
+        case 0xA: op.opcode = T_ADC; break;
+        case 0xB: op.opcode = T_SBC; break;
+        case 0xD: op.opcode = compare ? T_CMP : T_SUB; break;
+        case 0xE: op.opcode = T_RSB; break;
+        default: return false; //PKHBT/PKHTB (DSP) and reserved
+        }
+        return true;
+    }
+
+    static ThumbOp Decode16(Word hw) {
+        ThumbOp op = NewOp(2);
+        Byte low = hw & 7;
+        Byte middle = (hw >> 3) & 7;
+        Byte high = (hw >> 8) & 7;
+
+        static const Byte registerOffsetOps[8] = { T_STR, T_STRH, T_STRB, T_LDRSB, T_LDR, T_LDRH, T_LDRB, T_LDRSH };
+        static const Byte dataProcessingOps[16] = { T_AND, T_EOR, T_MOV, T_MOV, T_MOV, T_ADC, T_SBC, T_MOV, T_TST, T_RSB, T_CMP, T_CMN, T_ORR, T_MUL, T_BIC, T_MVN };
+
+        switch (hw >> 11)
+        {
+        case 0x00: //LSL, LSR, ASR (immediate)
+        case 0x01:
+        case 0x02:
+            op.opcode = T_MOV;
+            op.rd = low;
+            op.rm = middle;
+            op.flags = TF_SETS_OUTSIDE_IT;
+            ImmediateShift(op, hw >> 11, (hw >> 6) & 0x1F);
+            break;
+        case 0x03: //ADD, SUB (register or 3-bit immediate)
+            op.opcode = (hw & 0x0200) ? T_SUB : T_ADD;
+            op.rd = low;
+            op.rn = middle;
+            op.flags = TF_SETS_OUTSIDE_IT;
+            if (hw & 0x0400) {
+                op.imm = (hw >> 6) & 7;
+                op.flags |= TF_IMMEDIATE;
+            }
+            else {
+                op.rm = (hw >> 6) & 7;
+            }
+            break;
+        case 0x04: //MOV, CMP, ADD, SUB (8-bit immediate)
+        case 0x05:
+        case 0x06:
+        case 0x07: {
+            static const Byte immediateOps[4] = { T_MOV, T_CMP, T_ADD, T_SUB };
+            op.opcode = immediateOps[(hw >> 11) & 3];
+            op.rd = op.rn = high;
+            op.imm = hw & 0xFF;
+            op.flags = TF_IMMEDIATE | (op.opcode == T_CMP ? TF_SETS : TF_SETS_OUTSIDE_IT);
+        } break;
+        case 0x08:
+            if (!(hw & 0x0400)) { //Data processing (register)
+                Byte opc = (hw >> 6) & 0xF;
+                op.opcode = dataProcessingOps[opc];
+                op.rd = op.rn = low;
+                op.rm = middle;
+                op.flags = (op.opcode == T_TST || op.opcode == T_CMP || op.opcode == T_CMN) ? TF_SETS : TF_SETS_OUTSIDE_IT;
+                switch (opc)
+                {
+                case 0x2: //LSL, LSR, ASR, ROR (register): Rdn shifted by Rm
+                case 0x3:
+                case 0x4:
+                case 0x7:
+                    op.rm = low;
+                    op.ra = middle;
+                    op.shift = opc == 0x7 ? TS_ROR : opc - 0x2;
+                    op.flags |= TF_SHIFT_REGISTER;
+                    break;
+                case 0x9: //RSB Rd, Rn, #0
+                    op.rn = middle;
+                    op.flags |= TF_IMMEDIATE;
+                    break;
+                case 0xD: //MUL Rdm, Rn, Rdm
+                    op.rn = middle;
+                    op.rm = low;
+                    break;
+                }
+            }
+            else if (((hw >> 8) & 3) == 3) { //BX, BLX
+                op.opcode = (hw & 0x80) ? T_BLX : T_BX;
+                op.rm = (hw >> 3) & 0xF;
+            }
+            else { //ADD, CMP, MOV with high registers
+                static const Byte specialOps[3] = { T_ADD, T_CMP, T_MOV };
+                op.opcode = specialOps[(hw >> 8) & 3];
+                op.rd = op.rn = ((hw >> 4) & 8) | low;
+                op.rm = (hw >> 3) & 0xF;
+                op.flags = op.opcode == T_CMP ? TF_SETS : 0;
+            }
+            break;
+        case 0x09: //LDR (literal)
+            op.opcode = T_LDR;
+            op.rd = high;
+            op.rn = PC;
+            op.imm = (hw & 0xFF) << 2;
+            op.flags = TF_IMMEDIATE | TF_INDEX | TF_ADD;
+            break;
+        case 0x0A: //Load/store (register offset)
+        case 0x0B:
+            op.opcode = registerOffsetOps[(hw >> 9) & 7];
+            op.rd = low;
+            op.rn = middle;
+            op.rm = (hw >> 6) & 7;
+            op.flags = TF_INDEX | TF_ADD;
+            break;
+        case 0x0C: //STR, LDR, STRB, LDRB, STRH, LDRH (immediate)
+        case 0x0D:
+        case 0x0E:
+        case 0x0F:
+        case 0x10:
+        case 0x11: {
+            static const Byte immediateOffsetOps[6] = { T_STR, T_LDR, T_STRB, T_LDRB, T_STRH, T_LDRH };
+            static const Byte scales[6] = { 2, 2, 0, 0, 1, 1 };
+            Byte form = (hw >> 11) - 0x0C;
+            op.opcode = immediateOffsetOps[form];
+            op.rd = low;
+            op.rn = middle;
+            op.imm = ((hw >> 6) & 0x1F) << scales[form];
+            op.flags = TF_IMMEDIATE | TF_INDEX | TF_ADD;
+        } break;
+        case 0x12: //STR, LDR (SP relative)
+        case 0x13:
+            op.opcode = (hw & 0x0800) ? T_LDR : T_STR;
+            op.rd = high;
+            op.rn = SP;
+            op.imm = (hw & 0xFF) << 2;
+            op.flags = TF_IMMEDIATE | TF_INDEX | TF_ADD;
+            break;
+        case 0x14: //ADR
+            op.opcode = T_ADR;
+            op.rd = high;
+            op.imm = (hw & 0xFF) << 2;
+            break;
+        case 0x15: //ADD Rd, SP, #imm
+            op.opcode = T_ADD;
+            op.rd = high;
+            op.rn = SP;
+            op.imm = (hw & 0xFF) << 2;
+            op.flags = TF_IMMEDIATE;
+            break;
+        case 0x16:
+        case 0x17:
+            return DecodeMisc16(op, hw);
+        case 0x18: //STM, LDM (increment after)
+        case 0x19:
+            op.opcode = (hw & 0x0800) ? T_LDM : T_STM;
+            op.rn = high;
+            op.imm = hw & 0xFF;
+            op.flags = TF_ADD;
+            if (op.opcode == T_STM || !(op.imm & (1 << high))) {
+                op.flags |= TF_WRITEBACK; //LDM writes back only when Rn is not loaded
+            }
+            break;
+        case 0x1A: //B<cond>, UDF, SVC
+        case 0x1B: {
+            Byte cond = (hw >> 8) & 0xF;
+            if (cond == 0xE) {
+                return Undefined(op, hw);
+            }
+            if (cond == 0xF) {
+                op.opcode = T_SVC;
+                op.imm = hw & 0xFF;
+                break;
+            }
+            op.opcode = T_B;
+            op.cond = cond;
+            op.imm = SignExtend((hw & 0xFF) << 1, 9);
+        } break;
+        case 0x1C: //B
+            op.opcode = T_B;
+            op.imm = SignExtend((hw & 0x7FF) << 1, 12);
+            break;
+        default:
+            return Undefined(op, hw);
+        }
+
+        if (op.opcode >= T_LDR && op.opcode <= T_STRH) {
+            op.cycles = op.opcode <= T_LDRSH ? 2 : 1;
+        }
+        else if (op.opcode == T_LDM || op.opcode == T_STM) {
+            op.cycles = 1 + (Byte)CountRegisters(op.imm);
+        }
+        return op;
+    }
+
+    //1011 xxxx: stack adjust, CBZ/CBNZ, extend, PUSH/POP, CPS, REV, BKPT, IT and hints
+    static ThumbOp DecodeMisc16(ThumbOp op, Word hw) {
+        Byte low = hw & 7;
+        Byte middle = (hw >> 3) & 7;
+
+        if ((hw & 0xFF00) == 0xB000) { //ADD, SUB SP, SP, #imm
+            op.opcode = (hw & 0x80) ? T_SUB : T_ADD;
+            op.rd = op.rn = SP;
+            op.imm = (hw & 0x7F) << 2;
+            op.flags = TF_IMMEDIATE;
+        }
+        else if ((hw & 0xF500) == 0xB100) { //CBZ, CBNZ
+            op.opcode = (hw & 0x0800) ? T_CBNZ : T_CBZ;
+            op.rn = low;
+            op.imm = (((hw >> 9) & 1) << 6) | (((hw >> 3) & 0x1F) << 1);
+        }
+        else if ((hw & 0xFF00) == 0xB200) { //SXTH, SXTB, UXTH, UXTB
+            static const Byte extendOps[4] = { T_SXTH, T_SXTB, T_UXTH, T_UXTB };
+            op.opcode = extendOps[(hw >> 6) & 3];
+            op.rd = low;
+            op.rm = middle;
+            op.rn = PC; //No accumulator
+        }
+        else if ((hw & 0xFE00) == 0xB400) { //PUSH: STMDB SP!
+            op.opcode = T_STM;
+            op.rn = SP;
+            op.imm = (hw & 0xFF) | ((hw & 0x100) << 6); //M bit: LR
+            op.flags = TF_WRITEBACK;
+            op.cycles = 1 + (Byte)CountRegisters(op.imm);
+        }
+        else if ((hw & 0xFFEC) == 0xB660) { //CPSIE, CPSID
+            op.opcode = T_CPS;
+            op.amount = (hw >> 4) & 1;
+            op.imm = hw & 3; //I (PRIMASK) and F (FAULTMASK)
+        }
+        else if ((hw & 0xFF00) == 0xBA00 && ((hw >> 6) & 3) != 2) { //REV, REV16, REVSH
+            static const Byte reverseOps[4] = { T_REV, T_REV16, T_UNDEFINED, T_REVSH };
+            op.opcode = reverseOps[(hw >> 6) & 3];
+            op.rd = low;
+            op.rm = middle;
+        }
+        else if ((hw & 0xFE00) == 0xBC00) { //POP: LDMIA SP!
+            op.opcode = T_LDM;
+            op.rn = SP;
+            op.imm = (hw & 0xFF) | ((hw & 0x100) << 7); //P bit: PC
+            op.flags = TF_ADD | TF_WRITEBACK;
+            op.cycles = 1 + (Byte)CountRegisters(op.imm);
+        }
+        else if ((hw & 0xFF00) == 0xBE00) {
+            op.opcode = T_BKPT;
+            op.imm = hw & 0xFF;
+        }
+        else if ((hw & 0xFF00) == 0xBF00) {
+            if (hw & 0xF) { //IT: firstcond and mask are the initial ITSTATE
+                op.opcode = T_IT;
+                op.imm = hw & 0xFF;
+            }
+            else { //NOP, YIELD, WFE, WFI, SEV
+                op.opcode = ((hw >> 4) & 0xF) == 3 ? T_WFI : T_NOP;
+            }
+        }
+        else {
+            return Undefined(op, hw);
+        }
+        return op;
+    }
+
+    static ThumbOp Decode32(Word hw1, Word hw2) {
+        ThumbOp op = NewOp(4);
+        DWord encoding = ((DWord)hw1 << 16) | hw2;
+        Byte rn = hw1 & 0xF;
+        Byte rt = hw2 >> 12;
+        Byte rd = (hw2 >> 8) & 0xF;
+        Byte rm = hw2 & 0xF;
+
+        if ((hw1 & 0xFE40) == 0xE800) { //Load/store multiple
+            Byte mode = (hw1 >> 7) & 3;
+            if (mode != 1 && mode != 2) {
+                return Undefined(op, encoding); //SRS/RFE are not in the M profile
+            }
+            op.opcode = (hw1 & 0x10) ? T_LDM : T_STM;
+            op.rn = rn;
+            op.imm = hw2;
+            op.flags = (mode == 1 ? TF_ADD : 0) | ((hw1 & 0x20) ? TF_WRITEBACK : 0);
+            op.cycles = 1 + (Byte)CountRegisters(op.imm);
+        }
+        else if ((hw1 & 0xFE40) == 0xE840) { //Load/store dual or exclusive, table branch
+            Byte op1 = (hw1 >> 7) & 3;
+            Byte op2 = (hw1 >> 4) & 3;
+            Byte op3 = (hw2 >> 4) & 0xF;
+            op.rn = rn;
+            if (op1 == 0 && op2 == 0) { //STREX Rd, Rt, [Rn, #imm]
+                op.opcode = T_STREX;
+                op.rd = rt;
+                op.ra = rd;
+                op.imm = (hw2 & 0xFF) << 2;
+                op.amount = 4;
+            }
+            else if (op1 == 0 && op2 == 1) { //LDREX
+                op.opcode = T_LDREX;
+                op.rd = rt;
+                op.imm = (hw2 & 0xFF) << 2;
+                op.amount = 4;
+                op.cycles = 2;
+            }
+            else if ((op1 & 2) || (op2 & 2)) { //LDRD, STRD
+                op.opcode = (hw1 & 0x10) ? T_LDRD : T_STRD;
+                op.rd = rt;
+                op.ra = rd;
+                op.imm = (hw2 & 0xFF) << 2;
+                op.flags = TF_IMMEDIATE | ((hw1 & 0x100) ? TF_INDEX : 0) | ((hw1 & 0x80) ? TF_ADD : 0) | ((hw1 & 0x20) ? TF_WRITEBACK : 0);
+                op.cycles = op.opcode == T_LDRD ? 3 : 2;
+            }
+            else if (op1 == 1 && op2 == 1 && op3 <= 1) { //TBB, TBH
+                op.opcode = op3 ? T_TBH : T_TBB;
+                op.rm = rm;
+                op.cycles = 2;
+            }
+            else if (op1 == 1 && (op3 == 4 || op3 == 5)) { //LDREXB, LDREXH, STREXB, STREXH
+                op.opcode = op2 ? T_LDREX : T_STREX;
+                op.rd = rt;
+                op.ra = rm;
+                op.amount = op3 == 4 ? 1 : 2;
+            }
+            else {
+                return Undefined(op, encoding);
+            }
+        }
+        else if ((hw1 & 0xFE00) == 0xEA00) { //Data processing (shifted register)
+            op.rm = rm;
+            ImmediateShift(op, (hw2 >> 4) & 3, (((hw2 >> 12) & 7) << 2) | ((hw2 >> 6) & 3));
+            if (!DataProcessing(op, (hw1 >> 5) & 0xF, (hw1 & 0x10) != 0, rn, rd)) {
+                return Undefined(op, encoding);
+            }
+        }
+        else if ((hw1 & 0xF800) == 0xF000 && !(hw2 & 0x8000)) { //Data processing (immediate)
+            DWord imm12 = (((hw1 >> 10) & 1) << 11) | (((hw2 >> 12) & 7) << 8) | (hw2 & 0xFF);
+            if (!(hw1 & 0x0200)) {
+                ModifiedImmediate(op, imm12);
+                if (!DataProcessing(op, (hw1 >> 5) & 0xF, (hw1 & 0x10) != 0, rn, rd)) {
+                    return Undefined(op, encoding);
+                }
+            }
+            else if (!DecodePlainImmediate(op, hw1, hw2, imm12)) {
+                return Undefined(op, encoding);
+            }
+        }
+        else if ((hw1 & 0xF800) == 0xF000) { //Branches and miscellaneous control
+            if (!DecodeBranch(op, hw1, hw2)) {
+                return Undefined(op, encoding);
+            }
+        }
+        else if ((hw1 & 0xFE00) == 0xF800) { //Load/store single
+            if (!DecodeLoadStore(op, hw1, hw2)) {
+                return Undefined(op, encoding);
+            }
+        }
+        else if ((hw1 & 0xFF00) == 0xFA00 && (hw2 & 0xF000) == 0xF000) { //Data processing (register)
+            Byte op1 = (hw1 >> 4) & 0xF;
+            Byte op2 = (hw2 >> 4) & 0xF;
+            op.rd = rd;
+            if (op1 < 8 && op2 == 0) { //LSL, LSR, ASR, ROR (register)
+                op.opcode = T_MOV;
+                op.rm = rn;
+                op.ra = rm;
+                op.shift = op1 >> 1;
+                op.flags = TF_SHIFT_REGISTER | ((op1 & 1) ? TF_SETS : 0);
+            }
+            else if ((op1 == 0 || op1 == 1 || op1 == 4 || op1 == 5) && (op2 & 8)) { //SXTAH, UXTAH, SXTAB, UXTAB and the plain extends
+                static const Byte extendOps[6] = { T_SXTH, T_UXTH, T_UNDEFINED, T_UNDEFINED, T_SXTB, T_UXTB };
+                op.opcode = extendOps[op1];
+                op.rn = rn;
+                op.rm = rm;
+                op.amount = (op2 & 3) * 8;
+            }
+            else if (op1 == 9 && (op2 & 0xC) == 8) { //REV, REV16, RBIT, REVSH
+                static const Byte reverseOps[4] = { T_REV, T_REV16, T_RBIT, T_REVSH };
+                op.opcode = reverseOps[op2 & 3];
+                op.rm = rm;
+            }
+            else if (op1 == 0xB && op2 == 8) {
+                op.opcode = T_CLZ;
+                op.rm = rm;
+            }
+            else {
+                return Undefined(op, encoding); //Parallel and saturating arithmetic, SEL (DSP)
+            }
+        }
+        else if ((hw1 & 0xFF80) == 0xFB00) { //Multiply, multiply accumulate
+            Byte op1 = (hw1 >> 4) & 7;
+            Byte op2 = (hw2 >> 4) & 3;
+            if (op1 != 0 || op2 > 1) {
+                return Undefined(op, encoding); //SMULxy, SMLAxy and the other DSP multiplies
+            }
+            op.opcode = op2 ? T_MLS : rt == PC ? T_MUL : T_MLA;
+            op.rd = rd;
+            op.rn = rn;
+            op.rm = rm;
+            op.ra = rt;
+        }
+        else if ((hw1 & 0xFF80) == 0xFB80) { //Long multiply, divide
+            Byte op1 = (hw1 >> 4) & 7;
+            Byte op2 = (hw2 >> 4) & 0xF;
+            op.rn = rn;
+            op.rm = rm;
+            if ((op1 == 1 || op1 == 3) && op2 == 0xF) {
+                op.opcode = op1 == 1 ? T_SDIV : T_UDIV;
+                op.rd = rd;
+                op.cycles = 6; //2 - 12 on the M7, depending on the operands
+            }
+            else if (op2 == 0 && (op1 == 0 || op1 == 2 || op1 == 4 || op1 == 6)) {
+                static const Byte longOps[4] = { T_SMULL, T_UMULL, T_SMLAL, T_UMLAL };
+                op.opcode = longOps[op1 >> 1];
+                op.rd = rt;
+                op.ra = rd;
+                op.cycles = 2;
+            }
+            else {
+                return Undefined(op, encoding);
+            }
+        }
+        else {
+            return Undefined(op, encoding); //Coprocessor and floating point
+        }
+
+        if (op.opcode == T_UNDEFINED) {
+            return Undefined(op, encoding);
+        }
+        return op;
+    }
+
+    //ADDW, SUBW, ADR, MOVW, MOVT, SSAT, USAT, SBFX, UBFX, BFI, BFC
+    static bool DecodePlainImmediate(ThumbOp& op, Word hw1, Word hw2, DWord imm12) {
+        Byte rn = hw1 & 0xF;
+        Byte lsb = (((hw2 >> 12) & 7) << 2) | ((hw2 >> 6) & 3);
+        Byte field = hw2 & 0x1F;
+        Byte opc = (hw1 >> 4) & 0x1F;
+        op.rd = (hw2 >> 8) & 0xF;
+        op.rn = rn;
+
+        switch (opc)
+        {
+        case 0x00: //ADDW, ADR
+        case 0x0A: { //SUBW, ADR
+            bool subtract = opc == 0x0A;
+            if (rn == PC) {
+                op.opcode = T_ADR;
+                op.imm = subtract ? 0u - imm12 : imm12;
+            }
+            else {
+                op.opcode = subtract ? T_SUB : T_ADD;
+                op.imm = imm12;
+                op.flags = TF_IMMEDIATE;
+            }
+        } break;
+        case 0x04: //MOVW
+            op.opcode = T_MOV;
+            op.imm = ((DWord)rn << 12) | imm12;
+            op.flags = TF_IMMEDIATE;
+            break;
+        case 0x0C:
+            op.opcode = T_MOVT;
+            op.imm = ((DWord)rn << 12) | imm12;
+            break;
+        case 0x10: //SSAT LSL
+        case 0x12: //SSAT ASR (SSAT16 without a shift)
+            if (opc == 0x12 && lsb == 0) {
+                return false;
+            }
+            op.opcode = T_SSAT;
+            ImmediateShift(op, opc == 0x12 ? TS_ASR : TS_LSL, lsb);
+            op.imm = field + 1;
+            break;
+        case 0x18: //USAT LSL
+        case 0x1A: //USAT ASR (USAT16 without a shift)
+            if (opc == 0x1A && lsb == 0) {
+                return false;
+            }
+            op.opcode = T_USAT;
+            ImmediateShift(op, opc == 0x1A ? TS_ASR : TS_LSL, lsb);
+            op.imm = field;
+            break;
+        case 0x14:
+        case 0x1C: //SBFX, UBFX: field is width - 1
+            if (lsb + field > 31) {
+                return false;
+            }
+            op.opcode = opc == 0x1C ? T_UBFX : T_SBFX;
+            op.amount = lsb;
+            op.imm = field + 1;
+            break;
+        case 0x16: //BFI, BFC: field is the msb
+            if (field < lsb) {
+                return false;
+            }
+            op.opcode = rn == PC ? T_BFC : T_BFI;
+            op.amount = lsb;
+            op.imm = field - lsb + 1;
+            break;
+        default:
+            return false;
+        }
+        return true;
+    }
+
+    //B, B<cond>, BL (32-bit), MSR, MRS, barriers and hints
+    static bool DecodeBranch(ThumbOp& op, Word hw1, Word hw2) {
+        DWord s = (hw1 >> 10) & 1;
+        DWord j1 = (hw2 >> 13) & 1;
+        DWord j2 = (hw2 >> 11) & 1;
+
+        if (hw2 & 0x1000) { //B.W, BL: J1 and J2 are inverted into I1 and I2 unless they match S
+            DWord i1 = !(j1 ^ s);
+            DWord i2 = !(j2 ^ s);
+            op.opcode = (hw2 & 0x4000) ? T_BL : T_B;
+            op.imm = SignExtend((s << 24) | (i1 << 23) | (i2 << 22) | ((DWord)(hw1 & 0x3FF) << 12) | ((DWord)(hw2 & 0x7FF) << 1), 25);
+            return true;
+        }
+        if (hw2 & 0x4000) {
+            return false; //BLX (immediate) switches to ARM state, which the M profile does not have
+        }
+
+        if (((hw1 >> 7) & 7) != 7) { //B<cond>.W
+            op.opcode = T_B;
+            op.cond = (hw1 >> 6) & 0xF;
+            op.imm = SignExtend((s << 20) | (j2 << 19) | (j1 << 18) | ((DWord)(hw1 & 0x3F) << 12) | ((DWord)(hw2 & 0x7FF) << 1), 21);
+            return true;
+        }
+
+        switch ((hw1 >> 4) & 0x7F)
+        {
+        case 0x38: //MSR
+        case 0x39:
+            op.opcode = T_MSR;
+            op.rn = hw1 & 0xF;
+            op.imm = hw2 & 0xFF;
+            op.amount = (hw2 >> 10) & 3;
+            return true;
+        case 0x3A: //NOP.W, YIELD.W, WFE.W, WFI.W, SEV.W
+            op.opcode = (hw2 & 0xFF) == 3 ? T_WFI : T_NOP;
+            return true;
+        case 0x3B: //CLREX, DSB, DMB, ISB: one core and no write buffer, the barriers have nothing to wait for
+            op.opcode = ((hw2 >> 4) & 0xF) == 2 ? T_CLREX : T_NOP;
+            return true;
+        case 0x3E: //MRS
+        case 0x3F:
+            op.opcode = T_MRS;
+            op.rd = (hw2 >> 8) & 0xF;
+            op.imm = hw2 & 0xFF;
+            return true;
+        default:
+            return false; //UDF.W and the unallocated space
+        }
+    }
+
+    //LDR, LDRB, LDRH, LDRSB, LDRSH, STR, STRB, STRH: literal, imm12, imm8 with index/writeback, register
+    static bool DecodeLoadStore(ThumbOp& op, Word hw1, Word hw2) {
+        bool load = (hw1 & 0x10) != 0;
+        bool sign = (hw1 & 0x100) != 0;
+        Byte size = (hw1 >> 5) & 3;
+        if (size == 3 || (sign && (!load || size == 2))) {
+            return false;
+        }
+
+        static const Byte loadOps[3] = { T_LDRB, T_LDRH, T_LDR };
+        static const Byte signedLoadOps[2] = { T_LDRSB, T_LDRSH };
+        static const Byte storeOps[3] = { T_STRB, T_STRH, T_STR };
+        op.opcode = !load ? storeOps[size] : sign ? signedLoadOps[size] : loadOps[size];
+        op.rd = hw2 >> 12;
+        op.rn = hw1 & 0xF;
+        op.cycles = load ? 2 : 1;
+
+        if (op.rn == PC) { //Literal: bit 7 is U
+            if (!load) {
+                return false;
+            }
+            op.imm = hw2 & 0xFFF;
+            op.flags = TF_IMMEDIATE | TF_INDEX | ((hw1 & 0x80) ? TF_ADD : 0);
+        }
+        else if (hw1 & 0x80) { //Positive 12-bit offset
+            op.imm = hw2 & 0xFFF;
+            op.flags = TF_IMMEDIATE | TF_INDEX | TF_ADD;
+        }
+        else if (hw2 & 0x800) { //8-bit offset with P, U and W. PUW = 110 are the unprivileged forms, the same here
+            if (!(hw2 & 0x400) && !(hw2 & 0x100)) {
+                return false;
+            }
+            op.imm = hw2 & 0xFF;
+            op.flags = TF_IMMEDIATE | ((hw2 & 0x400) ? TF_INDEX : 0) | ((hw2 & 0x200) ? TF_ADD : 0) | ((hw2 & 0x100) ? TF_WRITEBACK : 0);
+        }
+        else if ((hw2 & 0xFC0) == 0) { //Register, LSL #0-3
+            op.rm = hw2 & 0xF;
+            op.amount = (hw2 >> 4) & 3;
+            op.flags = TF_INDEX | TF_ADD;
+        }
+        else {
+            return false;
+        }
+
+        if (load && op.rd == PC && size != 2) {
+            op.opcode = T_NOP; //PLD, PLI: no cache to warm
+        }
+        return true;
+    }
+};
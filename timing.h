@@ -0,0 +1,336 @@
+#pragma once
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "types.h"
+
+/*
+    Optional memory timing model, in the style of the Cortex-M7 memory system: an instruction cache and a
+    data cache in front of main memory, plus tightly coupled memories (TCMs) and I/O that bypass them
+
+    Every guest access is looked up by its CPU address in the region table:
+        cached regions:   a cache hit is free, a miss costs the cache's missPenalty plus the region's wait states.
+                          The data cache is write-back/write-allocate, evicting a dirty line costs another missPenalty
+        uncached regions: every access costs the region's wait states (0 for a TCM)
+
+    Lines are tagged by physical address, so switching a bank register never returns stale hits. Accesses
+    made behind the CPU's back (DMA, host pokes) are not snooped by the caches.
+    The extra cycles are charged on top of the usual 1 cycle per byte. With no model attached the CPU
+    runs its untimed loop and pays nothing for this
+
+    Config file format (text, one record per line, '#' starts a comment):
+        icache <size> <lineSize> <ways> <missPenalty>     size 0 disables the cache
+        dcache <size> <lineSize> <ways> <missPenalty>
+        memory <waitStates>                               main memory, anything no region covers (cached)
+        region <name> <start> <end> <waitStates> cached|uncached
+                                                          end is exclusive, later regions win where they overlap.
+                                                          A config with region lines replaces the default TCMs
+*/
+enum AccessKind : Byte
+{
+    ACCESS_FETCH,
+    ACCESS_READ,
+    ACCESS_WRITE,
+};
+
+struct CacheConfig
+{
+    DWord size; //Bytes, 0 disables the cache
+    Word lineSize; //Bytes
+    Byte ways;
+    Byte missPenalty; //Cycles to refill a line
+};
+
+struct TimingRegion
+{
+    std::string name;
+    Word start;
+    DWord end; //Exclusive, so a region can reach 0xFFFF
+    Byte waitStates; //Extra cycles per access, added to the miss penalty when cached
+    bool cached;
+};
+
+struct TimingConfig
+{
+    CacheConfig icache{ 4096, 32, 2, 8 };
+    CacheConfig dcache{ 4096, 32, 4, 8 };
+    Byte memoryWaitStates = 2; //Main memory, anything not covered by a region
+    std::vector<TimingRegion> regions{
+        { "ITCM", 0x0000, 0x1000, 0, false },
+        { "DTCM", 0xE000, 0xFF00, 0, false },
+        { "I/O", 0xFF00, 0x10000, 1, false },
+    };
+
+    bool Load(const std::string& path) {
+        std::ifstream file(path);
+        if (!file) {
+            std::cout << "ERROR: Could not open timing config " << path << "\n";
+            return false;
+        }
+
+        bool replacedRegions = false;
+        std::string line;
+        for (int lineNumber = 1; std::getline(file, line); lineNumber++) {
+            line = line.substr(0, line.find('#'));
+            std::istringstream in(line);
+            std::string kind;
+            if (!(in >> kind)) {
+                continue;
+            }
+
+            bool ok = false;
+            if (kind == "icache" || kind == "dcache") {
+                DWord size, lineSize, ways, penalty;
+                if (in >> size >> lineSize >> ways >> penalty) {
+                    CacheConfig& cache = kind == "icache" ? icache : dcache;
+                    cache = CacheConfig{ size, (Word)lineSize, (Byte)ways, (Byte)penalty };
+                    ok = true;
+                }
+            }
+            else if (kind == "region") {
+                TimingRegion region;
+                std::string start, end, mode;
+                DWord waitStates;
+                char* startEnd = nullptr;
+                char* endEnd = nullptr;
+                if (in >> region.name >> start >> end >> waitStates >> mode && (mode == "cached" || mode == "uncached")) {
+                    DWord first = std::strtoul(start.c_str(), &startEnd, 0);
+                    DWord last = std::strtoul(end.c_str(), &endEnd, 0);
+                    ok = *startEnd == 0 && *endEnd == 0 && first < last && first < 0x10000;
+                }
+                if (ok) {
+                    if (!replacedRegions) {
+                        regions.clear();
+                        replacedRegions = true;
+                    }
+                    region.start = (Word)std::strtoul(start.c_str(), nullptr, 0);
+                    region.end = std::min<DWord>(std::strtoul(end.c_str(), nullptr, 0), 0x10000);
+                    region.waitStates = (Byte)waitStates;
+                    region.cached = mode == "cached";
+                    regions.push_back(region);
+                }
+            }
+            else if (kind == "memory") {
+                DWord waitStates;
+                if (in >> waitStates) {
+                    memoryWaitStates = (Byte)waitStates;
+                    ok = true;
+                }
+            }
+
+            if (!ok) {
+                std::cout << "ERROR: " << path << ":" << lineNumber << ": Bad timing config line\n";
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+//Set associative cache with LRU replacement. Only tags are kept, the data always lives in Memory
+struct CacheModel
+{
+    struct Line
+    {
+        DWord tag; //Physical line number
+        uint64_t lastUse;
+        bool valid;
+        bool dirty;
+    };
+
+    CacheConfig config{};
+    DWord sets = 0;
+    uint64_t tick = 0;
+    std::vector<Line> lines;
+
+    void Configure(const CacheConfig& cache, const char* name) {
+        config = cache;
+        sets = 0;
+        lines.clear();
+
+        if (cache.size == 0) {
+            return;
+        }
+        if (cache.lineSize == 0 || cache.ways == 0 || cache.size % (cache.lineSize * cache.ways) != 0) {
+            std::cout << "WARNING: " << name << " size must be a multiple of lineSize * ways, the cache is disabled\n";
+            config.size = 0;
+            return;
+        }
+
+        sets = cache.size / (cache.lineSize * cache.ways);
+        lines.assign(sets * cache.ways, Line{});
+    }
+
+    bool Enabled() const {
+        return sets != 0;
+    }
+
+    void Invalidate() {
+        std::fill(lines.begin(), lines.end(), Line{});
+    }
+
+    //Returns the refill cycles: 0 on a hit
+    i64 Access(DWord physical, bool write, i64 refill, bool& hit) {
+        DWord tag = physical / config.lineSize;
+        Line* set = &lines[(tag % sets) * config.ways];
+        Line* victim = set;
+        tick++;
+
+        for (Byte way = 0; way < config.ways; way++) {
+            Line& line = set[way];
+            if (line.valid && line.tag == tag) {
+                line.lastUse = tick;
+                line.dirty |= write;
+                hit = true;
+                return 0;
+            }
+            if (!line.valid || (victim->valid && line.lastUse < victim->lastUse)) {
+                victim = &line;
+            }
+        }
+
+        hit = false;
+        i64 stall = refill;
+        if (victim->valid && victim->dirty) {
+            stall += config.missPenalty; //Write the old line back first
+        }
+        *victim = Line{ tag, tick, true, write };
+        return stall;
+    }
+};
+
+struct TimingCounters
+{
+    uint64_t fetches;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t stalls; //Extra cycles on top of 1 per byte
+};
+
+struct PCCounters
+{
+    DWord accesses;
+    DWord misses;
+    DWord stalls;
+};
+
+struct TimingModel
+{
+    static constexpr Byte MEMORY_REGION = 0; //Index of the implicit main memory region
+
+    std::vector<TimingRegion> regions;
+    std::vector<Byte> regionAt; //Per CPU address: index into regions
+    CacheModel icache;
+    CacheModel dcache;
+
+    std::vector<TimingCounters> counters; //Per region
+    std::vector<PCCounters> pcCounters; //Per instruction address
+
+    TimingModel(const TimingConfig& config = TimingConfig{}) {
+        Configure(config);
+    }
+
+    void Configure(const TimingConfig& config) {
+        regions.clear();
+        regions.push_back({ "memory", 0x0000, 0x10000, config.memoryWaitStates, true });
+        regions.insert(regions.end(), config.regions.begin(), config.regions.end());
+        if (regions.size() > 256) {
+            std::cout << "WARNING: Only the first 255 timing regions are used\n";
+            regions.resize(256);
+        }
+
+        regionAt.assign(0x10000, (Byte)MEMORY_REGION);
+        for (size_t i = 1; i < regions.size(); i++) {
+            for (DWord address = regions[i].start; address < regions[i].end; address++) {
+                regionAt[address] = (Byte)i;
+            }
+        }
+
+        icache.Configure(config.icache, "I-cache");
+        dcache.Configure(config.dcache, "D-cache");
+        ResetCounters();
+    }
+
+    void ResetCounters() {
+        counters.assign(regions.size(), TimingCounters{});
+        pcCounters.assign(0x10000, PCCounters{});
+    }
+
+    //Returns the stall cycles for one byte access made by the instruction at pc
+    i64 Access(Word pc, Word address, DWord physical, AccessKind kind) {
+        Byte index = regionAt[address];
+        const TimingRegion& region = regions[index];
+        TimingCounters& count = counters[index];
+        PCCounters& pcCount = pcCounters[pc];
+
+        switch (kind)
+        {
+        case ACCESS_FETCH: count.fetches++; break;
+        case ACCESS_READ: count.reads++; break;
+        default: count.writes++; break;
+        }
+        pcCount.accesses++;
+
+        i64 stall = region.waitStates;
+        CacheModel& cache = kind == ACCESS_FETCH ? icache : dcache;
+        if (region.cached && cache.Enabled()) {
+            bool hit;
+            stall = cache.Access(physical, kind == ACCESS_WRITE, cache.config.missPenalty + region.waitStates, hit);
+            if (hit) {
+                count.hits++;
+            }
+            else {
+                count.misses++;
+                pcCount.misses++;
+            }
+        }
+
+        count.stalls += stall;
+        pcCount.stalls += (DWord)stall;
+        return stall;
+    }
+
+    void Report(std::ostream& out, size_t topCount = 10) const {
+        out << "Timing: I-cache " << icache.config.size << " B, D-cache " << dcache.config.size << " B\n";
+        for (size_t i = 0; i < regions.size(); i++) {
+            const TimingRegion& region = regions[i];
+            const TimingCounters& count = counters[i];
+            if (count.fetches + count.reads + count.writes == 0) {
+                continue;
+            }
+
+            out << "  " << region.name << (region.cached ? " (cached)" : " (uncached)")
+                << ": fetches " << count.fetches << ", reads " << count.reads << ", writes " << count.writes;
+            if (region.cached) {
+                out << ", hits " << count.hits << ", misses " << count.misses;
+            }
+            out << ", stall cycles " << count.stalls << "\n";
+        }
+
+        std::vector<Word> pcs;
+        for (DWord pc = 0; pc < pcCounters.size(); pc++) {
+            if (pcCounters[pc].stalls) {
+                pcs.push_back((Word)pc);
+            }
+        }
+        std::sort(pcs.begin(), pcs.end(), [this](Word a, Word b) { return pcCounters[a].stalls > pcCounters[b].stalls; });
+        if (pcs.size() > topCount) {
+            pcs.resize(topCount);
+        }
+
+        for (Word pc : pcs) {
+            const PCCounters& pcCount = pcCounters[pc];
+            char hex[8];
+            std::snprintf(hex, sizeof(hex), "0x%04X", pc);
+            out << "  PC " << hex << ": accesses " << pcCount.accesses << ", misses " << pcCount.misses
+                << ", stall cycles " << pcCount.stalls << "\n";
+        }
+    }
+};
@@ -0,0 +1,8 @@
+#pragma once
+#include <cstdint>
+
+typedef uint8_t Byte;
+typedef uint16_t Word;
+typedef uint32_t DWord;
+
+typedef int64_t i64;